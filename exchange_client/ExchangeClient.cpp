@@ -3,6 +3,9 @@
 #include "../socklib/EventService.h"
 #include "../socklib/TcpSocket.h"
 #include "../socklib/ByteBuffer.h"
+#include "../socklib/SendQueue.h"
+#include "../socklib/Framing.h"
+#include "../socklib/ShmTransport.h"
 
 namespace agpc {
 
@@ -19,8 +22,12 @@ namespace agpc {
     class Exchange : public EventNode {
     public:
 
-        Exchange(int exch_num, int port)
-                : exch_num_(exch_num), port_(port), gen_(rd_()), distr_(1, 1000) {
+        // format FORMAT_DELTA_VARINT or FORMAT_TAGGED is asked of the server first; the client waits for the server
+        // to echo the request, so only use them against a server that negotiates. ascending sends a sorted file,
+        // as the exchanges in the README keep, for SortServer -M.
+        Exchange(int exch_num, int port, WireFormat format, bool ascending = false)
+                : gen_(rd_()), distr_(1, 1000), port_(port), exch_num_(exch_num),
+                  negotiating_(format != FORMAT_FIXED), format_(format), ascending_(ascending) {
         }
 
         void start() {
@@ -31,11 +38,36 @@ namespace agpc {
             sock_.create();
             sock_.connect(addr_);
 
+            if (negotiating_) {
+                FormatRequest request;
+                request.magic_ = FormatRequest::MAGIC;
+                request.format_ = format_;
+                sendQueue_.putBytes(request);
+            }
+
             eventService_.registerHandler(sock_.getFD(), this);
             running_ = true;
             eventService_.poll();
         }
 
+        // co-located server: the same batches go through a shared memory ring, no event loop needed
+        void start_shm(const std::string &path) {
+            ShmProducer producer;
+            producer.connect(path);
+
+            IncomingMessage msgs[MSGS_PER_WRITE];
+            while (!stop_) {
+                int count = 0;
+                while (count < MSGS_PER_WRITE && !stop_) {
+                    msgs[count].exchangeNumber_ = exch_num_;
+                    msgs[count].value_ = next_value();
+                    ++count;
+                }
+                producer.push(msgs, count);
+            }
+            producer.close();
+        }
+
         void onRead() override {
             recvBuffer_.compact();
 
@@ -44,7 +76,21 @@ namespace agpc {
             if (bytes == -1) {
                 std::cout << "server disconnected " << sock_.getFD() << std::endl;
                 eventService_.removeFD(sock_.getFD());
+                eventService_.stop();
+                return;
             }
+
+            recvBuffer_.wAdvance(bytes);
+            if (negotiating_ && recvBuffer_.rSize() >= FormatRequest::LENGTH) {
+                FormatRequest reply;
+                recvBuffer_.read(reply);
+                if (reply.magic_ != FormatRequest::MAGIC || reply.format_ != format_) {
+                    format_ = FORMAT_FIXED;
+                }
+                negotiating_ = false;
+                eventService_.updateHandler(sock_.getFD(), this);
+            }
+            recvBuffer_.clear();
         }
 
         void onWrite() override {
@@ -52,38 +98,129 @@ namespace agpc {
             send();
         }
 
-        bool isWriter() override {
+        bool isReader() override {
             return true;
         }
 
+        // while waiting for the server's answer there is nothing to write once the request is out
+        bool isWriter() override {
+            return !negotiating_ || !sendQueue_.empty();
+        }
+
+        // generates the next batch only once the previous one is fully written, so the whole batch goes out
+        // in one sendmsg and nothing is dropped when the socket buffer fills up
         void send() {
+            if (negotiating_) {
+                if (sendQueue_.flush(sock_) < 0) {
+                    std::cout << "send failed, server disconnected " << sock_.getFD() << std::endl;
+                    eventService_.removeFD(sock_.getFD());
+                    eventService_.stop();
+                } else if (sendQueue_.empty()) {
+                    eventService_.updateHandler(sock_.getFD(), this);
+                }
+                return;
+            }
 
-            for(int n=0; n<5; ++n) {
-                OutgoingMessage omsg;
-                omsg.exchangeNumber_ = exch_num_;
+            if (sendQueue_.empty() && !stop_ && format_ == FORMAT_TAGGED) {
+                send_tagged();
+            }
 
-                if(curent_count_ < stop_after_max_) {
-                    omsg.value_ = distr_(gen_);
-                }else{
-                    omsg.value_ = 0;
-                    stop_ = true;
+            if (sendQueue_.empty() && !stop_ && format_ == FORMAT_DELTA_VARINT) {
+                int64_t values[MSGS_PER_WRITE];
+                int count = 0;
+                while (count < MSGS_PER_WRITE && !stop_) {
+                    values[count++] = next_value();
                 }
 
-                curent_count_++;
-                sock_.send(reinterpret_cast<char *>(&omsg), omsg.LENGTH, 0);
-
-                if(stop_)
-                {
-                    eventService_.removeFD(sock_.getFD());
-                    sock_.close();
-                    eventService_.stop();
+                char packet[BatchPacketHeader::MAX_PACKET];
+                sendQueue_.append(packet, encodeBatchPacket(exch_num_, values, count, packet));
+            }
 
+            if (sendQueue_.empty() && !stop_) {
+                for (int n = 0; n < MSGS_PER_WRITE && !stop_; ++n) {
+                    OutgoingMessage omsg;
+                    omsg.exchangeNumber_ = exch_num_;
+                    omsg.value_ = next_value();
+                    sendQueue_.putBytes(omsg);
                 }
             }
+
+            if (sendQueue_.flush(sock_) < 0) {
+                std::cout << "send failed, server disconnected " << sock_.getFD() << std::endl;
+                sendQueue_.clear();
+                stop_ = true;
+            }
+
+            if (stop_ && sendQueue_.empty()) {
+                eventService_.removeFD(sock_.getFD());
+                sock_.close();
+                eventService_.stop();
+            }
         }
 
      protected:
 
+        enum {
+            MSGS_PER_WRITE = 64,
+            HEARTBEAT_EVERY = 1024,
+            // every REPLAY_EVERY values the last REPLAY are sent again after a SequenceReset, as a reconnecting
+            // exchange would; the server drops the repeats
+            REPLAY_EVERY = 10000,
+            REPLAY = 16
+        };
+
+        void send_tagged() {
+            char frames[(MSGS_PER_WRITE + REPLAY) * ExchangeFraming::FrameSize<IncomingMessage>::VALUE +
+                        ExchangeFraming::FrameSize<Heartbeat>::VALUE +
+                        ExchangeFraming::FrameSize<SequenceReset>::VALUE];
+            size_t length = 0;
+
+            for (int n = 0; n < MSGS_PER_WRITE && !stop_; ++n) {
+                if (sent_ % HEARTBEAT_EVERY == 0) {
+                    Heartbeat heartbeat;
+                    heartbeat.exchangeNumber_ = exch_num_;
+                    length += ExchangeFraming::encode(heartbeat, frames + length);
+                }
+
+                IncomingMessage msg;
+                msg.exchangeNumber_ = exch_num_;
+                msg.value_ = next_value();
+                length += ExchangeFraming::encode(msg, frames + length);
+                recent_[sent_ % REPLAY] = msg.value_;
+                ++sent_;
+
+                if (sent_ % REPLAY_EVERY == 0 && !stop_) {
+                    SequenceReset reset;
+                    reset.exchangeNumber_ = exch_num_;
+                    reset.nextSequence_ = sent_ - REPLAY;
+                    length += ExchangeFraming::encode(reset, frames + length);
+                    for (uint64_t seq = sent_ - REPLAY; seq < sent_; ++seq) {
+                        msg.value_ = recent_[seq % REPLAY];
+                        length += ExchangeFraming::encode(msg, frames + length);
+                    }
+                }
+            }
+
+            sendQueue_.append(frames, length);
+        }
+
+        static_assert(static_cast<int>(MSGS_PER_WRITE) <= static_cast<int>(BatchPacketHeader::MAX_VALUES), "a batch must fit in one packet");
+
+        int64_t next_value() {
+            int64_t value = 0;
+            if (curent_count_ < stop_after_max_ && ascending_) {
+                value = last_;
+                last_ += distr_(gen_) % 4;
+            } else if (curent_count_ < stop_after_max_) {
+                value = distr_(gen_);
+            } else {
+                stop_ = true;
+            }
+
+            curent_count_++;
+            return value;
+        }
+
         std::random_device rd_;
         std::mt19937 gen_;
         std::uniform_int_distribution<> distr_;
@@ -95,9 +232,18 @@ namespace agpc {
         TcpSocket sock_;
         EventService eventService_;
         ByteBuffer<1024> recvBuffer_;
+        SendQueue<> sendQueue_;
         int stop_after_max_{50000};
         int curent_count_{0};
         bool stop_{false};
+        bool negotiating_;
+        WireFormat format_;
+        bool ascending_;
+        // ascending values start at 1, 0 ends the stream
+        int64_t last_{1};
+        // tagged: values sent so far and the last REPLAY of them
+        uint64_t sent_{0};
+        int64_t recent_[REPLAY];
     };
 }
 
@@ -105,17 +251,40 @@ using namespace agpc;
 
 int main(int argc, char *argv[]) {
 
-    if (argc != 3) {
-        throw std::runtime_error("usage : ./Exchange <id> <port_number> ");
+    const char *usage = "usage : ./Exchange <id> <port_number|shm:socket_path> [varint | tagged] [ascending]";
+    if (argc < 3 || argc > 5) {
+        throw std::runtime_error(usage);
+    }
+
+    WireFormat format = FORMAT_FIXED;
+    bool ascending = false;
+    for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "varint") {
+            format = FORMAT_DELTA_VARINT;
+        } else if (arg == "tagged") {
+            format = FORMAT_TAGGED;
+        } else if (arg == "ascending") {
+            ascending = true;
+        } else {
+            throw std::runtime_error(usage);
+        }
     }
 
     std::string port_num_str = argv[2];
     std::string exch_num_str = argv[1];
 
-    int port_num = std::stoi(port_num_str);
     int exch_num = std::stoi(exch_num_str);
 
-    Exchange e(exch_num, port_num);
+    if (port_num_str.compare(0, 4, "shm:") == 0) {
+        Exchange e(exch_num, 0, FORMAT_FIXED, ascending);
+        e.start_shm(port_num_str.substr(4));
+        return 0;
+    }
+
+    int port_num = std::stoi(port_num_str);
+
+    Exchange e(exch_num, port_num, format, ascending);
     e.start();
 
 }
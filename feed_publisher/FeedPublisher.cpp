@@ -0,0 +1,218 @@
+#include <cstdint>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+#include "../socklib/EventService.h"
+#include "../socklib/TcpSocket.h"
+#include "../socklib/UdpSocket.h"
+#include "../socklib/ClientConnection.h"
+
+// multicasts the values of N exchanges as sequenced FeedPacketHeader datagrams, skipping one in k datagrams at
+// random to simulate loss, and serves the TCP retransmit requests of the receivers. for loopback tests of
+// SortServer -m / -R.
+
+namespace agpc {
+
+    class FeedPublisher : public EventNode {
+    public:
+        typedef ClientConnectionT<FeedPublisher, ByteBuffer<1024>, FixedFraming<RetransmitRequest> > ClientConnection;
+
+        enum {
+            VALUES_PER_PACKET = 64,
+            HEARTBEATS = 5
+        };
+
+        // ascending exchanges publish sorted values, for SortServer -M
+        FeedPublisher(const sockaddr_in &group, const in_addr &iface, int recoveryPort, int exchanges,
+                      int64_t messages, int dropEvery, bool ascending = false)
+                : group_(group), iface_(iface), recoveryPort_(recoveryPort), dropEvery_(dropEvery),
+                  history_(exchanges) {
+            std::mt19937 gen(std::random_device{}());
+            std::uniform_int_distribution<> distr(1, 1000);
+            for (std::vector<int64_t> &values : history_) {
+                int64_t last = 1;
+                for (int64_t m = 0; m < messages; ++m) {
+                    if (ascending) {
+                        values.push_back(last);
+                        last += distr(gen) % 4;
+                    } else {
+                        values.push_back(distr(gen));
+                    }
+                }
+                values.push_back(0);
+            }
+        }
+
+        ~FeedPublisher() {
+            for (ClientConnection *c : clients_) {
+                delete c;
+            }
+        }
+
+        void run() {
+            sockaddr_in addr;
+            std::memset(&addr, '\0', sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_ANY);
+            addr.sin_port = htons(recoveryPort_);
+
+            sock_.create();
+            sock_.setReuseAddr(true);
+            sock_.bind(addr);
+            sock_.listen(16);
+            eventService_.registerHandler(sock_.getFD(), this);
+
+            std::thread publisher(&FeedPublisher::publish, this);
+            eventService_.poll();
+            publisher.join();
+
+            eventService_.removeFD(sock_.getFD());
+            sock_.close();
+            std::cout << "published " << sent_ << " datagrams, dropped " << dropped_ << ", retransmitted "
+                      << retransmitted_ << " values" << std::endl;
+        }
+
+        void onRead() override {
+            TcpSocket client_socket;
+            while (sock_.accept(client_socket)) {
+                clients_.push_back(new ClientConnection(eventService_, client_socket, this));
+            }
+        }
+
+        void onAccept(int fd) override {
+            TcpSocket client_socket;
+            client_socket.setFD(fd);
+            clients_.push_back(new ClientConnection(eventService_, client_socket, this));
+        }
+
+        bool isReader() override { return true; }
+
+        bool isAcceptor() override { return true; }
+
+        void onMsg(const RetransmitRequest &req, ClientConnection *conn) {
+            if (req.exchangeNumber_ < 0 || static_cast<size_t>(req.exchangeNumber_) >= history_.size())
+                return;
+
+            const std::vector<int64_t> &values = history_[req.exchangeNumber_];
+            uint64_t end = req.sequence_ + req.count_;
+            if (end > values.size())
+                end = values.size();
+
+            for (uint64_t seq = req.sequence_; seq < end; seq += FeedPacketHeader::MAX_VALUES) {
+                FeedPacketHeader header;
+                header.exchangeNumber_ = req.exchangeNumber_;
+                header.sequence_ = seq;
+                header.count_ = static_cast<uint32_t>(end - seq < FeedPacketHeader::MAX_VALUES
+                                                      ? end - seq : static_cast<uint64_t>(FeedPacketHeader::MAX_VALUES));
+                conn->sendBytes(header);
+                conn->send(reinterpret_cast<const char *>(&values[seq]), header.count_ * sizeof(int64_t));
+                retransmitted_ += header.count_;
+            }
+        }
+
+        void flush() {}
+
+        void onDisconnect(ClientConnection * /*conn*/) {}
+
+    protected:
+
+        // round robin over the exchanges, one packet each, from its own thread. the history is read only by now.
+        void publish() {
+            UdpSocket udp;
+            udp.create();
+            udp.setMulticastInterface(iface_);
+            udp.setMulticastLoop(true);
+            udp.setMulticastTtl(1);
+
+            std::mt19937 gen(std::random_device{}());
+            std::uniform_int_distribution<> drop(1, dropEvery_ > 0 ? dropEvery_ : 1);
+
+            char datagram[FeedPacketHeader::MAX_DATAGRAM];
+            bool more = true;
+            for (uint64_t seq = 0; more; seq += VALUES_PER_PACKET) {
+                more = false;
+                for (size_t exch = 0; exch < history_.size(); ++exch) {
+                    const std::vector<int64_t> &values = history_[exch];
+                    if (seq >= values.size())
+                        continue;
+                    more = true;
+
+                    FeedPacketHeader header;
+                    header.exchangeNumber_ = static_cast<int32_t>(exch);
+                    header.sequence_ = seq;
+                    header.count_ = static_cast<uint32_t>(values.size() - seq < VALUES_PER_PACKET
+                                                          ? values.size() - seq : static_cast<size_t>(VALUES_PER_PACKET));
+                    std::memcpy(datagram, &header, sizeof(header));
+                    std::memcpy(datagram + sizeof(header), &values[seq], header.count_ * sizeof(int64_t));
+
+                    if (dropEvery_ > 0 && drop(gen) == 1) {
+                        ++dropped_;
+                        continue;
+                    }
+                    udp.sendTo(datagram, sizeof(header) + header.count_ * sizeof(int64_t), group_);
+                    ++sent_;
+                }
+                // keep a loopback receiver from being overrun
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+
+            // heartbeats carry the next sequence number, so a receiver notices a lost last packet
+            for (int h = 0; h < HEARTBEATS; ++h) {
+                for (size_t exch = 0; exch < history_.size(); ++exch) {
+                    FeedPacketHeader header;
+                    header.exchangeNumber_ = static_cast<int32_t>(exch);
+                    header.sequence_ = history_[exch].size();
+                    header.count_ = 0;
+                    udp.sendTo(reinterpret_cast<const char *>(&header), sizeof(header), group_);
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+
+            // leave time for the last retransmit requests
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            udp.close();
+            eventService_.post([this]() { eventService_.stop(); });
+        }
+
+        EventService eventService_;
+        TcpSocket sock_;
+        sockaddr_in group_;
+        in_addr iface_;
+        int recoveryPort_;
+        int dropEvery_;
+        std::vector<std::vector<int64_t> > history_;
+        std::vector<ClientConnection *> clients_;
+        uint64_t sent_{0};
+        uint64_t dropped_{0};
+        uint64_t retransmitted_{0};
+    };
+}
+
+using namespace agpc;
+
+int main(int argc, char *argv[]) {
+    if (argc < 5 || argc > 8) {
+        throw std::runtime_error("usage : ./FeedPublisher <group:port> <recovery_port> <exchanges> "
+                                 "<messages_per_exchange> [drop_one_in] [iface_addr] [ascending]");
+    }
+
+    sockaddr_in group = parseEndpoint(argv[1]);
+    int recoveryPort = std::stoi(argv[2]);
+    int exchanges = std::stoi(argv[3]);
+    int64_t messages = std::stoll(argv[4]);
+    int dropEvery = argc > 5 ? std::stoi(argv[5]) : 0;
+
+    in_addr iface;
+    if (inet_pton(AF_INET, argc > 6 ? argv[6] : "127.0.0.1", &iface) != 1) {
+        throw std::runtime_error("bad interface address");
+    }
+
+    bool ascending = argc > 7 && std::string(argv[7]) == "ascending";
+    if (argc > 7 && !ascending) {
+        throw std::runtime_error("expected ascending, got " + std::string(argv[7]));
+    }
+
+    FeedPublisher publisher(group, iface, recoveryPort, exchanges, messages, dropEvery, ascending);
+    publisher.run();
+}
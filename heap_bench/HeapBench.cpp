@@ -0,0 +1,419 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <chrono>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../sort_server/dary_heap.h"
+#include "../sort_server/loser_tree.h"
+#include "../sort_server/radix_heap.h"
+#include "../sort_server/radix_sort.h"
+#include "../sort_server/spill_runs.h"
+
+// runs SortServer's value distributions through the heap family, the radix sorts and the spilling sort and
+// reports ns per item, fastest last.
+// every result is compared with std::sort's, which also keeps the work from being optimised away, and any
+// mismatch fails the run.
+
+namespace agpc {
+
+    enum class Distribution {
+        // 1..1000, what ExchangeClient sends
+        Exchange,
+        Uniform,
+        // already sorted, as the exchanges' files are
+        Ascending,
+        // -1000..1000, across the sign bit the radix keys flip
+        Signed
+    };
+
+    static const char *name(Distribution dist) {
+        switch (dist) {
+            case Distribution::Exchange:
+                return "exchange";
+            case Distribution::Uniform:
+                return "uniform";
+            case Distribution::Ascending:
+                return "ascending";
+            case Distribution::Signed:
+                return "signed";
+        }
+        return "";
+    }
+
+    static std::vector<int64_t> make_values(Distribution dist, size_t n, uint32_t seed) {
+        std::mt19937_64 gen(seed);
+        std::uniform_int_distribution<int64_t> exchange(1, 1000);
+        std::uniform_int_distribution<int64_t> around_zero(-1000, 1000);
+        std::vector<int64_t> values(n);
+        int64_t next = 0;
+        for (size_t i = 0; i < n; ++i) {
+            switch (dist) {
+                case Distribution::Exchange:
+                    values[i] = exchange(gen);
+                    break;
+                case Distribution::Uniform:
+                    values[i] = static_cast<int64_t>(gen());
+                    break;
+                case Distribution::Ascending:
+                    next += exchange(gen) % 4;
+                    values[i] = next;
+                    break;
+                case Distribution::Signed:
+                    values[i] = around_zero(gen);
+                    break;
+            }
+        }
+        return values;
+    }
+
+    typedef std::chrono::steady_clock clock;
+
+    static double ns_per_item(clock::time_point start, size_t items) {
+        return std::chrono::duration<double, std::nano>(clock::now() - start).count() / items;
+    }
+
+    static std::vector<int64_t> sorted(std::vector<int64_t> values) {
+        std::sort(values.begin(), values.end());
+        return values;
+    }
+
+    // out holds exactly the values of expected, which is ascending, largest first
+    static bool descending(const std::vector<int64_t> &out, const std::vector<int64_t> &expected) {
+        return out.size() == expected.size() && std::equal(out.begin(), out.end(), expected.rbegin());
+    }
+
+    // everything in, everything out largest first, as a SortServer flush does
+    template <typename HEAP>
+    static double drain(const std::vector<int64_t> &values, const std::vector<int64_t> &expected, bool &ok) {
+        std::vector<int64_t> out;
+        out.reserve(values.size());
+
+        clock::time_point start = clock::now();
+        HEAP heap;
+        heap.push_range(values.begin(), values.end());
+        heap.pop_n(values.size(), std::back_inserter(out));
+        double ns = ns_per_item(start, values.size());
+
+        ok = descending(out, expected);
+        return ns;
+    }
+
+    struct Candidate {
+        const char *name;
+        double ns;
+        bool ok;
+    };
+
+    static size_t failures = 0;
+
+    static void report(const std::string &test, const std::vector<Candidate> &candidates) {
+        const Candidate *fastest = nullptr;
+        for (const Candidate &c : candidates) {
+            std::cout << test << "  " << c.name << ": " << c.ns << " ns/item" << (c.ok ? "" : "  WRONG OUTPUT")
+                      << std::endl;
+            if (!c.ok) {
+                ++failures;
+            }
+            if (c.ok && (!fastest || c.ns < fastest->ns)) {
+                fastest = &c;
+            }
+        }
+        if (fastest) {
+            std::cout << test << "  fastest: " << fastest->name << std::endl;
+        }
+    }
+
+    static void bench_drain(Distribution dist, size_t items) {
+        std::vector<int64_t> values = make_values(dist, items, 1);
+        std::vector<int64_t> expected = sorted(values);
+        std::vector<Candidate> candidates;
+        Candidate c;
+
+        c.name = "binary heap";
+        c.ns = drain<dary_heap<int64_t, std::greater<int64_t>, 2> >(values, expected, c.ok);
+        candidates.push_back(c);
+
+        c.name = "4-ary heap";
+        c.ns = drain<dary_heap<int64_t, std::greater<int64_t>, 4> >(values, expected, c.ok);
+        candidates.push_back(c);
+
+        c.name = "8-ary heap";
+        c.ns = drain<dary_heap<int64_t, std::greater<int64_t>, 8> >(values, expected, c.ok);
+        candidates.push_back(c);
+
+        c.name = "radix heap";
+        c.ns = drain<radix_heap<int64_t, std::greater<int64_t> > >(values, expected, c.ok);
+        candidates.push_back(c);
+
+        report(std::string("drain ") + name(dist), candidates);
+    }
+
+    // a whole batch sorted in place, as a delta flush does
+    template <unsigned BITS, bool COMBINE>
+    static double radix(const std::vector<int64_t> &values, const std::vector<int64_t> &expected, unsigned threads,
+                        bool &ok) {
+        std::vector<int64_t> data(values);
+        std::vector<int64_t> scratch(values.size());
+
+        clock::time_point start = clock::now();
+        parallel_radix_sort<BITS, COMBINE>(data.data(), scratch.data(), data.size(), threads);
+        double ns = ns_per_item(start, values.size());
+
+        ok = data == expected;
+        return ns;
+    }
+
+    // the spilling sort with a budget small enough to spill a run per 32K values and merge them in groups
+    static double spill(const std::vector<int64_t> &values, const std::vector<int64_t> &expected, unsigned threads,
+                        bool &ok) {
+        std::vector<int64_t> out;
+        out.reserve(values.size());
+        const char *tmp = getenv("TMPDIR");
+
+        clock::time_point start = clock::now();
+        spill_runs runs(16 * spill_block::BYTES, tmp ? tmp : "/tmp", threads);
+        for (int64_t value : values) {
+            runs.insert(value);
+        }
+        runs.drain([&out](int64_t value) { out.push_back(value); });
+        double ns = ns_per_item(start, values.size());
+
+        ok = descending(out, expected);
+        return ns;
+    }
+
+    static void bench_sort(Distribution dist, size_t items) {
+        std::vector<int64_t> values = make_values(dist, items, 1);
+        std::vector<int64_t> expected = sorted(values);
+        // the parallel paths are checked even on a single cpu
+        unsigned threads = std::thread::hardware_concurrency();
+        if (threads < 2) {
+            threads = 2;
+        }
+        std::string parallel = " " + std::to_string(threads) + " threads";
+        std::vector<Candidate> candidates;
+        Candidate c;
+
+        c.name = "radix 8 bit";
+        c.ns = radix<8, false>(values, expected, 1, c.ok);
+        candidates.push_back(c);
+
+        c.name = "radix 11 bit";
+        c.ns = radix<11, false>(values, expected, 1, c.ok);
+        candidates.push_back(c);
+
+        c.name = "radix 16 bit";
+        c.ns = radix<16, false>(values, expected, 1, c.ok);
+        candidates.push_back(c);
+
+        c.name = "radix 8 bit combining";
+        c.ns = radix<8, true>(values, expected, 1, c.ok);
+        candidates.push_back(c);
+
+        c.name = "radix 11 bit combining";
+        c.ns = radix<11, true>(values, expected, 1, c.ok);
+        candidates.push_back(c);
+
+        std::string parallelName = "radix 11 bit" + parallel;
+        c.name = parallelName.c_str();
+        c.ns = radix<11, false>(values, expected, threads, c.ok);
+        candidates.push_back(c);
+
+        std::string combiningName = "radix 11 bit combining" + parallel;
+        c.name = combiningName.c_str();
+        c.ns = radix<11, true>(values, expected, threads, c.ok);
+        candidates.push_back(c);
+
+        c.name = "spill runs";
+        c.ns = spill(values, expected, 1, c.ok);
+        candidates.push_back(c);
+
+        report(std::string("sort ") + name(dist), candidates);
+    }
+
+    struct Head {
+        int64_t value;
+        size_t run;
+
+        bool operator>(const Head &other) const { return value > other.value; }
+    };
+
+    // k ascending runs merged largest first, read back to front as per exchange sorted data would be
+    static void bench_merge(size_t items, size_t runs) {
+        std::vector<std::vector<int64_t> > data(runs);
+        for (size_t r = 0; r < runs; ++r) {
+            data[r] = make_values(Distribution::Ascending, items / runs, static_cast<uint32_t>(r + 1));
+        }
+        size_t total = (items / runs) * runs;
+        std::vector<int64_t> all;
+        for (const std::vector<int64_t> &run : data) {
+            all.insert(all.end(), run.begin(), run.end());
+        }
+        std::vector<int64_t> expected = sorted(all);
+        std::vector<Candidate> candidates;
+        Candidate c;
+
+        {
+            std::vector<int64_t> out;
+            out.reserve(total);
+            clock::time_point start = clock::now();
+            loser_tree<int64_t, std::greater<int64_t> > tree(runs);
+            for (size_t r = 0; r < runs; ++r) {
+                tree.push_range(r, data[r].rbegin(), data[r].rend());
+            }
+            tree.pop_n(total, std::back_inserter(out));
+            c.name = "loser tree";
+            c.ns = ns_per_item(start, total);
+            c.ok = descending(out, expected);
+            candidates.push_back(c);
+        }
+
+        {
+            std::vector<int64_t> out;
+            out.reserve(total);
+            clock::time_point start = clock::now();
+            std::vector<size_t> next(runs);
+            dary_heap<Head, std::greater<Head> > heap;
+            for (size_t r = 0; r < runs; ++r) {
+                if (!data[r].empty()) {
+                    heap.push(Head{data[r].back(), r});
+                    next[r] = data[r].size() - 1;
+                }
+            }
+            while (!heap.empty()) {
+                Head head = heap.pop();
+                out.push_back(head.value);
+                if (next[head.run] > 0) {
+                    heap.push(Head{data[head.run][--next[head.run]], head.run});
+                }
+            }
+            c.name = "4-ary heap of heads";
+            c.ns = ns_per_item(start, total);
+            c.ok = descending(out, expected);
+            candidates.push_back(c);
+        }
+
+        {
+            std::vector<int64_t> out;
+            out.reserve(total);
+            clock::time_point start = clock::now();
+            radix_heap<int64_t, std::greater<int64_t> > heap;
+            for (size_t r = 0; r < runs; ++r) {
+                heap.push_range(data[r].begin(), data[r].end());
+            }
+            heap.pop_n(total, std::back_inserter(out));
+            c.name = "radix heap";
+            c.ns = ns_per_item(start, total);
+            c.ok = descending(out, expected);
+            candidates.push_back(c);
+        }
+
+        report("merge " + std::to_string(runs) + " runs", candidates);
+    }
+
+    // an item that can only be moved, as one owning a payload would be
+    struct Boxed {
+        std::unique_ptr<int64_t> value;
+    };
+
+    struct BoxedGreater {
+        bool operator()(const Boxed &a, const Boxed &b) const { return *a.value > *b.value; }
+    };
+
+    static std::vector<Boxed> boxed(const std::vector<int64_t> &values) {
+        std::vector<Boxed> items(values.size());
+        for (size_t i = 0; i < values.size(); ++i) {
+            items[i].value.reset(new int64_t(values[i]));
+        }
+        return items;
+    }
+
+    static std::vector<int64_t> unboxed(const std::vector<Boxed> &items) {
+        std::vector<int64_t> values(items.size());
+        for (size_t i = 0; i < items.size(); ++i) {
+            values[i] = *items[i].value;
+        }
+        return values;
+    }
+
+    // the bulk pushes move the items in, so move only types go through them as through push(T &&)
+    static void bench_move_only(size_t items, size_t runs) {
+        std::vector<int64_t> values = make_values(Distribution::Exchange, items, 1);
+        std::vector<int64_t> expected = sorted(values);
+        std::vector<Candidate> candidates;
+        Candidate c;
+
+        {
+            std::vector<Boxed> in = boxed(values);
+            std::vector<Boxed> out;
+            out.reserve(in.size());
+            clock::time_point start = clock::now();
+            dary_heap<Boxed, BoxedGreater> heap;
+            heap.push_range(in.begin(), in.end());
+            heap.pop_n(in.size(), std::back_inserter(out));
+            c.name = "d-ary heap";
+            c.ns = ns_per_item(start, values.size());
+            c.ok = descending(unboxed(out), expected);
+            candidates.push_back(c);
+        }
+
+        {
+            // the sorted values dealt round robin, so each run is ascending
+            std::vector<std::vector<Boxed> > data(runs);
+            for (size_t r = 0; r < runs; ++r) {
+                std::vector<int64_t> run;
+                for (size_t i = r; i < expected.size(); i += runs) {
+                    run.push_back(expected[i]);
+                }
+                data[r] = boxed(run);
+            }
+            std::vector<Boxed> out;
+            out.reserve(values.size());
+            clock::time_point start = clock::now();
+            loser_tree<Boxed, BoxedGreater> tree(runs);
+            for (size_t r = 0; r < runs; ++r) {
+                tree.push_range(r, data[r].rbegin(), data[r].rend());
+            }
+            tree.pop_n(values.size(), std::back_inserter(out));
+            c.name = "loser tree";
+            c.ns = ns_per_item(start, values.size());
+            c.ok = descending(unboxed(out), expected);
+            candidates.push_back(c);
+        }
+
+        report("move only", candidates);
+    }
+}
+
+using namespace agpc;
+
+int main(int argc, char *argv[]) {
+    if (argc > 3) {
+        throw std::runtime_error("usage : ./HeapBench [items] [merge_runs]");
+    }
+
+    size_t items = argc > 1 ? std::stoul(argv[1]) : 1000000;
+    size_t runs = argc > 2 ? std::stoul(argv[2]) : 64;
+
+    bench_drain(Distribution::Exchange, items);
+    bench_drain(Distribution::Uniform, items);
+    bench_drain(Distribution::Ascending, items);
+    bench_drain(Distribution::Signed, items);
+    bench_merge(items, runs);
+    bench_move_only(items, runs);
+    bench_sort(Distribution::Exchange, items);
+    bench_sort(Distribution::Uniform, items);
+    bench_sort(Distribution::Signed, items);
+
+    if (failures > 0) {
+        std::cout << failures << " variants gave wrong output" << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,173 @@
+#include <cstdint>
+#include <chrono>
+#include <thread>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "../socklib/EventService.h"
+#include "../socklib/TcpSocket.h"
+#include "../socklib/ClientConnection.h"
+
+// pushes 12 byte exchange messages from N blocking loopback connections into one EventService and reports
+// ingest throughput, so the epoll and io_uring backends can be compared on the same traffic.
+
+namespace agpc {
+
+    class LoopbackBench : public EventNode {
+    public:
+        // messages are read in place from the receive buffer, see MessageView.h
+        typedef ClientConnectionT<LoopbackBench, ByteBuffer<1024>, ViewFraming<IncomingView<> > > ClientConnection;
+
+        LoopbackBench(EventBackend backend, int connections, int64_t messages, bool edgeTriggered)
+                : eventService_(backend), connections_(connections), messages_(messages),
+                  edgeTriggered_(edgeTriggered) {}
+
+        ~LoopbackBench() {
+            for (ClientConnection *c : clients_) {
+                delete c;
+            }
+        }
+
+        double run() {
+            sockaddr_in addr;
+            std::memset(&addr, '\0', sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port = 0;
+
+            sock_.create();
+            sock_.setReuseAddr(true);
+            sock_.bind(addr);
+            sock_.listen(connections_);
+
+            socklen_t len = sizeof(addr);
+            ::getsockname(sock_.getFD(), (sockaddr *) &addr, &len);
+            eventService_.registerHandler(sock_.getFD(), this);
+
+            auto start = std::chrono::steady_clock::now();
+            std::thread sender(&LoopbackBench::send, this, addr);
+            eventService_.poll();
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            sender.join();
+
+            eventService_.removeFD(sock_.getFD());
+            sock_.close();
+            return std::chrono::duration<double>(elapsed).count();
+        }
+
+        void onRead() override {
+            TcpSocket client_socket;
+            while (sock_.accept(client_socket)) {
+                clients_.push_back(new ClientConnection(eventService_, client_socket, this, edgeTriggered_));
+            }
+        }
+
+        void onAccept(int fd) override {
+            TcpSocket client_socket;
+            client_socket.setFD(fd);
+            clients_.push_back(new ClientConnection(eventService_, client_socket, this, edgeTriggered_));
+        }
+
+        bool isReader() override { return true; }
+
+        bool isAcceptor() override { return true; }
+
+        void onMsg(const IncomingView<> &msg, ClientConnection * /*conn*/) {
+            checksum_ += msg.value();
+            if (++received_ == messages_ * connections_) {
+                eventService_.stop();
+            }
+        }
+
+        void flush() {}
+
+        void onDisconnect(ClientConnection * /*conn*/) {}
+
+        const PollStats &pollStats() const { return eventService_.pollStats(); }
+
+        int64_t received() const { return received_; }
+
+    protected:
+
+        // plain blocking sockets on a separate thread, written round robin in 64k chunks
+        void send(sockaddr_in addr) {
+            std::vector<int> fds;
+            for (int i = 0; i < connections_; ++i) {
+                int fd = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+                if (::connect(fd, (sockaddr *) &addr, sizeof(addr)) != 0) {
+                    std::cout << "bench connect failed [" << errno << "]" << std::endl;
+                    ::close(fd);
+                    continue;
+                }
+                fds.push_back(fd);
+            }
+
+            const int64_t perChunk = 65536 / IncomingMessage::LENGTH;
+            std::vector<char> chunk(perChunk * IncomingMessage::LENGTH);
+            for (int64_t m = 0; m < perChunk; ++m) {
+                IncomingMessage msg;
+                msg.exchangeNumber_ = 1;
+                msg.value_ = m + 1;
+                std::memcpy(&chunk[m * IncomingMessage::LENGTH], &msg, sizeof(msg));
+            }
+
+            for (int64_t sent = 0; sent < messages_; sent += perChunk) {
+                int64_t count = messages_ - sent < perChunk ? messages_ - sent : perChunk;
+                for (int fd : fds) {
+                    const char *p = chunk.data();
+                    size_t left = count * IncomingMessage::LENGTH;
+                    while (left > 0) {
+                        ssize_t n = ::send(fd, p, left, 0);
+                        if (n <= 0)
+                            break;
+                        p += n;
+                        left -= n;
+                    }
+                }
+            }
+
+            for (int fd : fds) {
+                ::close(fd);
+            }
+        }
+
+        EventService eventService_;
+        TcpSocket sock_;
+        int connections_;
+        int64_t messages_;
+        bool edgeTriggered_;
+        int64_t received_{0};
+        int64_t checksum_{0};
+        std::vector<ClientConnection *> clients_;
+    };
+}
+
+using namespace agpc;
+
+static void bench(const char *name, EventBackend backend, int connections, int64_t messages, bool edgeTriggered) {
+    LoopbackBench b(backend, connections, messages, edgeTriggered);
+    double seconds = b.run();
+    const PollStats &stats = b.pollStats();
+
+    std::cout << name << (edgeTriggered ? " (edge triggered)" : "") << ": " << b.received() << " msgs in "
+              << seconds << "s, " << static_cast<int64_t>(b.received() / seconds) << " msgs/s, "
+              << stats.productivePolls << " productive polls" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || argc > 5) {
+        throw std::runtime_error("usage : ./LoopbackBench <connections> <messages_per_connection> "
+                                 "[epoll|uring|both] [et]");
+    }
+
+    int connections = std::stoi(argv[1]);
+    int64_t messages = std::stoll(argv[2]);
+    std::string which = argc > 3 ? argv[3] : "both";
+    bool edgeTriggered = argc > 4 && std::string(argv[4]) == "et";
+
+    if (which == "epoll" || which == "both") {
+        bench("epoll", EventBackend::Epoll, connections, messages, edgeTriggered);
+    }
+    if (which == "uring" || which == "both") {
+        bench("io_uring", EventBackend::IoUring, connections, messages, edgeTriggered);
+    }
+}
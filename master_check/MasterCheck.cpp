@@ -0,0 +1,116 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../sort_server/master_store.h"
+
+// crash recovery of SortServer's master store (-F): each round a child process appends values and exits without
+// closing the store, as a crash would. reopening has to find every value appended so far and closing compacts
+// them; after the last round the master has to hold exactly those values ascending. exits 1 otherwise.
+
+namespace agpc {
+
+    static std::vector<int64_t> read_master(const std::string &path) {
+        std::vector<int64_t> values;
+        FILE *file = fopen(path.c_str(), "rb");
+        if (!file)
+            return values;
+        if (fseek(file, master_store::HEADER, SEEK_SET) == 0) {
+            int64_t chunk[4096];
+            size_t n;
+            while ((n = fread(chunk, sizeof(int64_t), 4096, file)) > 0) {
+                values.insert(values.end(), chunk, chunk + n);
+            }
+        }
+        fclose(file);
+        return values;
+    }
+
+    // the child dies with segments sealed, some of them possibly half compacted, and one still being written
+    static bool crash_after_appending(const std::string &dir, size_t segmentBytes,
+                                      const std::vector<int64_t> &values) {
+        pid_t child = fork();
+        if (child < 0) {
+            throw std::runtime_error("cannot fork");
+        }
+        if (child == 0) {
+            master_store store(dir, segmentBytes);
+            for (int64_t value : values) {
+                store.append(value);
+            }
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(child, &status, 0);
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+
+    static bool check(size_t values, size_t rounds, size_t segmentBytes) {
+        char dir[] = "/tmp/mastercheck-XXXXXX";
+        if (!mkdtemp(dir)) {
+            throw std::runtime_error("cannot create a directory for the master store");
+        }
+
+        std::mt19937_64 gen(1);
+        std::uniform_int_distribution<int64_t> around_zero(-1000, 1000);
+        std::vector<int64_t> all;
+        bool ok = true;
+
+        for (size_t round = 0; round < rounds && ok; ++round) {
+            std::vector<int64_t> batch(values);
+            for (int64_t &value : batch) {
+                value = around_zero(gen);
+            }
+            all.insert(all.end(), batch.begin(), batch.end());
+
+            if (!crash_after_appending(dir, segmentBytes, batch)) {
+                std::cout << "round " << round << ": appending child failed" << std::endl;
+                ok = false;
+                break;
+            }
+
+            master_store store(dir, segmentBytes);
+            std::cout << "round " << round << ": recovered " << store.recovered_values() << " of " << all.size()
+                      << " values in " << store.recovered_segments() << " segments" << std::endl;
+            if (store.recovered_values() != all.size()) {
+                ok = false;
+            }
+            store.close();
+        }
+
+        std::string master = std::string(dir) + "/master";
+        std::sort(all.begin(), all.end());
+        if (ok && read_master(master) != all) {
+            std::cout << "compacted master does not hold the values appended, ascending" << std::endl;
+            ok = false;
+        }
+        unlink(master.c_str());
+        rmdir(dir);
+        return ok;
+    }
+}
+
+using namespace agpc;
+
+int main(int argc, char *argv[]) {
+    if (argc > 4) {
+        throw std::runtime_error("usage : ./MasterCheck [values_per_round] [rounds] [segment_bytes]");
+    }
+
+    size_t values = argc > 1 ? std::stoul(argv[1]) : 1000000;
+    size_t rounds = argc > 2 ? std::stoul(argv[2]) : 3;
+    size_t segmentBytes = argc > 3 ? std::stoul(argv[3]) : 1 << 16;
+
+    if (!check(values, rounds, segmentBytes)) {
+        std::cout << "master store check failed" << std::endl;
+        return 1;
+    }
+    std::cout << "master store check passed" << std::endl;
+}
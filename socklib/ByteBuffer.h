@@ -55,7 +55,7 @@ namespace agpc {
 
         template<typename T>
         void read(T &val) {
-            val = *reinterpret_cast<T const *>(rPos_);
+            memcpy(&val, rPos_, sizeof(T));
             rPos_ += sizeof(T);
         }
 
@@ -4,85 +4,264 @@
 #include "EventService.h"
 #include "TcpSocket.h"
 #include "ByteBuffer.h"
-
-#define bswap64(y) (((uint64_t)ntohl(y)) << 32 | ntohl(y>>32))
+#include "SendQueue.h"
+#include "Messages.h"
+#include "Framing.h"
+#include "LoopStats.h"
 
 namespace agpc {
 
-#pragma pack(push, 1)
+    // BUFFER is any type with the ByteBuffer interface, e.g. MirroredRingBuffer for large receive buffers.
+    // FRAMING splits the byte stream into messages, see Framing.h. with rxTimestamps the socket reports kernel
+    // receive times, read with recvmsg and handed on in MessageBatch::receivedNanos_; such connections skip the
+    // io_uring multishot recv, which has no control messages.
+    template<typename HANDLER, typename BUFFER = ByteBuffer<1024>, typename FRAMING = FixedFraming<IncomingMessage> >
+    class ClientConnectionT : public EventNode {
+    public:
+        ClientConnectionT(EventService &eventService, TcpSocket &tcpSocket, HANDLER *handler,
+                          bool edgeTriggered = false, RxTimestamps rxTimestamps = RxTimestamps::Off)
+                : eventService_(eventService), sock_(tcpSocket), handler_(handler), edgeTriggered_(edgeTriggered),
+                  rxTimestamps_(rxTimestamps != RxTimestamps::Off) {
+            if (rxTimestamps_) {
+                sock_.setReceiveTimestamps(rxTimestamps);
+            }
+            eventService_.registerHandler(sock_.getFD(), this);
+        }
 
-    struct IncomingMessage {
-        int32_t exchangeNumber_;
-        int64_t value_;
+        ~ClientConnectionT() {
+            sock_.close();
+        }
 
-        enum {
-            LENGTH = 4 + 8
-        };
+        void onRead() override {
+            bool sent_something = false;
+            AGPC_STATS_ONLY(++stats_.wakeups; uint64_t messagesBefore = stats_.messages;)
 
-        int32_t getExchangeNTOH() const { return ntohl(exchangeNumber_); }
+            // level triggered: one recv per wakeup. edge triggered: keep reading and parsing until the
+            // socket is drained, a short read means the kernel queue is empty.
+            for (;;) {
+                recvBuffer_.compact();
 
-        int64_t getValueNTOH() const { return bswap64(value_); }
+                size_t room = recvBuffer_.wSize();
+                ssize_t bytes = rxTimestamps_ ? sock_.receive(recvBuffer_.wPtr(), room, 0, receivedNanos_)
+                                              : sock_.receive(recvBuffer_.wPtr(), room, 0);
 
-        int32_t getExchange() const { return exchangeNumber_; }
+                if (bytes == -1) {
+                    if (sent_something) {
+                        handler_->flush();
+                    }
+                    // the stream ended while paused with bytes held back. reading again after resumeReading()
+                    // parses them first and then sees the end once more.
+                    if (paused_ && !held_.empty()) {
+                        return;
+                    }
+                    // the handler may schedule this connection for destruction, nothing may follow
+                    disconnect();
+                    return;
+                }
 
-        int64_t getValue() const { return value_; }
+                recvBuffer_.wAdvance(bytes);
+                AGPC_STATS_ONLY(stats_.bytes += bytes; eventService_.loopStats().bytesPerRecv.record(bytes);)
 
-    };
+                if (parse()) {
+                    sent_something = true;
+                }
 
-#pragma pack(pop)
+                if (closed_) {
+                    return;
+                }
 
-    template<typename HANDLER>
-    class ClientConnectionT : public EventNode {
-    public:
-        ClientConnectionT(EventService &eventService, TcpSocket &tcpSocket, HANDLER *handler)
-                : eventService_(eventService), sock_(tcpSocket), handler_(handler) {
-            eventService_.registerHandler(sock_.getFD(), this);
-        }
-
-        void onRead() override {
-            recvBuffer_.compact();
+                if (!edgeTriggered_ || static_cast<size_t>(bytes) < room || paused_) {
+                    break;
+                }
+            }
 
-            ssize_t bytes = sock_.receive(recvBuffer_.wPtr(), recvBuffer_.wSize(), 0);
+            AGPC_STATS_ONLY(eventService_.loopStats().messagesPerWakeup.record(stats_.messages - messagesBefore);)
+            if(sent_something){
+                handler_->flush();
+            }
+        }
 
-            if (bytes == -1) {
-                eventService_.removeFD(sock_.getFD());
+        // bytes already received by a completion based EventService backend. while paused they are held back
+        // unparsed, the backend may have taken more from the socket than the handler wants right now.
+        void onData(const char *data, size_t length) override {
+            if (paused_) {
+                held_.insert(held_.end(), data, data + length);
                 return;
             }
 
-            recvBuffer_.wAdvance(bytes);
-
             bool sent_something = false;
+            AGPC_STATS_ONLY(++stats_.wakeups; stats_.bytes += length; uint64_t messagesBefore = stats_.messages;
+                            eventService_.loopStats().bytesPerRecv.record(length);)
+
+            while (length > 0) {
+                recvBuffer_.compact();
+
+                size_t n = length < recvBuffer_.wSize() ? length : recvBuffer_.wSize();
+                memcpy(recvBuffer_.wPtr(), data, n);
+                recvBuffer_.wAdvance(n);
+                data += n;
+                length -= n;
 
-            while (recvBuffer_.rSize() >= 12) {
-                IncomingMessage msg;
-                recvBuffer_.read(msg);
-                handler_->onMsg(msg.getExchange(), msg.getValue(), this);
-                sent_something = true;
+                if (parse()) {
+                    sent_something = true;
+                }
+
+                if (closed_) {
+                    return;
+                }
+
+                if (paused_ && length > 0) {
+                    held_.insert(held_.end(), data, data + length);
+                    AGPC_STATS_ONLY(stats_.bytes -= length;)
+                    break;
+                }
             }
 
-            if(sent_something){
+            AGPC_STATS_ONLY(eventService_.loopStats().messagesPerWakeup.record(stats_.messages - messagesBefore);)
+            if (sent_something) {
                 handler_->flush();
             }
         }
 
+        // queues the bytes and tries to write them right away. what the socket does not take is written from
+        // onWrite, the connection only asks for EPOLLOUT while something is queued.
+        bool send(const char *bytes, size_t length) {
+            if (closed_)
+                return false;
+
+            bool idle = sendQueue_.empty();
+            sendQueue_.append(bytes, length);
+            if (!idle)
+                return true;
+
+            if (sendQueue_.flush(sock_) < 0) {
+                sendQueue_.clear();
+                return false;
+            }
+
+            if (!sendQueue_.empty()) {
+                eventService_.updateHandler(sock_.getFD(), this);
+            }
+            return true;
+        }
+
+        template<typename T>
+        bool sendBytes(T const &outgoing) {
+            return send(reinterpret_cast<const char *>(&outgoing), sizeof(outgoing));
+        }
+
+        size_t queuedBytes() const { return sendQueue_.size(); }
+
+        // called by the framing when the stream cannot be decoded any further
+        void protocolError(const char *reason) {
+            std::cout << "protocol error on " << sock_.getFD() << ": " << reason << std::endl;
+            disconnect();
+        }
+
         void onWrite() override {
-            std::cout << "on Write called on socket connection." << std::endl;
+            if (closed_ || sendQueue_.empty())
+                return;
+
+            if (sendQueue_.flush(sock_) < 0) {
+                sendQueue_.clear();
+                disconnect();
+                return;
+            }
+
+            if (sendQueue_.empty()) {
+                eventService_.updateHandler(sock_.getFD(), this);
+            }
         }
 
-        bool isReader() override { return true; }
+        // flow control: stop asking for input, so the peer is held back by its tcp window, until
+        // resumeReading(). only from the connection's own reactor.
+        void pauseReading() {
+            if (paused_ || closed_)
+                return;
+            paused_ = true;
+            eventService_.updateHandler(sock_.getFD(), this);
+        }
+
+        void resumeReading() {
+            if (!paused_ || closed_)
+                return;
+            paused_ = false;
+            eventService_.updateHandler(sock_.getFD(), this);
+
+            releaseHeld();
+        }
+
+        bool isPaused() const { return paused_; }
+
+        bool isReader() override { return !paused_; }
+
+        bool isWriter() override { return !sendQueue_.empty(); }
+
+        bool isEdgeTriggered() override { return edgeTriggered_; }
+
+        bool isStreamReader() override { return !rxTimestamps_ && !paused_; }
+
+        int getFD() { return sock_.getFD(); }
+
+        EventService &eventService() { return eventService_; }
 
         bool isStopped() const { return stopped_; }
 
         void setStopped() { stopped_ = true; }
 
+        // kernel receive time (CLOCK_REALTIME ns) of the latest read, 0 without rxTimestamps
+        uint64_t receivedNanos() const { return receivedNanos_; }
+
+        const FRAMING &framing() const { return framing_; }
+
+#ifdef AGPC_STATS
+        const ConnectionStats &stats() const { return stats_; }
+#endif
+
 
     protected:
 
-        bool stopped_{false};
-        TcpSocket sock_;
+        // stop polling the socket and tell the handler, which owns the connection. it must defer destroying
+        // it (e.g. via EventService::post) since the event loop may still be dispatching to it.
+        void disconnect() {
+            if (closed_)
+                return;
+            closed_ = true;
+            eventService_.removeFD(sock_.getFD());
+            handler_->onDisconnect(this);
+        }
+
+        void releaseHeld() {
+            if (held_.empty())
+                return;
+
+            std::vector<char> held;
+            held.swap(held_);
+            onData(held.data(), held.size());
+        }
+
+        bool parse() {
+            size_t count = framing_.parse(recvBuffer_, handler_, this);
+            AGPC_STATS_ONLY(stats_.messages += count;)
+            return count > 0;
+        }
+
         EventService &eventService_;
+        TcpSocket sock_;
         HANDLER *handler_;
-        ByteBuffer<1024> recvBuffer_;
+        bool stopped_{false};
+        bool closed_{false};
+        bool paused_{false};
+        bool edgeTriggered_;
+        bool rxTimestamps_;
+        uint64_t receivedNanos_{0};
+        BUFFER recvBuffer_;
+        SendQueue<> sendQueue_;
+        std::vector<char> held_;
+        FRAMING framing_;
+#ifdef AGPC_STATS
+        ConnectionStats stats_;
+#endif
     };
 
 
@@ -0,0 +1,145 @@
+#pragma once
+
+#ifndef SOCKETLIB_CONNECTIONREGISTRY_H
+#define SOCKETLIB_CONNECTIONREGISTRY_H
+
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <memory>
+#include "SockCommon.h"
+#include "SlabAllocator.h"
+
+namespace agpc {
+
+    // connection objects indexed by their fd and allocated from a slab. every slot carries a generation that is
+    // bumped when its connection is destroyed, so a Handle taken earlier (e.g. captured by a posted task) can
+    // tell that the fd has since been closed or reused. with nodeLocal every NUMA node gets its own slabs and a
+    // connection comes from the node of the thread creating it, normally the pinned reactor that serves it.
+    // not thread safe.
+    template<typename CONN>
+    class ConnectionRegistry {
+    public:
+
+        struct Handle {
+            int fd;
+            uint32_t generation;
+        };
+
+        explicit ConnectionRegistry(bool nodeLocal = false) : nodeLocal_(nodeLocal) {}
+
+        ConnectionRegistry(const ConnectionRegistry &) = delete;
+
+        ConnectionRegistry &operator=(const ConnectionRegistry &) = delete;
+
+        ~ConnectionRegistry() {
+            for (size_t fd = 0; fd < slots_.size(); ++fd) {
+                if (slots_[fd].conn) {
+                    destroy(static_cast<int>(fd));
+                }
+            }
+        }
+
+        template<typename... ARGS>
+        CONN *create(int fd, ARGS &&... args) {
+            if (fd < 0) {
+                throw std::runtime_error("invalid fd for connection registry");
+            }
+
+            if (static_cast<size_t>(fd) >= slots_.size()) {
+                slots_.resize(fd * 2 + 16);
+            }
+
+            Slot &slot = slots_[fd];
+            if (slot.conn) {
+                throw std::runtime_error("fd already registered");
+            }
+
+            slot.node = nodeLocal_ ? NumaTopology::currentNode() : -1;
+            SlabAllocator<CONN> &allocator = allocatorFor(slot.node);
+            void *mem = allocator.allocate();
+            try {
+                slot.conn = new(mem) CONN(std::forward<ARGS>(args)...);
+            }
+            catch (...) {
+                allocator.deallocate(mem);
+                throw;
+            }
+
+            ++active_;
+            return slot.conn;
+        }
+
+        CONN *find(int fd) const {
+            if (fd < 0 || static_cast<size_t>(fd) >= slots_.size())
+                return nullptr;
+            return slots_[fd].conn;
+        }
+
+        CONN *find(const Handle &handle) const {
+            CONN *conn = find(handle.fd);
+            if (conn && slots_[handle.fd].generation != handle.generation)
+                return nullptr;
+            return conn;
+        }
+
+        Handle handle(int fd) const {
+            Handle h;
+            h.fd = fd;
+            h.generation = (fd >= 0 && static_cast<size_t>(fd) < slots_.size()) ? slots_[fd].generation : 0;
+            return h;
+        }
+
+        bool destroy(int fd) {
+            CONN *conn = find(fd);
+            if (!conn)
+                return false;
+
+            Slot &slot = slots_[fd];
+            slot.conn = nullptr;
+            ++slot.generation;
+            --active_;
+
+            conn->~CONN();
+            allocatorFor(slot.node).deallocate(conn);
+            return true;
+        }
+
+        bool destroy(const Handle &handle) {
+            return find(handle) ? destroy(handle.fd) : false;
+        }
+
+        size_t active() const { return active_; }
+
+    protected:
+
+        struct Slot {
+            CONN *conn{nullptr};
+            uint32_t generation{0};
+            int node{-1};
+        };
+
+        SlabAllocator<CONN> &allocatorFor(int node) {
+            if (node < 0)
+                return allocator_;
+
+            if (static_cast<size_t>(node) >= nodeAllocators_.size()) {
+                nodeAllocators_.resize(node + 1);
+            }
+            if (!nodeAllocators_[node]) {
+                nodeAllocators_[node].reset(new SlabAllocator<CONN>(node));
+            }
+            return *nodeAllocators_[node];
+        }
+
+        std::vector<Slot> slots_;
+        bool nodeLocal_;
+        SlabAllocator<CONN> allocator_;
+        std::vector<std::unique_ptr<SlabAllocator<CONN> > > nodeAllocators_;
+        size_t active_{0};
+    };
+}
+
+#endif //SOCKETLIB_CONNECTIONREGISTRY_H
@@ -0,0 +1,119 @@
+#pragma once
+
+#ifndef SOCKETLIB_DELTAVARINT_H
+#define SOCKETLIB_DELTAVARINT_H
+
+#include <cstdint>
+#include <cstddef>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace agpc {
+
+    // a run of int64 values as the zigzag encoded differences between neighbours (the first one taken against 0),
+    // each written as a LEB128 varint. a sorted or slowly moving stream shrinks to 1-2 bytes per value.
+    // differences are taken modulo 2^64, so any input round trips exactly.
+    class DeltaVarint {
+    public:
+
+        enum {
+            MAX_VARINT_BYTES = 10
+        };
+
+        static uint64_t zigzag(int64_t value) {
+            return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+        }
+
+        static int64_t unzigzag(uint64_t value) {
+            return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+        }
+
+        // out needs room for count * MAX_VARINT_BYTES, returns the number of bytes written
+        static size_t encode(const int64_t *values, size_t count, char *out) {
+            uint8_t *p = reinterpret_cast<uint8_t *>(out);
+            uint64_t prev = 0;
+
+            for (size_t i = 0; i < count; ++i) {
+                uint64_t value = static_cast<uint64_t>(values[i]);
+                uint64_t v = zigzag(static_cast<int64_t>(value - prev));
+                prev = value;
+
+                while (v >= 0x80) {
+                    *p++ = static_cast<uint8_t>(v) | 0x80;
+                    v >>= 7;
+                }
+                *p++ = static_cast<uint8_t>(v);
+            }
+
+            return p - reinterpret_cast<uint8_t *>(out);
+        }
+
+        // decodes exactly count values from [in, end), returns the bytes consumed or 0 if the input is malformed
+        static size_t decode(const char *in, const char *end, size_t count, int64_t *values) {
+            const uint8_t *p = reinterpret_cast<const uint8_t *>(in);
+            const uint8_t *e = reinterpret_cast<const uint8_t *>(end);
+
+            // pass 1: varints into zigzagged deltas, the one and two byte cases first
+            for (size_t i = 0; i < count; ++i) {
+                if (p == e)
+                    return 0;
+
+                uint64_t v = *p++;
+                if (v & 0x80) {
+                    v &= 0x7f;
+                    unsigned shift = 7;
+                    uint8_t byte;
+                    do {
+                        if (p == e || shift > 63)
+                            return 0;
+                        byte = *p++;
+                        v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                        shift += 7;
+                    } while (byte & 0x80);
+                }
+                values[i] = static_cast<int64_t>(v);
+            }
+
+            // pass 2: undo zigzag and delta in place
+            prefixSum(values, count);
+
+            return p - reinterpret_cast<const uint8_t *>(in);
+        }
+
+    protected:
+
+        static void prefixSum(int64_t *values, size_t count) {
+            size_t i = 0;
+            uint64_t sum = 0;
+
+#if defined(__SSE2__)
+            // two lanes at a time: [d0, d1] -> [s + d0, s + d0 + d1], carrying the high lane into the next pair
+            const __m128i one = _mm_set1_epi64x(1);
+            const __m128i zero = _mm_setzero_si128();
+            __m128i carry = zero;
+
+            for (; i + 2 <= count; i += 2) {
+                __m128i *slot = reinterpret_cast<__m128i *>(values + i);
+                __m128i v = _mm_loadu_si128(slot);
+                v = _mm_xor_si128(_mm_srli_epi64(v, 1), _mm_sub_epi64(zero, _mm_and_si128(v, one)));
+                v = _mm_add_epi64(v, _mm_slli_si128(v, 8));
+                v = _mm_add_epi64(v, carry);
+                _mm_storeu_si128(slot, v);
+                carry = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 2, 3, 2));
+            }
+
+            if (i > 0)
+                sum = static_cast<uint64_t>(values[i - 1]);
+#endif
+
+            for (; i < count; ++i) {
+                sum += static_cast<uint64_t>(unzigzag(static_cast<uint64_t>(values[i])));
+                values[i] = static_cast<int64_t>(sum);
+            }
+        }
+    };
+}
+
+#endif //SOCKETLIB_DELTAVARINT_H
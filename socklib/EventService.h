@@ -6,6 +6,8 @@
 #include <iostream>
 #include <stdexcept>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -14,13 +16,24 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <vector>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include "SockCommon.h"
+#include "MpscQueue.h"
+#include "LoopStats.h"
+
+#ifndef AGPC_NO_IO_URING
+#include "IoUring.h"
+#endif
 
 namespace agpc {
 
     class EventNode {
     public:
 
+        virtual ~EventNode() {}
+
         virtual void onRead() {}
 
         virtual void onWrite() {}
@@ -28,40 +41,176 @@ namespace agpc {
         virtual bool isReader() { return false; }
 
         virtual bool isWriter() { return false; }
+
+        // edge triggered nodes must drain their fd until EAGAIN on every wakeup
+        virtual bool isEdgeTriggered() { return false; }
+
+        // completion based backends (io_uring) can hand over received bytes or accepted fds directly.
+        // nodes that opt in still get onRead() from the epoll backend, and on EOF/errors from io_uring,
+        // so they must keep a working onRead().
+        virtual bool isStreamReader() { return false; }
+
+        virtual void onData(const char * /*data*/, size_t /*length*/) {}
+
+        virtual bool isAcceptor() { return false; }
+
+        virtual void onAccept(int /*fd*/) {}
+    };
+
+    struct PollStats {
+        uint64_t productivePolls{0};
+        uint64_t emptyPolls{0};
+        uint64_t blockingPolls{0};
+    };
+
+    enum class EventBackend {
+        Epoll,
+        IoUring
     };
 
+#ifndef AGPC_DEFAULT_EVENT_BACKEND
+#define AGPC_DEFAULT_EVENT_BACKEND agpc::EventBackend::Epoll
+#endif
+
     class EventService {
     public:
 
-        EventService() : epfd_(INVALID_FD_VAL) {
-            epfd_ = epoll_create1(0);
-            if (epfd_ < 0) {
-                std::cout << "epoll create failed [" << errno << "]" << std::endl;
-                throw std::runtime_error("epoll create failed");
+        typedef std::function<void()> Task;
+
+        explicit EventService(EventBackend backend = AGPC_DEFAULT_EVENT_BACKEND)
+                : epfd_(INVALID_FD_VAL), backend_(backend) {
+            if (backend_ == EventBackend::IoUring) {
+#ifndef AGPC_NO_IO_URING
+                ring_.init(URING_ENTRIES);
+                ring_.registerBufferRing(URING_BUFFER_GROUP, URING_BUFFER_COUNT, URING_BUFFER_SIZE);
+#else
+                throw std::runtime_error("io_uring backend compiled out (AGPC_NO_IO_URING)");
+#endif
+            } else {
+                epfd_ = epoll_create1(0);
+                if (epfd_ < 0) {
+                    std::cout << "epoll create failed [" << errno << "]" << std::endl;
+                    throw std::runtime_error("epoll create failed");
+                }
+            }
+
+            waker_.fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (waker_.fd_ < 0) {
+                std::cout << "eventfd create failed [" << errno << "]" << std::endl;
+                if (epfd_ != INVALID_FD_VAL)
+                    close(epfd_);
+                throw std::runtime_error("eventfd create failed");
             }
+
+            waker_.service_ = this;
+            registerHandler(waker_.fd_, &waker_);
+            AGPC_STATS_ONLY(StatsDumpSignal::watch(waker_.fd_);)
         }
 
+        EventService(const EventService &) = delete;
+
+        EventService &operator=(const EventService &) = delete;
+
         ~EventService() {
+            if (waker_.fd_ != INVALID_FD_VAL) {
+                AGPC_STATS_ONLY(StatsDumpSignal::unwatch(waker_.fd_);)
+                close(waker_.fd_);
+                waker_.fd_ = INVALID_FD_VAL;
+            }
             if (epfd_ != INVALID_FD_VAL) {
                 close(epfd_);
                 epfd_ = INVALID_FD_VAL;
             }
         }
 
-        void stop() { stop_ = true; }
+        EventBackend backend() const { return backend_; }
+
+        // safe to call from any thread, a blocked poll() is woken up through the eventfd
+        void stop() {
+            stop_.store(true, std::memory_order_release);
+            wakeup();
+        }
+
+        bool isStopped() const { return stop_.load(std::memory_order_acquire); }
+
+        void wakeup() {
+            uint64_t one = 1;
+            ssize_t result = ::write(waker_.fd_, &one, sizeof(one));
+            (void) result;
+        }
+
+        // runs task on the loop thread. callable from any thread; only the first post after the loop has
+        // picked up its tasks pays for the eventfd write.
+        void post(Task task) {
+            tasks_.push(std::move(task));
+            if (!wakePending_.exchange(true, std::memory_order_acq_rel)) {
+                wakeup();
+            }
+        }
+
+        // busy poll mode: after every productive poll keep calling epoll_wait with a zero timeout for up to
+        // spinNanos before falling back to a blocking wait. 0 (the default) always blocks.
+        void setSpinBudget(uint64_t spinNanos) { spinBudget_ = std::chrono::nanoseconds(spinNanos); }
+
+        // only consistent when read from the polling thread or after poll() returned
+        const PollStats &pollStats() const { return stats_; }
+
+#ifdef AGPC_STATS
+        LoopStats &loopStats() { return *loopStats_; }
+
+        // moves the loop's stats into /dev/shm/<name> where other processes can read them while it runs.
+        // call before poll().
+        void mapStats(const std::string &name) {
+            loopStats_ = sharedStats_.create(name);
+        }
+
+        // printed above the stats dumped on the stats signal
+        void setStatsLabel(const std::string &label) { statsLabel_ = label; }
+#endif
 
         bool poll() {
+#ifndef AGPC_NO_IO_URING
+            if (backend_ == EventBackend::IoUring) {
+                return pollUring();
+            }
+#endif
+            typedef std::chrono::steady_clock clock;
+
             epoll_event eevents[64];
-            while (!stop_) {
-                int nfds = epoll_wait(epfd_, eevents, ARRAY_SIZE(eevents), -1);
+            bool spinning = spinBudget_.count() > 0;
+            clock::time_point lastProductive = clock::now();
+
+            while (!stop_.load(std::memory_order_acquire)) {
+                int timeout = -1;
+                if (spinning && clock::now() - lastProductive < spinBudget_) {
+                    timeout = 0;
+                }
+
+                if (timeout < 0) {
+                    ++stats_.blockingPolls;
+                }
+
+                int nfds = epoll_wait(epfd_, eevents, ARRAY_SIZE(eevents), timeout);
                 if (nfds < 0) {
-                    std::cout << "epoll returned but no events" << std::endl;
+                    if (errno != EINTR) {
+                        std::cout << "epoll returned but no events" << std::endl;
+                    }
+                    continue;
+                }
+
+                if (nfds == 0) {
+                    ++stats_.emptyPolls;
                     continue;
                 }
 
+                ++stats_.productivePolls;
+                AGPC_STATS_ONLY(uint64_t woke = monotonicNanos();)
+
                 for (int i = 0; i < nfds; i++) {
                     auto e = eevents[i];
                     EventNode *handler = static_cast<EventNode *>(e.data.ptr);
+                    AGPC_STATS_ONLY(uint64_t started = monotonicNanos();
+                                    loopStats_->wakeToHandlerNanos.record(started - woke);)
 
                     if (e.events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
                         if (handler) {
@@ -73,19 +222,26 @@ namespace agpc {
                             handler->onWrite();
                         }
                     }
+                    AGPC_STATS_ONLY(loopStats_->handlerNanos.record(monotonicNanos() - started);)
+                }
+
+                if (spinning) {
+                    lastProductive = clock::now();
                 }
             }
+
+            return true;
         }
 
         void registerHandler(int fd, EventNode *handler) {
+#ifndef AGPC_NO_IO_URING
+            if (backend_ == EventBackend::IoUring) {
+                registerUring(fd, handler);
+                return;
+            }
+#endif
             epoll_event eevent;
-            eevent.data.fd = fd;
-
-            eevent.events = (EPOLLRDHUP | EPOLLPRI |
-                             (handler->isReader() ? (int) EPOLLIN : 0) |
-                             (handler->isWriter() ? (int) EPOLLOUT : 0)
-            );
-
+            eevent.events = epollEvents(handler);
             eevent.data.ptr = handler;
 
             if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &eevent) < 0) {
@@ -93,17 +249,382 @@ namespace agpc {
             }
         }
 
+        // re-reads isReader()/isWriter() of an already registered handler, e.g. to watch for writability only
+        // while it has bytes queued
+        void updateHandler(int fd, EventNode *handler) {
+#ifndef AGPC_NO_IO_URING
+            if (backend_ == EventBackend::IoUring) {
+                updateUring(fd, handler);
+                return;
+            }
+#endif
+            epoll_event eevent;
+            eevent.events = epollEvents(handler);
+            eevent.data.ptr = handler;
+
+            if (epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &eevent) < 0) {
+                std::cout << "epoll modify failed [" << errno << "]" << std::endl;
+            }
+        }
+
         void removeFD(int fd) {
-            if (fd != INVALID_FD_VAL) {
-                epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, 0);
+            if (fd == INVALID_FD_VAL)
+                return;
+
+#ifndef AGPC_NO_IO_URING
+            if (backend_ == EventBackend::IoUring) {
+                removeUring(fd);
+                return;
             }
+#endif
+            epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, 0);
         }
 
 
     protected:
 
+        enum {
+            MAX_TASKS_PER_WAKEUP = 1024
+        };
+
+        static uint32_t epollEvents(EventNode *handler) {
+            return (EPOLLRDHUP | EPOLLPRI |
+                    (handler->isReader() ? (int) EPOLLIN : 0) |
+                    (handler->isWriter() ? (int) EPOLLOUT : 0) |
+                    (handler->isEdgeTriggered() ? (int) EPOLLET : 0)
+            );
+        }
+
+        class Waker : public EventNode {
+        public:
+            void onRead() override {
+                uint64_t count;
+                while (::read(fd_, &count, sizeof(count)) > 0);
+                AGPC_STATS_ONLY(service_->checkStatsDump();)
+                service_->runTasks();
+            }
+
+            bool isReader() override { return true; }
+
+            int fd_{INVALID_FD_VAL};
+            EventService *service_{nullptr};
+        };
+
+#ifdef AGPC_STATS
+        void checkStatsDump() {
+            uint32_t generation = StatsDumpSignal::generation();
+            if (generation != dumpGeneration_) {
+                dumpGeneration_ = generation;
+                std::cerr << "-- " << statsLabel_ << "\n";
+                loopStats_->print(std::cerr);
+            }
+        }
+#endif
+
+        // clear the pending flag before draining so a post racing with us always signals again. batches are
+        // capped so a flood of tasks cannot starve socket events; leftovers re-signal the eventfd.
+        void runTasks() {
+            wakePending_.store(false, std::memory_order_release);
+
+            Task task;
+            for (int n = 0; n < MAX_TASKS_PER_WAKEUP; ++n) {
+                MpscQueue<Task>::PopResult result = tasks_.pop(task);
+                if (result == MpscQueue<Task>::EMPTY)
+                    return;
+                if (result == MpscQueue<Task>::BUSY)
+                    break;
+                task();
+            }
+
+            if (!wakePending_.exchange(true, std::memory_order_acq_rel)) {
+                wakeup();
+            }
+        }
+
+#ifndef AGPC_NO_IO_URING
+
+        // io_uring backend: multishot accept for acceptors, multishot recv into a provided buffer ring for
+        // stream readers, poll for everything else. all sqes queued during a loop iteration go to the kernel
+        // in the same io_uring_enter that waits for the next completions.
+
+        enum {
+            URING_ENTRIES = 256,
+            URING_BUFFER_GROUP = 0,
+            URING_BUFFER_COUNT = 256,
+            URING_BUFFER_SIZE = 4096
+        };
+
+        enum UringOp : uint8_t {
+            OP_POLL = 1,
+            OP_RECV,
+            OP_ACCEPT,
+            OP_CANCEL
+        };
+
+        // completions carry fd, generation and op; a generation mismatch marks completions that were still in
+        // flight when the fd was removed (and possibly reused), they are dropped.
+        struct UringSlot {
+            EventNode *node{nullptr};
+            uint32_t generation{0};
+            // a multishot recv is armed
+            bool streaming{false};
+        };
+
+        static uint64_t userData(int fd, uint32_t generation, uint8_t op) {
+            return (static_cast<uint64_t>(static_cast<uint32_t>(fd)) << 32) |
+                   (static_cast<uint64_t>(generation & 0xffffff) << 8) | op;
+        }
+
+        UringSlot *liveSlot(int fd, uint32_t generation) {
+            if (fd < 0 || static_cast<size_t>(fd) >= slots_.size())
+                return nullptr;
+            UringSlot &slot = slots_[fd];
+            if (!slot.node || (slot.generation & 0xffffff) != generation)
+                return nullptr;
+            return &slot;
+        }
+
+        void registerUring(int fd, EventNode *handler) {
+            if (static_cast<size_t>(fd) >= slots_.size()) {
+                slots_.resize(fd * 2 + 16);
+            }
+
+            UringSlot &slot = slots_[fd];
+            slot.node = handler;
+            slot.streaming = false;
+
+            if (handler->isAcceptor()) {
+                armAccept(fd, slot.generation);
+            } else if (handler->isStreamReader()) {
+                armRecv(fd, slot.generation);
+                slot.streaming = true;
+            }
+            armPoll(fd, slot);
+        }
+
+        void removeUring(int fd) {
+            if (static_cast<size_t>(fd) < slots_.size() && slots_[fd].node) {
+                slots_[fd].node = nullptr;
+                slots_[fd].streaming = false;
+                ++slots_[fd].generation;
+            }
+
+            io_uring_sqe *sqe = ring_.getSqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = userData(fd, 0, OP_CANCEL);
+
+            // cancel by fd has to reach the kernel before the caller closes the descriptor
+            ring_.submit(0);
+        }
+
+        // drop whatever poll is armed and arm one with the node's current mask. the remove is hard linked so the
+        // new poll is queued even when there was nothing to remove; the cancelled poll completes with
+        // ECANCELED and is not re-armed. a stream reader that stops reading (flow control) loses its recv, bytes
+        // already in flight may still be handed over.
+        void updateUring(int fd, EventNode *handler) {
+            if (static_cast<size_t>(fd) >= slots_.size() || slots_[fd].node != handler)
+                return;
+
+            UringSlot &slot = slots_[fd];
+            bool streaming = handler->isStreamReader() && !handler->isAcceptor();
+            if (slot.streaming && !streaming) {
+                io_uring_sqe *cancel = ring_.getSqe();
+                cancel->opcode = IORING_OP_ASYNC_CANCEL;
+                cancel->fd = -1;
+                cancel->addr = userData(fd, slot.generation, OP_RECV);
+                cancel->user_data = userData(fd, 0, OP_CANCEL);
+            } else if (!slot.streaming && streaming) {
+                armRecv(fd, slot.generation);
+            }
+            slot.streaming = streaming;
+
+            io_uring_sqe *sqe = ring_.getSqe();
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = userData(fd, slot.generation, OP_POLL);
+            sqe->flags = IOSQE_IO_HARDLINK;
+            sqe->user_data = userData(fd, 0, OP_CANCEL);
+
+            armPoll(fd, slot);
+        }
+
+        static uint32_t pollMask(EventNode *node) {
+            uint32_t mask = 0;
+            if (node->isReader() && !node->isStreamReader() && !node->isAcceptor())
+                mask |= POLLIN | POLLPRI | POLLRDHUP;
+            if (node->isWriter())
+                mask |= POLLOUT;
+            return mask;
+        }
+
+        // level triggered nodes get a one shot poll that is re-armed after every dispatch (re-arming a poll on a
+        // still readable fd completes immediately), edge triggered ones a multishot poll.
+        void armPoll(int fd, const UringSlot &slot) {
+            uint32_t mask = pollMask(slot.node);
+            if (!mask)
+                return;
+
+            io_uring_sqe *sqe = ring_.getSqe();
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = fd;
+            sqe->poll32_events = mask;
+            sqe->len = slot.node->isEdgeTriggered() ? IORING_POLL_ADD_MULTI : 0;
+            sqe->user_data = userData(fd, slot.generation, OP_POLL);
+        }
+
+        void armRecv(int fd, uint32_t generation) {
+            io_uring_sqe *sqe = ring_.getSqe();
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = fd;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = URING_BUFFER_GROUP;
+            sqe->user_data = userData(fd, generation, OP_RECV);
+        }
+
+        void armAccept(int fd, uint32_t generation) {
+            io_uring_sqe *sqe = ring_.getSqe();
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = fd;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            sqe->user_data = userData(fd, generation, OP_ACCEPT);
+        }
+
+        void onCompletion(const io_uring_cqe &cqe) {
+            int fd = static_cast<int>(cqe.user_data >> 32);
+            uint32_t generation = static_cast<uint32_t>(cqe.user_data >> 8) & 0xffffff;
+            uint8_t op = static_cast<uint8_t>(cqe.user_data & 0xff);
+            bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+            UringSlot *slot;
+
+            switch (op) {
+                case OP_RECV:
+                    if (cqe.flags & IORING_CQE_F_BUFFER) {
+                        uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                        if (cqe.res > 0 && (slot = liveSlot(fd, generation)) != nullptr) {
+                            slot->node->onData(ring_.buffer(URING_BUFFER_GROUP, bid), cqe.res);
+                        }
+                        ring_.recycleBuffer(URING_BUFFER_GROUP, bid);
+                    }
+
+                    if ((slot = liveSlot(fd, generation)) == nullptr || cqe.res == -ECANCELED)
+                        return;
+
+                    if (cqe.res > 0 || cqe.res == -ENOBUFS) {
+                        if (!more && slot->streaming)
+                            armRecv(fd, generation);
+                    } else {
+                        // EOF or error, the node finds out through its own recv and removes itself
+                        slot->node->onRead();
+                    }
+                    return;
+
+                case OP_ACCEPT:
+                    if (cqe.res >= 0) {
+                        if ((slot = liveSlot(fd, generation)) != nullptr) {
+                            slot->node->onAccept(cqe.res);
+                        } else {
+                            ::close(cqe.res);
+                        }
+                    }
+
+                    if (!more && liveSlot(fd, generation) != nullptr)
+                        armAccept(fd, generation);
+                    return;
+
+                case OP_POLL:
+                    if ((slot = liveSlot(fd, generation)) == nullptr || cqe.res == -ECANCELED)
+                        return;
+
+                    if (cqe.res < 0 || (cqe.res & (POLLIN | POLLPRI | POLLERR | POLLHUP | POLLRDHUP))) {
+                        slot->node->onRead();
+                    }
+                    if (cqe.res >= 0 && (cqe.res & (POLLOUT | POLLERR)) &&
+                        (slot = liveSlot(fd, generation)) != nullptr) {
+                        slot->node->onWrite();
+                    }
+
+                    if (!more && (slot = liveSlot(fd, generation)) != nullptr)
+                        armPoll(fd, *slot);
+                    return;
+
+                default:
+                    return;
+            }
+        }
+
+        bool pollUring() {
+            typedef std::chrono::steady_clock clock;
+
+            bool spinning = spinBudget_.count() > 0;
+            clock::time_point lastProductive = clock::now();
+
+            while (!stop_.load(std::memory_order_acquire)) {
+                unsigned waitNr = 1;
+                if (spinning && clock::now() - lastProductive < spinBudget_) {
+                    waitNr = 0;
+                }
+
+                if (waitNr) {
+                    ++stats_.blockingPolls;
+                }
+
+                if (ring_.submit(waitNr) < 0 && errno != EINTR && errno != EBUSY) {
+                    std::cout << "io_uring enter failed [" << errno << "]" << std::endl;
+                    continue;
+                }
+
+                // copy each cqe out and release its slot before dispatching so handlers may submit
+                unsigned completions = 0;
+                io_uring_cqe *cqe;
+                AGPC_STATS_ONLY(uint64_t woke = monotonicNanos();)
+                while ((cqe = ring_.peekCqe()) != nullptr) {
+                    io_uring_cqe completion = *cqe;
+                    ring_.cqeSeen();
+                    AGPC_STATS_ONLY(uint64_t started = monotonicNanos();
+                                    loopStats_->wakeToHandlerNanos.record(started - woke);)
+                    onCompletion(completion);
+                    AGPC_STATS_ONLY(loopStats_->handlerNanos.record(monotonicNanos() - started);)
+                    ++completions;
+                }
+
+                if (completions == 0) {
+                    ++stats_.emptyPolls;
+                    continue;
+                }
+
+                ++stats_.productivePolls;
+
+                if (spinning) {
+                    lastProductive = clock::now();
+                }
+            }
+
+            return true;
+        }
+
+        IoUring ring_;
+        std::vector<UringSlot> slots_;
+#endif
+
         int epfd_;
-        bool stop_{false};
+        EventBackend backend_;
+        Waker waker_;
+        std::chrono::nanoseconds spinBudget_{0};
+        PollStats stats_;
+        MpscQueue<Task> tasks_;
+        std::atomic<bool> wakePending_{false};
+#ifdef AGPC_STATS
+        LoopStats ownStats_;
+        LoopStats *loopStats_{&ownStats_};
+        SharedStatsRegion sharedStats_;
+        std::string statsLabel_{"event loop"};
+        uint32_t dumpGeneration_{0};
+#endif
+        std::atomic<bool> stop_{false};
     };
 }
 
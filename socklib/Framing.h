@@ -0,0 +1,416 @@
+#pragma once
+
+#ifndef SOCKETLIB_FRAMING_H
+#define SOCKETLIB_FRAMING_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include "Messages.h"
+#include "MessageBatch.h"
+#include "MessageView.h"
+#include "DeltaVarint.h"
+
+namespace agpc {
+
+    template<typename... TYPES>
+    struct TypeList {
+    };
+
+    // hands a decoded message to the handler. the original 12 byte message keeps its (exchange, value)
+    // callback, every other type goes to HANDLER::onMsg(const T &, CONN *). resolved at compile time.
+    template<typename HANDLER, typename T, typename CONN>
+    inline void deliver(HANDLER *handler, const T &msg, CONN *conn) {
+        handler->onMsg(msg, conn);
+    }
+
+    template<typename HANDLER, typename CONN>
+    inline void deliver(HANDLER *handler, const IncomingMessage &msg, CONN *conn) {
+        handler->onMsg(msg.getExchange(), msg.getValue(), conn);
+    }
+
+    // a headerless stream of packed MSG records, the original exchange protocol. parse() returns the number of
+    // messages delivered and leaves a trailing partial record in the buffer.
+    template<typename MSG>
+    struct FixedFraming {
+        template<typename HANDLER, typename CONN, typename BUFFER>
+        static size_t parse(BUFFER &buffer, HANDLER *handler, CONN *conn) {
+            size_t count = 0;
+
+            while (buffer.rSize() >= sizeof(MSG)) {
+                MSG msg;
+                buffer.read(msg);
+                deliver(handler, msg, conn);
+                ++count;
+            }
+
+            return count;
+        }
+    };
+
+    // headerless stream of VIEW::Message records handed to HANDLER::onMsg(const VIEW &, CONN *) straight out of the
+    // receive buffer, e.g. ViewFraming<IncomingView<NetworkOrder> >. the view is only valid during the call.
+    template<typename VIEW>
+    struct ViewFraming {
+        template<typename HANDLER, typename CONN, typename BUFFER>
+        static size_t parse(BUFFER &buffer, HANDLER *handler, CONN *conn) {
+            MessageViews<VIEW> views(buffer);
+            for (VIEW view : views) {
+                handler->onMsg(view, conn);
+            }
+            views.consume(buffer);
+            return views.size();
+        }
+    };
+
+    // the same headerless 12 byte stream, but all complete records of a read are decoded in one SIMD pass and
+    // handed over together to HANDLER::onMsgBatch(const MessageBatch &, CONN *), at most MAX_BATCH at a time.
+    // NETWORK_ORDER byte swaps exchange and value from big endian.
+    template<bool NETWORK_ORDER = false, size_t MAX_BATCH = 512>
+    struct BatchFraming {
+        template<typename HANDLER, typename CONN, typename BUFFER>
+        static size_t parse(BUFFER &buffer, HANDLER *handler, CONN *conn) {
+            int32_t exchanges[MAX_BATCH];
+            int64_t values[MAX_BATCH];
+            size_t total = 0;
+
+            while (buffer.rSize() >= IncomingMessage::LENGTH) {
+                size_t count = buffer.rSize() / IncomingMessage::LENGTH;
+                if (count > MAX_BATCH)
+                    count = MAX_BATCH;
+
+                BatchDecoder<NETWORK_ORDER>::decode(buffer.rPtr(), count, exchanges, values);
+                buffer.rAdvance(count * IncomingMessage::LENGTH);
+
+                MessageBatch batch = {exchanges, values, count, conn->receivedNanos()};
+                handler->onMsgBatch(batch, conn);
+                total += count;
+            }
+
+            return total;
+        }
+    };
+
+#pragma pack(push, 1)
+
+    // length is the number of body bytes that follow the header
+    struct FrameHeader {
+        uint8_t tag_;
+        uint8_t length_;
+    };
+
+#pragma pack(pop)
+
+    template<int TAG, typename LIST>
+    struct HasTag;
+
+    template<int TAG>
+    struct HasTag<TAG, TypeList<> > {
+        enum {
+            VALUE = 0
+        };
+    };
+
+    template<int TAG, typename T, typename... REST>
+    struct HasTag<TAG, TypeList<T, REST...> > {
+        enum {
+            VALUE = T::TAG == TAG || HasTag<TAG, TypeList<REST...> >::VALUE
+        };
+    };
+
+    // unrolls into a chain of compares on the tag, the first type in the list is tested first
+    template<typename LIST>
+    struct TagDispatch;
+
+    template<>
+    struct TagDispatch<TypeList<> > {
+        template<typename HANDLER, typename CONN>
+        static bool run(uint8_t, const char *, size_t, HANDLER *, CONN *) { return false; }
+    };
+
+    template<typename T, typename... REST>
+    struct TagDispatch<TypeList<T, REST...> > {
+        static_assert(sizeof(T) <= 255, "message body does not fit the frame length byte");
+        static_assert(T::TAG > 0 && T::TAG <= 255, "message tag must fit in one byte and not be 0");
+        static_assert(!HasTag<T::TAG, TypeList<REST...> >::VALUE, "duplicate message tag");
+
+        template<typename HANDLER, typename CONN>
+        static bool run(uint8_t tag, const char *body, size_t length, HANDLER *handler, CONN *conn) {
+            if (tag == T::TAG) {
+                if (length != sizeof(T))
+                    return false;
+
+                T msg;
+                memcpy(&msg, body, sizeof(T));
+                deliver(handler, msg, conn);
+                return true;
+            }
+
+            return TagDispatch<TypeList<REST...> >::run(tag, body, length, handler, conn);
+        }
+    };
+
+    // every message is preceded by a FrameHeader. frames with an unknown tag or an unexpected length are
+    // skipped, so new message types can be introduced without breaking older receivers.
+    template<typename LIST>
+    struct TaggedFraming {
+        template<typename T>
+        struct FrameSize {
+            enum {
+                VALUE = sizeof(FrameHeader) + sizeof(T)
+            };
+        };
+
+        template<typename HANDLER, typename CONN, typename BUFFER>
+        static size_t parse(BUFFER &buffer, HANDLER *handler, CONN *conn) {
+            size_t count = 0;
+
+            while (buffer.rSize() >= sizeof(FrameHeader)) {
+                FrameHeader header;
+                memcpy(&header, buffer.rPtr(), sizeof(header));
+
+                size_t frame = sizeof(FrameHeader) + header.length_;
+                if (buffer.rSize() < frame)
+                    break;
+
+                if (TagDispatch<LIST>::run(header.tag_, buffer.rPtr() + sizeof(FrameHeader), header.length_,
+                                           handler, conn)) {
+                    ++count;
+                }
+                buffer.rAdvance(frame);
+            }
+
+            return count;
+        }
+
+        // writes header and body to out, which must have room for FrameSize<T>::VALUE bytes
+        template<typename T>
+        static size_t encode(const T &msg, char *out) {
+            static_assert(HasTag<T::TAG, LIST>::VALUE, "message type is not part of this framing");
+
+            FrameHeader header;
+            header.tag_ = T::TAG;
+            header.length_ = sizeof(T);
+            memcpy(out, &header, sizeof(header));
+            memcpy(out + sizeof(header), &msg, sizeof(T));
+            return FrameSize<T>::VALUE;
+        }
+    };
+
+    typedef TaggedFraming<TypeList<IncomingMessage, Heartbeat, SequenceReset> > ExchangeFraming;
+
+    // one exchange's ExchangeFraming stream for handlers taking batches: values are gathered into onMsgBatch
+    // calls, any other message flushes the batch and goes to HANDLER::onMsg(const T &, CONN *). values are
+    // numbered as SequenceReset describes; the handler sees a reset before it applies, with received() the
+    // next number expected, and repeats it announces are dropped here.
+    template<size_t MAX_BATCH = 512>
+    class SequencedFraming {
+    public:
+
+        template<typename HANDLER, typename CONN, typename BUFFER>
+        size_t parse(BUFFER &buffer, HANDLER *handler, CONN *conn) {
+            Sink<HANDLER, CONN> sink(*this, handler, conn);
+            size_t count = ExchangeFraming::parse(buffer, &sink, conn);
+            sink.flush();
+            return count;
+        }
+
+        uint64_t received() const { return received_; }
+
+        uint64_t repeated() const { return repeated_; }
+
+        uint64_t lost() const { return lost_; }
+
+    protected:
+
+        template<typename HANDLER, typename CONN>
+        class Sink {
+        public:
+            Sink(SequencedFraming &stream, HANDLER *handler, CONN *conn)
+                    : stream_(stream), handler_(handler), conn_(conn) {}
+
+            void onMsg(int32_t exchange, int64_t value, CONN *) {
+                ++stream_.received_;
+                if (stream_.skip_ > 0) {
+                    --stream_.skip_;
+                    ++stream_.repeated_;
+                    return;
+                }
+                exchanges_[count_] = exchange;
+                values_[count_] = value;
+                if (++count_ == MAX_BATCH) {
+                    flush();
+                }
+            }
+
+            void onMsg(const SequenceReset &reset, CONN *) {
+                flush();
+                handler_->onMsg(reset, conn_);
+                uint64_t next = static_cast<uint64_t>(reset.nextSequence_);
+                if (next < stream_.received_) {
+                    stream_.skip_ = stream_.received_ - next;
+                } else {
+                    stream_.lost_ += next - stream_.received_;
+                    stream_.skip_ = 0;
+                }
+                stream_.received_ = next;
+            }
+
+            template<typename T>
+            void onMsg(const T &msg, CONN *) {
+                flush();
+                handler_->onMsg(msg, conn_);
+            }
+
+            void flush() {
+                if (count_ == 0)
+                    return;
+                MessageBatch batch = {exchanges_, values_, count_, conn_->receivedNanos()};
+                count_ = 0;
+                handler_->onMsgBatch(batch, conn_);
+            }
+
+        protected:
+
+            SequencedFraming &stream_;
+            HANDLER *handler_;
+            CONN *conn_;
+            int32_t exchanges_[MAX_BATCH];
+            int64_t values_[MAX_BATCH];
+            size_t count_{0};
+        };
+
+        uint64_t received_{0};
+        uint64_t skip_{0};
+        uint64_t repeated_{0};
+        uint64_t lost_{0};
+    };
+
+    // starts out undecided: if the first record is a FormatRequest for FORMAT_DELTA_VARINT the request is echoed
+    // back and the rest of the stream is read as BatchPacketHeader + DeltaVarint packets, for FORMAT_TAGGED it is
+    // echoed and the rest goes through SequencedFraming, otherwise it is the plain 12 byte stream handled by
+    // BatchFraming. either way the handler sees onMsgBatch, tagged streams also onMsg for the other types. unlike the other
+    // framings it keeps per connection state, ClientConnectionT holds one instance per connection.
+    template<bool NETWORK_ORDER = false>
+    class NegotiatedFraming {
+    public:
+
+        template<typename HANDLER, typename CONN, typename BUFFER>
+        size_t parse(BUFFER &buffer, HANDLER *handler, CONN *conn) {
+            if (format_ < 0) {
+                if (buffer.rSize() < FormatRequest::LENGTH)
+                    return 0;
+
+                FormatRequest request;
+                memcpy(&request, buffer.rPtr(), sizeof(request));
+                format_ = FORMAT_FIXED;
+                if (request.magic_ == FormatRequest::MAGIC &&
+                    (request.format_ == FORMAT_DELTA_VARINT || request.format_ == FORMAT_TAGGED)) {
+                    buffer.rAdvance(sizeof(request));
+                    format_ = static_cast<int>(request.format_);
+                    conn->sendBytes(request);
+                }
+            }
+
+            if (format_ == FORMAT_FIXED)
+                return BatchFraming<NETWORK_ORDER>::parse(buffer, handler, conn);
+
+            if (format_ == FORMAT_TAGGED)
+                return tagged_.parse(buffer, handler, conn);
+
+            return parsePackets(buffer, handler, conn);
+        }
+
+        int format() const { return format_; }
+
+        const SequencedFraming<> &tagged() const { return tagged_; }
+
+    protected:
+
+        template<typename HANDLER, typename CONN, typename BUFFER>
+        size_t parsePackets(BUFFER &buffer, HANDLER *handler, CONN *conn) {
+            int32_t exchanges[BatchPacketHeader::MAX_VALUES];
+            int64_t values[BatchPacketHeader::MAX_VALUES];
+            size_t total = 0;
+
+            while (buffer.rSize() >= BatchPacketHeader::LENGTH) {
+                BatchPacketHeader header;
+                memcpy(&header, buffer.rPtr(), sizeof(header));
+
+                if (header.length_ > BatchPacketHeader::MAX_PACKET - BatchPacketHeader::LENGTH ||
+                    header.count_ > BatchPacketHeader::MAX_VALUES) {
+                    conn->protocolError("oversized batch packet");
+                    return total;
+                }
+
+                size_t packet = BatchPacketHeader::LENGTH + header.length_;
+                if (buffer.rSize() < packet)
+                    break;
+
+                const char *body = buffer.rPtr() + BatchPacketHeader::LENGTH;
+                if (DeltaVarint::decode(body, body + header.length_, header.count_, values) != header.length_) {
+                    conn->protocolError("malformed batch packet");
+                    return total;
+                }
+                buffer.rAdvance(packet);
+
+                for (uint32_t i = 0; i < header.count_; ++i) {
+                    exchanges[i] = header.exchangeNumber_;
+                }
+
+                MessageBatch batch = {exchanges, values, header.count_, conn->receivedNanos()};
+                handler->onMsgBatch(batch, conn);
+                total += header.count_;
+            }
+
+            return total;
+        }
+
+        int format_{-1};
+        SequencedFraming<> tagged_;
+    };
+
+    // builds one compressed packet, out needs BatchPacketHeader::MAX_PACKET bytes. count is at most MAX_VALUES.
+    inline size_t encodeBatchPacket(int32_t exchangeNumber, const int64_t *values, size_t count, char *out) {
+        BatchPacketHeader header;
+        header.exchangeNumber_ = exchangeNumber;
+        header.count_ = static_cast<uint32_t>(count);
+        header.length_ = static_cast<uint32_t>(DeltaVarint::encode(values, count, out + BatchPacketHeader::LENGTH));
+        memcpy(out, &header, sizeof(header));
+        return BatchPacketHeader::LENGTH + header.length_;
+    }
+
+    // the recovery stream of a multicast feed, FeedPacketHeader followed by its values, handed to
+    // HANDLER::onFeedPacket(const FeedPacketHeader &, const int64_t *values, CONN *)
+    struct FeedPacketFraming {
+        template<typename HANDLER, typename CONN, typename BUFFER>
+        static size_t parse(BUFFER &buffer, HANDLER *handler, CONN *conn) {
+            int64_t values[FeedPacketHeader::MAX_VALUES];
+            size_t total = 0;
+
+            while (buffer.rSize() >= FeedPacketHeader::LENGTH) {
+                FeedPacketHeader header;
+                memcpy(&header, buffer.rPtr(), sizeof(header));
+
+                if (header.count_ > FeedPacketHeader::MAX_VALUES) {
+                    conn->protocolError("oversized feed packet");
+                    return total;
+                }
+
+                size_t packet = FeedPacketHeader::LENGTH + header.count_ * sizeof(int64_t);
+                if (buffer.rSize() < packet)
+                    break;
+
+                memcpy(values, buffer.rPtr() + FeedPacketHeader::LENGTH, header.count_ * sizeof(int64_t));
+                buffer.rAdvance(packet);
+                handler->onFeedPacket(header, values, conn);
+                total += header.count_;
+            }
+
+            return total;
+        }
+    };
+
+}
+
+#endif //SOCKETLIB_FRAMING_H
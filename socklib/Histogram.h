@@ -0,0 +1,117 @@
+#pragma once
+
+#ifndef SOCKETLIB_HISTOGRAM_H
+#define SOCKETLIB_HISTOGRAM_H
+
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+
+namespace agpc {
+
+    // HDR style log-linear histogram: every power of two range is split into 2^SUB_BUCKET_BITS linear buckets,
+    // so the relative error stays below 1 / 2^SUB_BUCKET_BITS over the whole uint64 range. fixed size and
+    // trivially copyable so it can live in a shared memory region. single writer.
+    template<unsigned SUB_BUCKET_BITS = 4>
+    class LogLinearHistogram {
+    public:
+
+        enum {
+            SUB_BUCKETS = 1 << SUB_BUCKET_BITS,
+            BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS
+        };
+
+        LogLinearHistogram() { reset(); }
+
+        void reset() {
+            std::memset(counts_, 0, sizeof(counts_));
+            count_ = 0;
+            sum_ = 0;
+            min_ = UINT64_MAX;
+            max_ = 0;
+        }
+
+        void record(uint64_t value) {
+            ++counts_[index(value)];
+            ++count_;
+            sum_ += value;
+            if (value < min_)
+                min_ = value;
+            if (value > max_)
+                max_ = value;
+        }
+
+        uint64_t count() const { return count_; }
+
+        uint64_t min() const { return count_ ? min_ : 0; }
+
+        uint64_t max() const { return max_; }
+
+        double mean() const { return count_ ? static_cast<double>(sum_) / count_ : 0.0; }
+
+        // lower bound of the bucket holding the given percentile (0..100), clamped to the observed range
+        uint64_t percentile(double pct) const {
+            if (count_ == 0)
+                return 0;
+
+            uint64_t rank = static_cast<uint64_t>(pct / 100.0 * count_);
+            if (rank >= count_)
+                rank = count_ - 1;
+
+            uint64_t seen = 0;
+            for (unsigned i = 0; i < BUCKETS; ++i) {
+                seen += counts_[i];
+                if (seen > rank) {
+                    uint64_t low = bucketLow(i);
+                    return low < min_ ? min_ : (low > max_ ? max_ : low);
+                }
+            }
+            return max_;
+        }
+
+        void merge(const LogLinearHistogram &other) {
+            for (unsigned i = 0; i < BUCKETS; ++i) {
+                counts_[i] += other.counts_[i];
+            }
+            count_ += other.count_;
+            sum_ += other.sum_;
+            if (other.count_ && other.min_ < min_)
+                min_ = other.min_;
+            if (other.max_ > max_)
+                max_ = other.max_;
+        }
+
+        void print(std::ostream &os, const char *name) const {
+            os << name << ": count " << count() << " min " << min() << " p50 " << percentile(50)
+               << " p90 " << percentile(90) << " p99 " << percentile(99) << " p99.9 " << percentile(99.9)
+               << " max " << max() << " mean " << mean() << "\n";
+        }
+
+        static unsigned index(uint64_t value) {
+            if (value < SUB_BUCKETS)
+                return static_cast<unsigned>(value);
+
+            unsigned msb = 63 - __builtin_clzll(value);
+            unsigned shift = msb - SUB_BUCKET_BITS;
+            return (shift + 1) * SUB_BUCKETS + static_cast<unsigned>((value >> shift) & (SUB_BUCKETS - 1));
+        }
+
+        static uint64_t bucketLow(unsigned index) {
+            if (index < SUB_BUCKETS)
+                return index;
+
+            unsigned shift = index / SUB_BUCKETS - 1;
+            return static_cast<uint64_t>(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+        }
+
+    protected:
+
+        uint64_t counts_[BUCKETS];
+        uint64_t count_;
+        uint64_t sum_;
+        uint64_t min_;
+        uint64_t max_;
+    };
+}
+
+#endif //SOCKETLIB_HISTOGRAM_H
@@ -0,0 +1,251 @@
+#pragma once
+
+#ifndef SOCKETLIB_IOURING_H
+#define SOCKETLIB_IOURING_H
+
+#include <iostream>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "SockCommon.h"
+
+namespace agpc {
+
+    // minimal io_uring wrapper over the raw syscalls (no liburing): one SQ/CQ pair plus provided buffer rings.
+    // not thread safe, owned by a single EventService.
+    class IoUring {
+    public:
+
+        IoUring() {}
+
+        IoUring(const IoUring &) = delete;
+
+        IoUring &operator=(const IoUring &) = delete;
+
+        ~IoUring() {
+            for (size_t i = 0; i < ARRAY_SIZE(bufRings_); ++i) {
+                if (bufRings_[i].ring) {
+                    munmap(bufRings_[i].ring, bufRings_[i].ringBytes);
+                    munmap(bufRings_[i].buffers, bufRings_[i].bufferBytes);
+                }
+            }
+            if (sqes_)
+                munmap(sqes_, sqesBytes_);
+            if (cqRingPtr_ && cqRingPtr_ != sqRingPtr_)
+                munmap(cqRingPtr_, cqRingBytes_);
+            if (sqRingPtr_)
+                munmap(sqRingPtr_, sqRingBytes_);
+            if (fd_ != INVALID_FD_VAL)
+                ::close(fd_);
+        }
+
+        void init(unsigned entries) {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+            // the ring may be created on one thread and driven from a reactor thread, so no SINGLE_ISSUER
+            params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+            params.cq_entries = entries * 4;
+
+            fd_ = setup(entries, &params);
+            if (fd_ < 0 && errno == EINVAL) {
+                // older kernels without cooperative task run
+                std::memset(&params, 0, sizeof(params));
+                params.flags = IORING_SETUP_CQSIZE;
+                params.cq_entries = entries * 4;
+                fd_ = setup(entries, &params);
+            }
+
+            if (fd_ < 0) {
+                fd_ = INVALID_FD_VAL;
+                std::cout << "io_uring setup failed [" << errno << "]" << std::endl;
+                throw std::runtime_error("io_uring setup failed");
+            }
+
+            sqRingBytes_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cqRingBytes_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                if (cqRingBytes_ > sqRingBytes_)
+                    sqRingBytes_ = cqRingBytes_;
+                cqRingBytes_ = sqRingBytes_;
+            }
+
+            sqRingPtr_ = map(sqRingBytes_, IORING_OFF_SQ_RING);
+            cqRingPtr_ = (params.features & IORING_FEAT_SINGLE_MMAP) ? sqRingPtr_
+                                                                     : map(cqRingBytes_, IORING_OFF_CQ_RING);
+            sqesBytes_ = params.sq_entries * sizeof(io_uring_sqe);
+            sqes_ = static_cast<io_uring_sqe *>(map(sqesBytes_, IORING_OFF_SQES));
+
+            char *sq = static_cast<char *>(sqRingPtr_);
+            sqHead_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+            sqTail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+            sqMask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+            sqEntries_ = params.sq_entries;
+            unsigned *array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+            for (unsigned i = 0; i < sqEntries_; ++i) {
+                array[i] = i;
+            }
+
+            char *cq = static_cast<char *>(cqRingPtr_);
+            cqHead_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+            cqTail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+            cqMask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+            cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+            sqLocalTail_ = *sqTail_;
+        }
+
+        // returns a zeroed sqe, submitting queued entries first if the ring is full
+        io_uring_sqe *getSqe() {
+            if (sqLocalTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_) {
+                submit(0);
+            }
+
+            io_uring_sqe *sqe = &sqes_[sqLocalTail_ & sqMask_];
+            std::memset(sqe, 0, sizeof(*sqe));
+            ++sqLocalTail_;
+            return sqe;
+        }
+
+        unsigned pending() const { return sqLocalTail_ - *sqTail_; }
+
+        // submits everything queued in one io_uring_enter and optionally waits for waitNr completions
+        int submit(unsigned waitNr) {
+            unsigned toSubmit = pending();
+            __atomic_store_n(sqTail_, sqLocalTail_, __ATOMIC_RELEASE);
+
+            // GETEVENTS even when not waiting so pending task work gets run
+            unsigned flags = IORING_ENTER_GETEVENTS;
+
+            int result;
+            do {
+                result = (int) syscall(__NR_io_uring_enter, fd_, toSubmit, waitNr, flags, nullptr, 0);
+            } while (result < 0 && errno == EINTR && waitNr == 0);
+
+            return result;
+        }
+
+        io_uring_cqe *peekCqe() {
+            unsigned head = *cqHead_;
+            if (head == __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE))
+                return nullptr;
+            return &cqes_[head & cqMask_];
+        }
+
+        void cqeSeen() {
+            __atomic_store_n(cqHead_, *cqHead_ + 1, __ATOMIC_RELEASE);
+        }
+
+        // registers a ring of count buffers of bufferSize bytes each as buffer group bgid
+        void registerBufferRing(uint16_t bgid, unsigned count, unsigned bufferSize) {
+            if (bgid >= ARRAY_SIZE(bufRings_) || (count & (count - 1)) != 0) {
+                throw std::runtime_error("invalid buffer ring parameters");
+            }
+
+            BufRing &br = bufRings_[bgid];
+            br.ringBytes = count * sizeof(io_uring_buf);
+            br.ring = static_cast<io_uring_buf_ring *>(mmap(nullptr, br.ringBytes, PROT_READ | PROT_WRITE,
+                                                            MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
+            br.bufferBytes = static_cast<size_t>(count) * bufferSize;
+            br.buffers = static_cast<char *>(mmap(nullptr, br.bufferBytes, PROT_READ | PROT_WRITE,
+                                                  MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
+            if (br.ring == MAP_FAILED || br.buffers == MAP_FAILED) {
+                br.ring = nullptr;
+                std::cout << "buffer ring allocation failed [" << errno << "]" << std::endl;
+                throw std::runtime_error("buffer ring allocation failed");
+            }
+
+            io_uring_buf_reg reg;
+            std::memset(&reg, 0, sizeof(reg));
+            reg.ring_addr = reinterpret_cast<uint64_t>(br.ring);
+            reg.ring_entries = count;
+            reg.bgid = bgid;
+
+            if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+                std::cout << "buffer ring registration failed [" << errno << "]" << std::endl;
+                throw std::runtime_error("buffer ring registration failed");
+            }
+
+            br.count = count;
+            br.mask = count - 1;
+            br.bufferSize = bufferSize;
+            br.localTail = 0;
+            for (unsigned bid = 0; bid < count; ++bid) {
+                recycleBuffer(bgid, static_cast<uint16_t>(bid));
+            }
+        }
+
+        char *buffer(uint16_t bgid, uint16_t bid) {
+            const BufRing &br = bufRings_[bgid];
+            return br.buffers + static_cast<size_t>(bid) * br.bufferSize;
+        }
+
+        // hands a consumed buffer back to the kernel
+        void recycleBuffer(uint16_t bgid, uint16_t bid) {
+            BufRing &br = bufRings_[bgid];
+            // index the entries directly: in C++ the kernel header's flex array member does not start at offset 0
+            io_uring_buf *buf = reinterpret_cast<io_uring_buf *>(br.ring) + (br.localTail & br.mask);
+            buf->addr = reinterpret_cast<uint64_t>(buffer(bgid, bid));
+            buf->len = br.bufferSize;
+            buf->bid = bid;
+            ++br.localTail;
+            __atomic_store_n(&br.ring->tail, br.localTail, __ATOMIC_RELEASE);
+        }
+
+        int getFD() const { return fd_; }
+
+    protected:
+
+        struct BufRing {
+            io_uring_buf_ring *ring{nullptr};
+            size_t ringBytes{0};
+            char *buffers{nullptr};
+            size_t bufferBytes{0};
+            unsigned count{0};
+            unsigned mask{0};
+            unsigned bufferSize{0};
+            uint16_t localTail{0};
+        };
+
+        static int setup(unsigned entries, io_uring_params *params) {
+            return (int) syscall(__NR_io_uring_setup, entries, params);
+        }
+
+        void *map(size_t bytes, uint64_t offset) {
+            void *ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+            if (ptr == MAP_FAILED) {
+                std::cout << "io_uring mmap failed [" << errno << "]" << std::endl;
+                throw std::runtime_error("io_uring mmap failed");
+            }
+            return ptr;
+        }
+
+        int fd_{INVALID_FD_VAL};
+
+        void *sqRingPtr_{nullptr};
+        size_t sqRingBytes_{0};
+        void *cqRingPtr_{nullptr};
+        size_t cqRingBytes_{0};
+        io_uring_sqe *sqes_{nullptr};
+        size_t sqesBytes_{0};
+
+        unsigned *sqHead_{nullptr};
+        unsigned *sqTail_{nullptr};
+        unsigned sqMask_{0};
+        unsigned sqEntries_{0};
+        unsigned sqLocalTail_{0};
+
+        unsigned *cqHead_{nullptr};
+        unsigned *cqTail_{nullptr};
+        unsigned cqMask_{0};
+        io_uring_cqe *cqes_{nullptr};
+
+        BufRing bufRings_[4];
+    };
+}
+
+#endif //SOCKETLIB_IOURING_H
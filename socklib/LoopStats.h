@@ -0,0 +1,223 @@
+#pragma once
+
+#ifndef SOCKETLIB_LOOPSTATS_H
+#define SOCKETLIB_LOOPSTATS_H
+
+#include <iostream>
+#include <stdexcept>
+#include <atomic>
+#include <new>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "Histogram.h"
+#include "SockCommon.h"
+
+// instrumentation is compiled in only with -DAGPC_STATS, otherwise every AGPC_STATS_ONLY(...) vanishes
+#ifdef AGPC_STATS
+#define AGPC_STATS_ONLY(...) __VA_ARGS__
+#else
+#define AGPC_STATS_ONLY(...)
+#endif
+
+namespace agpc {
+
+    inline uint64_t monotonicNanos() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+    }
+
+    // the clock kernel receive timestamps are taken on
+    inline uint64_t realtimeNanos() {
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+    }
+
+    // per event loop numbers. plain data so it can be placed in a shared memory region and read by another
+    // process while the loop keeps writing (single writer, readers may see a slightly torn snapshot).
+    struct LoopStats {
+        enum {
+            MAGIC = 0x41475053
+        };
+
+        uint32_t magic{MAGIC};
+        uint32_t size{sizeof(LoopStats)};
+        LogLinearHistogram<> wakeToHandlerNanos;
+        LogLinearHistogram<> handlerNanos;
+        LogLinearHistogram<> bytesPerRecv;
+        LogLinearHistogram<> messagesPerWakeup;
+
+        void print(std::ostream &os) const {
+            wakeToHandlerNanos.print(os, "wake to handler ns");
+            handlerNanos.print(os, "handler ns");
+            bytesPerRecv.print(os, "bytes per recv");
+            messagesPerWakeup.print(os, "messages per wakeup");
+            os.flush();
+        }
+    };
+
+    struct ConnectionStats {
+        uint64_t messages{0};
+        uint64_t bytes{0};
+        uint64_t wakeups{0};
+    };
+
+    // a STATS living in /dev/shm/<name>, the creating side owns and unlinks it. STATS is plain data starting
+    // with its magic and size, like LoopStats.
+    template<typename STATS>
+    class SharedRegion {
+    public:
+
+        SharedRegion() {}
+
+        SharedRegion(const SharedRegion &) = delete;
+
+        SharedRegion &operator=(const SharedRegion &) = delete;
+
+        ~SharedRegion() {
+            if (stats_) {
+                munmap(stats_, sizeof(STATS));
+            }
+            if (owner_) {
+                shm_unlink(name_.c_str());
+            }
+        }
+
+        STATS *create(const std::string &name) {
+            int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+            if (fd < 0 || ftruncate(fd, sizeof(STATS)) != 0) {
+                std::cout << "failed to create stats region " << name << " [" << errno << "]" << std::endl;
+                if (fd >= 0)
+                    ::close(fd);
+                throw std::runtime_error("failed to create stats region");
+            }
+
+            map(fd, PROT_READ | PROT_WRITE, name);
+            owner_ = true;
+            name_ = name;
+            return new(stats_) STATS();
+        }
+
+        const STATS *open(const std::string &name) {
+            int fd = shm_open(name.c_str(), O_RDONLY, 0);
+            if (fd < 0) {
+                std::cout << "failed to open stats region " << name << " [" << errno << "]" << std::endl;
+                throw std::runtime_error("failed to open stats region");
+            }
+
+            map(fd, PROT_READ, name);
+            if (stats_->magic != STATS::MAGIC || stats_->size != sizeof(STATS)) {
+                throw std::runtime_error("stats region layout mismatch");
+            }
+            return stats_;
+        }
+
+    protected:
+
+        void map(int fd, int prot, const std::string &name) {
+            void *ptr = mmap(nullptr, sizeof(STATS), prot, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (ptr == MAP_FAILED) {
+                std::cout << "failed to map stats region " << name << " [" << errno << "]" << std::endl;
+                throw std::runtime_error("failed to map stats region");
+            }
+            stats_ = static_cast<STATS *>(ptr);
+        }
+
+        STATS *stats_{nullptr};
+        bool owner_{false};
+        std::string name_;
+    };
+
+    typedef SharedRegion<LoopStats> SharedStatsRegion;
+
+    // the magic /dev/shm/<name> starts with, telling which stats it holds. 0 if it cannot be read.
+    inline uint32_t sharedRegionMagic(const std::string &name) {
+        uint32_t magic = 0;
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd >= 0) {
+            if (::pread(fd, &magic, sizeof(magic), 0) != static_cast<ssize_t>(sizeof(magic))) {
+                magic = 0;
+            }
+            ::close(fd);
+        }
+        return magic;
+    }
+
+    // asks every watching event loop to dump its stats when the signal arrives. the handler only bumps a
+    // generation and pokes the loops' eventfds (both async signal safe); the loops dump on their own thread.
+    class StatsDumpSignal {
+    public:
+
+        enum {
+            MAX_WATCHERS = 64
+        };
+
+        static void install(int signo) {
+            struct sigaction sa;
+            std::memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = &StatsDumpSignal::onSignal;
+            sigemptyset(&sa.sa_mask);
+            sa.sa_flags = SA_RESTART;
+            if (sigaction(signo, &sa, nullptr) != 0) {
+                std::cout << "failed to install stats signal handler [" << errno << "]" << std::endl;
+            }
+        }
+
+        static void watch(int wakeFd) {
+            for (int i = 0; i < MAX_WATCHERS; ++i) {
+                int expected = 0;
+                if (watchers()[i].compare_exchange_strong(expected, wakeFd + 1))
+                    return;
+            }
+        }
+
+        static void unwatch(int wakeFd) {
+            for (int i = 0; i < MAX_WATCHERS; ++i) {
+                int expected = wakeFd + 1;
+                if (watchers()[i].compare_exchange_strong(expected, 0))
+                    return;
+            }
+        }
+
+        static uint32_t generation() { return generationCounter().load(std::memory_order_acquire); }
+
+    protected:
+
+        // fds are stored + 1 so the zero initialised table means empty
+        static std::atomic<int> *watchers() {
+            static std::atomic<int> table[MAX_WATCHERS];
+            return table;
+        }
+
+        static std::atomic<uint32_t> &generationCounter() {
+            static std::atomic<uint32_t> counter(0);
+            return counter;
+        }
+
+        static void onSignal(int) {
+            int saved = errno;
+            generationCounter().fetch_add(1, std::memory_order_acq_rel);
+
+            uint64_t one = 1;
+            for (int i = 0; i < MAX_WATCHERS; ++i) {
+                int fd = watchers()[i].load(std::memory_order_acquire);
+                if (fd > 0) {
+                    ssize_t result = ::write(fd - 1, &one, sizeof(one));
+                    (void) result;
+                }
+            }
+            errno = saved;
+        }
+    };
+}
+
+#endif //SOCKETLIB_LOOPSTATS_H
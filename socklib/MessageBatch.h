@@ -0,0 +1,134 @@
+#pragma once
+
+#ifndef SOCKETLIB_MESSAGEBATCH_H
+#define SOCKETLIB_MESSAGEBATCH_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include "Messages.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AGPC_X86_SIMD
+#endif
+
+namespace agpc {
+
+    // complete messages of one read, split into parallel exchange / value arrays. receivedNanos_ is the kernel
+    // receive time (CLOCK_REALTIME) where the transport has one, otherwise 0.
+    struct MessageBatch {
+        const int32_t *exchanges_;
+        const int64_t *values_;
+        size_t count_;
+        uint64_t receivedNanos_;
+    };
+
+    // unpacks count packed 12 byte IncomingMessages into separate arrays, byte swapping from network order when
+    // SWAP is set. x86 gets SSSE3 / AVX2 shuffles chosen at runtime, so no -m flags are needed.
+    template<bool SWAP>
+    class BatchDecoder {
+    public:
+
+        typedef void (*DecodeFn)(const char *, size_t, int32_t *, int64_t *);
+
+        static void decode(const char *src, size_t count, int32_t *exchanges, int64_t *values) {
+            static const DecodeFn fn = select();
+            fn(src, count, exchanges, values);
+        }
+
+        static DecodeFn select() {
+#ifdef AGPC_X86_SIMD
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2"))
+                return &decodeAvx2;
+            if (__builtin_cpu_supports("ssse3"))
+                return &decodeSsse3;
+#endif
+            return &decodeScalar;
+        }
+
+        static void decodeScalar(const char *src, size_t count, int32_t *exchanges, int64_t *values) {
+            for (size_t i = 0; i < count; ++i, src += IncomingMessage::LENGTH) {
+                IncomingMessage msg;
+                memcpy(&msg, src, sizeof(msg));
+                exchanges[i] = SWAP ? msg.getExchangeNTOH() : msg.getExchange();
+                values[i] = SWAP ? msg.getValueNTOH() : msg.getValue();
+            }
+        }
+
+#ifdef AGPC_X86_SIMD
+
+        // 4 records (48 bytes, 3 loads) per step. dwords: e0 v0 v0 e1 | v1 v1 e2 v2 | v2 e3 v3 v3
+        __attribute__((target("ssse3")))
+        static void decodeSsse3(const char *src, size_t count, int32_t *exchanges, int64_t *values) {
+            const __m128i swap32 = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+            const __m128i swap64 = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+
+            size_t i = 0;
+            for (; i + 4 <= count; i += 4, src += 4 * IncomingMessage::LENGTH) {
+                __m128i x0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+                __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 16));
+                __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 32));
+
+                __m128i v01 = _mm_unpacklo_epi64(_mm_srli_si128(x0, 4), x1);
+                __m128i v23 = _mm_unpacklo_epi64(_mm_alignr_epi8(x2, x1, 12), _mm_srli_si128(x2, 8));
+                __m128i e01 = _mm_shuffle_epi32(x0, _MM_SHUFFLE(3, 3, 3, 0));
+                __m128i e23 = _mm_unpacklo_epi32(_mm_shuffle_epi32(x1, _MM_SHUFFLE(2, 2, 2, 2)),
+                                                 _mm_shuffle_epi32(x2, _MM_SHUFFLE(1, 1, 1, 1)));
+                __m128i e = _mm_unpacklo_epi64(e01, e23);
+
+                if (SWAP) {
+                    e = _mm_shuffle_epi8(e, swap32);
+                    v01 = _mm_shuffle_epi8(v01, swap64);
+                    v23 = _mm_shuffle_epi8(v23, swap64);
+                }
+
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(exchanges + i), e);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(values + i), v01);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(values + i + 2), v23);
+            }
+
+            decodeScalar(src, count - i, exchanges + i, values + i);
+        }
+
+        // 4 records per step from two overlapping 32 byte loads (dwords 0-7 and 4-11), gathered with cross lane
+        // dword permutes
+        __attribute__((target("avx2")))
+        static void decodeAvx2(const char *src, size_t count, int32_t *exchanges, int64_t *values) {
+            const __m256i valuesLo = _mm256_setr_epi32(1, 2, 4, 5, 0, 0, 0, 0);
+            const __m256i valuesHi = _mm256_setr_epi32(0, 0, 0, 0, 3, 4, 6, 7);
+            const __m256i exchLo = _mm256_setr_epi32(0, 3, 6, 0, 0, 0, 0, 0);
+            const __m256i exchHi = _mm256_setr_epi32(0, 0, 0, 5, 0, 0, 0, 0);
+            const __m128i swap32 = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+            const __m256i swap64 = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                                    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+
+            size_t i = 0;
+            for (; i + 4 <= count; i += 4, src += 4 * IncomingMessage::LENGTH) {
+                __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+                __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 16));
+
+                __m256i v = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(a, valuesLo),
+                                               _mm256_permutevar8x32_epi32(b, valuesHi), 0xF0);
+                __m128i e = _mm256_castsi256_si128(
+                        _mm256_blend_epi32(_mm256_permutevar8x32_epi32(a, exchLo),
+                                           _mm256_permutevar8x32_epi32(b, exchHi), 0x08));
+
+                if (SWAP) {
+                    e = _mm_shuffle_epi8(e, swap32);
+                    v = _mm256_shuffle_epi8(v, swap64);
+                }
+
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(exchanges + i), e);
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(values + i), v);
+            }
+
+            decodeScalar(src, count - i, exchanges + i, values + i);
+        }
+
+#endif
+    };
+}
+
+#endif //SOCKETLIB_MESSAGEBATCH_H
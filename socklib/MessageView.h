@@ -0,0 +1,176 @@
+#pragma once
+
+#ifndef SOCKETLIB_MESSAGEVIEW_H
+#define SOCKETLIB_MESSAGEVIEW_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <endian.h>
+#include "Messages.h"
+
+// build with -DAGPC_VIEW_BOUNDS_CHECK to have every view access checked against the record / readable region
+#ifdef AGPC_VIEW_BOUNDS_CHECK
+#define AGPC_VIEW_CHECK(cond, what) do { if (!(cond)) throw std::runtime_error(what); } while (0)
+#else
+#define AGPC_VIEW_CHECK(cond, what) do {} while (0)
+#endif
+
+namespace agpc {
+
+    // byte order policies for views. fields are loaded with memcpy, so records may sit at any alignment.
+    struct HostOrder {
+        template<typename T>
+        static T load(const char *p) {
+            T value;
+            memcpy(&value, p, sizeof(T));
+            return value;
+        }
+    };
+
+    template<size_t SIZE>
+    struct BigEndian;
+
+    template<>
+    struct BigEndian<1> {
+        static uint8_t toHost(uint8_t v) { return v; }
+    };
+
+    template<>
+    struct BigEndian<2> {
+        static uint16_t toHost(uint16_t v) { return be16toh(v); }
+    };
+
+    template<>
+    struct BigEndian<4> {
+        static uint32_t toHost(uint32_t v) { return be32toh(v); }
+    };
+
+    template<>
+    struct BigEndian<8> {
+        static uint64_t toHost(uint64_t v) { return be64toh(v); }
+    };
+
+    struct NetworkOrder {
+        template<typename T>
+        static T load(const char *p) {
+            typedef decltype(BigEndian<sizeof(T)>::toHost(0)) Raw;
+            Raw raw;
+            memcpy(&raw, p, sizeof(raw));
+            raw = BigEndian<sizeof(T)>::toHost(raw);
+            T value;
+            memcpy(&value, &raw, sizeof(value));
+            return value;
+        }
+    };
+
+    // a MSG record where it lies in the receive buffer, valid until the buffer is advanced or compacted.
+    // fields are read by offset, so nothing is copied but the field itself.
+    template<typename MSG, typename ORDER = HostOrder>
+    class MessageView {
+    public:
+        static_assert(std::is_trivially_copyable<MSG>::value, "views need plain wire records");
+
+        typedef MSG Message;
+
+        explicit MessageView(const char *data) : data_(data) {}
+
+        template<typename F>
+        F field(size_t offset) const {
+            AGPC_VIEW_CHECK(offset + sizeof(F) <= sizeof(MSG), "message view field out of bounds");
+            return ORDER::template load<F>(data_ + offset);
+        }
+
+        // the raw record, still in wire byte order
+        MSG copy() const {
+            MSG msg;
+            memcpy(&msg, data_, sizeof(MSG));
+            return msg;
+        }
+
+        const char *data() const { return data_; }
+
+    protected:
+
+        const char *data_;
+    };
+
+    template<typename ORDER = HostOrder>
+    class IncomingView : public MessageView<IncomingMessage, ORDER> {
+    public:
+
+        explicit IncomingView(const char *data) : MessageView<IncomingMessage, ORDER>(data) {}
+
+        int32_t exchange() const {
+            return this->template field<int32_t>(offsetof(IncomingMessage, exchangeNumber_));
+        }
+
+        int64_t value() const {
+            return this->template field<int64_t>(offsetof(IncomingMessage, value_));
+        }
+    };
+
+    // the complete VIEW::Message records at the front of a buffer's readable region. iterate, then consume()
+    // to advance the buffer past them; a trailing partial record stays in the buffer.
+    template<typename VIEW>
+    class MessageViews {
+    public:
+
+        enum {
+            RECORD = sizeof(typename VIEW::Message)
+        };
+
+        class Iterator {
+        public:
+            Iterator(const char *pos, const char *end) : pos_(pos), end_(end) {}
+
+            VIEW operator*() const {
+                AGPC_VIEW_CHECK(pos_ + RECORD <= end_, "message view iterator out of bounds");
+                return VIEW(pos_);
+            }
+
+            Iterator &operator++() {
+                pos_ += RECORD;
+                return *this;
+            }
+
+            bool operator!=(const Iterator &other) const { return pos_ != other.pos_; }
+
+            bool operator==(const Iterator &other) const { return pos_ == other.pos_; }
+
+        protected:
+            const char *pos_;
+            const char *end_;
+        };
+
+        template<typename BUFFER>
+        explicit MessageViews(const BUFFER &buffer)
+                : begin_(buffer.rPtr()), count_(buffer.rSize() / RECORD) {}
+
+        Iterator begin() const { return Iterator(begin_, begin_ + count_ * RECORD); }
+
+        Iterator end() const { return Iterator(begin_ + count_ * RECORD, begin_ + count_ * RECORD); }
+
+        size_t size() const { return count_; }
+
+        VIEW operator[](size_t i) const {
+            AGPC_VIEW_CHECK(i < count_, "message view index out of bounds");
+            return VIEW(begin_ + i * RECORD);
+        }
+
+        template<typename BUFFER>
+        void consume(BUFFER &buffer) const {
+            AGPC_VIEW_CHECK(buffer.rPtr() == begin_, "buffer moved under its message views");
+            buffer.rAdvance(count_ * RECORD);
+        }
+
+    protected:
+
+        const char *begin_;
+        size_t count_;
+    };
+}
+
+#endif //SOCKETLIB_MESSAGEVIEW_H
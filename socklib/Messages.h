@@ -0,0 +1,120 @@
+#pragma once
+
+#ifndef SOCKETLIB_MESSAGES_H
+#define SOCKETLIB_MESSAGES_H
+
+#include <cstdint>
+#include <endian.h>
+#include <arpa/inet.h>
+
+namespace agpc {
+
+    inline uint64_t ntoh64(uint64_t value) { return be64toh(value); }
+
+#pragma pack(push, 1)
+
+    // TAG identifies the message inside a TaggedFraming stream, the plain 12 byte stream carries no tags
+
+    struct IncomingMessage {
+        int32_t exchangeNumber_;
+        int64_t value_;
+
+        enum {
+            TAG = 1,
+            LENGTH = 4 + 8
+        };
+
+        int32_t getExchangeNTOH() const { return ntohl(exchangeNumber_); }
+
+        int64_t getValueNTOH() const { return static_cast<int64_t>(ntoh64(static_cast<uint64_t>(value_))); }
+
+        int32_t getExchange() const { return exchangeNumber_; }
+
+        int64_t getValue() const { return value_; }
+
+    };
+
+    struct Heartbeat {
+        int32_t exchangeNumber_;
+
+        enum {
+            TAG = 2,
+            LENGTH = 4
+        };
+    };
+
+    // the exchange's values are numbered from 0 in the order sent; its next one is nextSequence_. set back after a
+    // reconnect or replay, the repeats up to the old position are dropped; set ahead, the values in between are lost
+    struct SequenceReset {
+        int32_t exchangeNumber_;
+        int64_t nextSequence_;
+
+        enum {
+            TAG = 3,
+            LENGTH = 4 + 8
+        };
+    };
+
+    // opens a compressed stream (see NegotiatedFraming): the exchange sends it as its first 12 byte record and
+    // the server echoes it back when it accepts the format
+    struct FormatRequest {
+        int32_t magic_;
+        int64_t format_;
+
+        enum {
+            MAGIC = 0x7a504741,
+            LENGTH = 4 + 8
+        };
+    };
+
+    enum WireFormat {
+        FORMAT_FIXED = 0,
+        FORMAT_DELTA_VARINT = 1,
+        // ExchangeFraming: tagged IncomingMessage, Heartbeat and SequenceReset frames
+        FORMAT_TAGGED = 2
+    };
+
+    // followed by length_ bytes holding count_ DeltaVarint encoded values of one exchange
+    struct BatchPacketHeader {
+        uint32_t length_;
+        int32_t exchangeNumber_;
+        uint32_t count_;
+
+        enum {
+            LENGTH = 4 + 4 + 4,
+            // keeps a whole packet inside the default 1k receive buffer
+            MAX_PACKET = 1024,
+            MAX_VALUES = (MAX_PACKET - LENGTH) / 10
+        };
+    };
+
+    // a multicast datagram, and a retransmitted packet on the recovery connection: count_ values (int64 each)
+    // of one exchange carrying the sequence numbers sequence_ .. sequence_ + count_ - 1. a packet with count_ 0
+    // is a heartbeat announcing the next sequence number, so a lost tail is noticed.
+    struct FeedPacketHeader {
+        int32_t exchangeNumber_;
+        uint32_t count_;
+        uint64_t sequence_;
+
+        enum {
+            LENGTH = 4 + 4 + 8,
+            MAX_DATAGRAM = 1472,
+            MAX_VALUES = (MAX_DATAGRAM - LENGTH) / 8
+        };
+    };
+
+    // asks the recovery server for count_ values of an exchange starting at sequence_
+    struct RetransmitRequest {
+        int32_t exchangeNumber_;
+        uint32_t count_;
+        uint64_t sequence_;
+
+        enum {
+            LENGTH = 4 + 4 + 8
+        };
+    };
+
+#pragma pack(pop)
+}
+
+#endif //SOCKETLIB_MESSAGES_H
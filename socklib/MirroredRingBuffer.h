@@ -0,0 +1,135 @@
+#pragma once
+
+#ifndef SOCKETLIB_MIRROREDRINGBUFFER_H
+#define SOCKETLIB_MIRROREDRINGBUFFER_H
+
+#include <iostream>
+#include <stdexcept>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace agpc {
+
+    // ring buffer whose memfd backing is mapped twice back to back, so both the readable and the writable
+    // region are always contiguous in memory. same interface as ByteBuffer, but compact() never moves data,
+    // which keeps large (multi MB) receive buffers cheap. SIZE must be a multiple of the page size.
+    template<size_t SIZE = 1 << 20>
+    class MirroredRingBuffer {
+    public:
+
+        MirroredRingBuffer() {
+            long page = sysconf(_SC_PAGESIZE);
+            if (page <= 0 || SIZE % static_cast<size_t>(page) != 0) {
+                throw std::runtime_error("mirrored ring buffer size must be a multiple of the page size");
+            }
+
+            int fd = memfd_create("agpc_ring", MFD_CLOEXEC);
+            if (fd < 0) {
+                std::cout << "memfd create failed [" << errno << "]" << std::endl;
+                throw std::runtime_error("memfd create failed");
+            }
+
+            if (ftruncate(fd, SIZE) != 0) {
+                std::cout << "memfd truncate failed [" << errno << "]" << std::endl;
+                ::close(fd);
+                throw std::runtime_error("memfd truncate failed");
+            }
+
+            // reserve 2 * SIZE of address space, then map the same file over both halves
+            void *base = mmap(nullptr, 2 * SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (base == MAP_FAILED) {
+                std::cout << "ring reservation failed [" << errno << "]" << std::endl;
+                ::close(fd);
+                throw std::runtime_error("ring reservation failed");
+            }
+
+            buf_ = static_cast<char *>(base);
+            if (mmap(buf_, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+                mmap(buf_ + SIZE, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+                std::cout << "ring mirror mapping failed [" << errno << "]" << std::endl;
+                munmap(base, 2 * SIZE);
+                ::close(fd);
+                throw std::runtime_error("ring mirror mapping failed");
+            }
+
+            ::close(fd);
+        }
+
+        MirroredRingBuffer(const MirroredRingBuffer &) = delete;
+
+        MirroredRingBuffer &operator=(const MirroredRingBuffer &) = delete;
+
+        ~MirroredRingBuffer() {
+            munmap(buf_, 2 * SIZE);
+        }
+
+        const char *begin() const { return buf_; }
+
+        const char *rPtr() const { return buf_ + rPos_; }
+
+        const char *rEnd() const { return buf_ + wPos_; }
+
+        char *wPtr() { return buf_ + wPos_; }
+
+        const char *wEnd() const { return buf_ + rPos_ + SIZE; }
+
+        size_t rSize() const { return wPos_ - rPos_; }
+
+        size_t wSize() const { return SIZE - rSize(); }
+
+        size_t capacity() const { return SIZE; }
+
+        size_t rPosition() const { return rPos_; }
+
+        size_t wPosition() const { return wPos_; }
+
+        // positions stay in [0, 2 * SIZE): once the reader crosses into the mirror both move back by SIZE
+        void rAdvance(const size_t length) {
+            rPos_ += length;
+            if (rPos_ >= SIZE) {
+                rPos_ -= SIZE;
+                wPos_ -= SIZE;
+            }
+        }
+
+        void wAdvance(const size_t length) {
+            wPos_ += length;
+        }
+
+        void clear() { rPos_ = wPos_ = 0; }
+
+        template<typename T>
+        void read(T &val) {
+            memcpy(&val, rPtr(), sizeof(T));
+            rAdvance(sizeof(T));
+        }
+
+        // nothing to move, the free space is always contiguous
+        void compact() {}
+
+        bool put(const char *bytes, size_t length) {
+            if (wSize() < length)
+                return false;
+            memcpy(wPtr(), bytes, length);
+            wAdvance(length);
+            return true;
+        }
+
+        template<typename T>
+        bool putBytes(T const &incoming) {
+            return put(reinterpret_cast<const char *>(&incoming), sizeof(incoming));
+        }
+
+    protected:
+
+        char *buf_{nullptr};
+        size_t rPos_{0};
+        size_t wPos_{0};
+    };
+}
+
+#endif //SOCKETLIB_MIRROREDRINGBUFFER_H
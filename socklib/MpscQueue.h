@@ -0,0 +1,98 @@
+#pragma once
+
+#ifndef SOCKETLIB_MPSCQUEUE_H
+#define SOCKETLIB_MPSCQUEUE_H
+
+#include <atomic>
+#include <utility>
+
+namespace agpc {
+
+    // unbounded lock-free multi producer / single consumer queue (Vyukov's intrusive node queue).
+    // push is one atomic exchange and never blocks; pop must only be called from the consumer thread.
+    template<typename T>
+    class MpscQueue {
+    public:
+
+        enum PopResult {
+            POPPED,
+            EMPTY,
+            // a producer swapped the head but has not linked its node yet, retry later
+            BUSY
+        };
+
+        MpscQueue() : head_(&stub_), tail_(&stub_) {}
+
+        MpscQueue(const MpscQueue &) = delete;
+
+        MpscQueue &operator=(const MpscQueue &) = delete;
+
+        ~MpscQueue() {
+            T discarded;
+            while (pop(discarded) != EMPTY);
+        }
+
+        void push(T value) {
+            push(new Node(std::move(value)));
+        }
+
+        PopResult pop(T &value) {
+            Node *tail = tail_;
+            Node *next = tail->next_.load(std::memory_order_acquire);
+
+            if (tail == &stub_) {
+                if (!next)
+                    return head_.load(std::memory_order_acquire) == &stub_ ? EMPTY : BUSY;
+                tail_ = next;
+                tail = next;
+                next = next->next_.load(std::memory_order_acquire);
+            }
+
+            if (next) {
+                tail_ = next;
+                value = std::move(tail->value_);
+                delete tail;
+                return POPPED;
+            }
+
+            if (tail != head_.load(std::memory_order_acquire))
+                return BUSY;
+
+            // tail is the last node, put the stub behind it so it can be released
+            push(&stub_);
+            next = tail->next_.load(std::memory_order_acquire);
+            if (next) {
+                tail_ = next;
+                value = std::move(tail->value_);
+                delete tail;
+                return POPPED;
+            }
+
+            return BUSY;
+        }
+
+    protected:
+
+        struct Node {
+            Node() : next_(nullptr) {}
+
+            explicit Node(T value) : next_(nullptr), value_(std::move(value)) {}
+
+            std::atomic<Node *> next_;
+            T value_;
+        };
+
+        void push(Node *node) {
+            node->next_.store(nullptr, std::memory_order_relaxed);
+            Node *prev = head_.exchange(node, std::memory_order_acq_rel);
+            prev->next_.store(node, std::memory_order_release);
+        }
+
+        Node stub_;
+        std::atomic<Node *> head_;
+        char pad_[64];
+        Node *tail_;
+    };
+}
+
+#endif //SOCKETLIB_MPSCQUEUE_H
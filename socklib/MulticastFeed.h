@@ -0,0 +1,273 @@
+#pragma once
+
+#ifndef SOCKETLIB_MULTICASTFEED_H
+#define SOCKETLIB_MULTICASTFEED_H
+
+#include <cstdint>
+#include <map>
+#include <vector>
+#include <sys/socket.h>
+#include "EventService.h"
+#include "UdpSocket.h"
+#include "ClientConnection.h"
+
+namespace agpc {
+
+    // receives FeedPacketHeader datagrams from a multicast group, many per recvmmsg, and hands the values of
+    // every exchange to HANDLER::onMsgBatch(const MessageBatch &, MulticastFeed *) strictly in sequence order.
+    // packets arriving ahead of a gap are held back and the missing range is requested once over a TCP
+    // recovery connection, whose answers go through the same sequencing. HANDLER also needs flush() and
+    // onFeedExchange(int32_t, MulticastFeed *), called when the first packet of an exchange shows up.
+    template<typename HANDLER>
+    class MulticastFeed : public EventNode {
+    public:
+        typedef ClientConnectionT<MulticastFeed, ByteBuffer<4096>, FeedPacketFraming> RecoveryConnection;
+
+        enum {
+            DATAGRAMS_PER_READ = 32,
+            RECV_BUFFER_SIZE = 4 << 20
+        };
+
+        MulticastFeed(EventService &eventService, HANDLER *handler)
+                : eventService_(eventService), handler_(handler) {
+            std::memset(&recoveryAddr_, '\0', sizeof(recoveryAddr_));
+        }
+
+        MulticastFeed(const MulticastFeed &) = delete;
+
+        MulticastFeed &operator=(const MulticastFeed &) = delete;
+
+        ~MulticastFeed() {
+            close();
+        }
+
+        // iface is the address of the local interface to join on, recovery the retransmit server
+        void open(const sockaddr_in &group, const in_addr &iface, const sockaddr_in &recovery) {
+            recoveryAddr_ = recovery;
+
+            try {
+                sock_.create();
+                sock_.setReuseAddr(true);
+                sock_.setRecvBufferSize(RECV_BUFFER_SIZE);
+                sock_.bind(group);
+                sock_.joinGroup(group.sin_addr, iface);
+                eventService_.registerHandler(sock_.getFD(), this);
+            }
+            catch (const std::exception &e) {
+                std::cout << "exception while opening multicast feed " << e.what() << std::endl;
+                sock_.close();
+                throw;
+            }
+        }
+
+        void close() {
+            if (sock_.getFD() != INVALID_FD_VAL) {
+                eventService_.removeFD(sock_.getFD());
+                sock_.close();
+            }
+            delete recovery_;
+            recovery_ = nullptr;
+        }
+
+        void onRead() override {
+            bool delivered = false;
+            int received;
+
+            do {
+                mmsghdr msgs[DATAGRAMS_PER_READ];
+                iovec iov[DATAGRAMS_PER_READ];
+                std::memset(msgs, 0, sizeof(msgs));
+                for (int i = 0; i < DATAGRAMS_PER_READ; ++i) {
+                    iov[i].iov_base = datagrams_[i];
+                    iov[i].iov_len = sizeof(datagrams_[i]);
+                    msgs[i].msg_hdr.msg_iov = &iov[i];
+                    msgs[i].msg_hdr.msg_iovlen = 1;
+                }
+
+                received = sock_.receiveBatch(msgs, DATAGRAMS_PER_READ);
+                for (int i = 0; i < received; ++i) {
+                    if (onDatagram(datagrams_[i], msgs[i].msg_len)) {
+                        delivered = true;
+                    }
+                }
+            } while (received == DATAGRAMS_PER_READ);
+
+            if (delivered) {
+                handler_->flush();
+            }
+        }
+
+        bool isReader() override { return true; }
+
+        // recovery connection callbacks
+
+        void onFeedPacket(const FeedPacketHeader &header, const int64_t *values, RecoveryConnection *) {
+            ++recovered_;
+            sequence(header, values);
+        }
+
+        void flush() {
+            handler_->flush();
+        }
+
+        // gaps still open are requested again once the next packet shows them
+        void onDisconnect(RecoveryConnection *conn) {
+            std::cout << "feed recovery connection lost" << std::endl;
+            recovery_ = nullptr;
+            for (typename std::map<int32_t, ExchangeSequence>::iterator it = exchanges_.begin();
+                 it != exchanges_.end(); ++it) {
+                it->second.requested = it->second.expected;
+            }
+            eventService_.post([conn]() { delete conn; });
+        }
+
+        uint64_t gaps() const { return gaps_; }
+
+        uint64_t recovered() const { return recovered_; }
+
+        uint64_t duplicates() const { return duplicates_; }
+
+    protected:
+
+        struct ExchangeSequence {
+            uint64_t expected{0};
+            // everything below this has been asked for
+            uint64_t requested{0};
+            std::map<uint64_t, std::vector<int64_t> > pending;
+        };
+
+        bool onDatagram(const char *data, size_t length) {
+            FeedPacketHeader header;
+            if (length < sizeof(header))
+                return false;
+
+            std::memcpy(&header, data, sizeof(header));
+            if (header.count_ > FeedPacketHeader::MAX_VALUES ||
+                length < FeedPacketHeader::LENGTH + header.count_ * sizeof(int64_t))
+                return false;
+
+            int64_t values[FeedPacketHeader::MAX_VALUES];
+            std::memcpy(values, data + FeedPacketHeader::LENGTH, header.count_ * sizeof(int64_t));
+            return sequence(header, values);
+        }
+
+        bool sequence(const FeedPacketHeader &header, const int64_t *values) {
+            typename std::map<int32_t, ExchangeSequence>::iterator found = exchanges_.find(header.exchangeNumber_);
+            if (found == exchanges_.end()) {
+                found = exchanges_.insert(std::make_pair(header.exchangeNumber_, ExchangeSequence())).first;
+                handler_->onFeedExchange(header.exchangeNumber_, this);
+            }
+
+            ExchangeSequence &s = found->second;
+            uint64_t begin = header.sequence_;
+            uint64_t end = begin + header.count_;
+
+            if (end <= s.expected) {
+                if (header.count_)
+                    ++duplicates_;
+                return false;
+            }
+
+            if (begin > s.expected) {
+                if (header.count_ && s.pending.find(begin) == s.pending.end()) {
+                    s.pending[begin].assign(values, values + header.count_);
+                }
+                request(header.exchangeNumber_, s, begin);
+                // the packet itself is held, so whatever comes next is only missing from its end on
+                if (begin <= s.requested && end > s.requested) {
+                    s.requested = end;
+                }
+                return false;
+            }
+
+            deliver(header.exchangeNumber_, values + (s.expected - begin), end - s.expected);
+            s.expected = end;
+
+            // held back packets that are now in sequence
+            while (!s.pending.empty() && s.pending.begin()->first <= s.expected) {
+                typename std::map<uint64_t, std::vector<int64_t> >::iterator it = s.pending.begin();
+                uint64_t pendingEnd = it->first + it->second.size();
+                if (pendingEnd > s.expected) {
+                    deliver(header.exchangeNumber_, &it->second[s.expected - it->first], pendingEnd - s.expected);
+                    s.expected = pendingEnd;
+                }
+                s.pending.erase(it);
+            }
+
+            if (!s.pending.empty()) {
+                request(header.exchangeNumber_, s, s.pending.begin()->first);
+            }
+            return true;
+        }
+
+        void deliver(int32_t exchangeNumber, const int64_t *values, size_t count) {
+            int32_t exchanges[FeedPacketHeader::MAX_VALUES];
+
+            while (count > 0) {
+                size_t n = count < FeedPacketHeader::MAX_VALUES ? count : static_cast<size_t>(FeedPacketHeader::MAX_VALUES);
+                for (size_t i = 0; i < n; ++i) {
+                    exchanges[i] = exchangeNumber;
+                }
+
+                MessageBatch batch = {exchanges, values, n, 0};
+                handler_->onMsgBatch(batch, this);
+                values += n;
+                count -= n;
+            }
+        }
+
+        // asks for [expected, upTo) minus what was already asked for
+        void request(int32_t exchangeNumber, ExchangeSequence &s, uint64_t upTo) {
+            uint64_t from = s.requested > s.expected ? s.requested : s.expected;
+            if (from >= upTo)
+                return;
+
+            if (!recovery_ && !connectRecovery())
+                return;
+
+            ++gaps_;
+            s.requested = upTo;
+            while (from < upTo) {
+                uint64_t n = upTo - from;
+                RetransmitRequest req;
+                req.exchangeNumber_ = exchangeNumber;
+                req.count_ = n > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(n);
+                req.sequence_ = from;
+                recovery_->sendBytes(req);
+                from += req.count_;
+            }
+        }
+
+        bool connectRecovery() {
+            if (recoveryAddr_.sin_port == 0)
+                return false;
+
+            TcpSocket sock;
+            try {
+                sock.create();
+                sock.connect(recoveryAddr_);
+            }
+            catch (const std::exception &e) {
+                std::cout << "feed recovery connect failed " << e.what() << std::endl;
+                sock.close();
+                return false;
+            }
+
+            recovery_ = new RecoveryConnection(eventService_, sock, this);
+            return true;
+        }
+
+        EventService &eventService_;
+        HANDLER *handler_;
+        UdpSocket sock_;
+        sockaddr_in recoveryAddr_;
+        RecoveryConnection *recovery_{nullptr};
+        std::map<int32_t, ExchangeSequence> exchanges_;
+        char datagrams_[DATAGRAMS_PER_READ][FeedPacketHeader::MAX_DATAGRAM];
+        uint64_t gaps_{0};
+        uint64_t recovered_{0};
+        uint64_t duplicates_{0};
+    };
+}
+
+#endif //SOCKETLIB_MULTICASTFEED_H
@@ -0,0 +1,213 @@
+#pragma once
+
+#ifndef SOCKETLIB_NUMATOPOLOGY_H
+#define SOCKETLIB_NUMATOPOLOGY_H
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <errno.h>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace agpc {
+
+    // cpus of every NUMA node as listed in /sys/devices/system/node. a box without that directory (or a
+    // kernel without NUMA) is one node holding every online cpu.
+    class NumaTopology {
+    public:
+
+        // from <linux/mempolicy.h>, which not every libc ships
+        enum {
+            MPOL_PREFERRED_ = 1,
+            MPOL_BIND_ = 2
+        };
+
+        NumaTopology() {
+            DIR *dir = opendir("/sys/devices/system/node");
+            if (dir) {
+                while (dirent *entry = readdir(dir)) {
+                    if (strncmp(entry->d_name, "node", 4) != 0 || !isdigit(entry->d_name[4]))
+                        continue;
+
+                    int node = atoi(entry->d_name + 4);
+                    std::ifstream in(std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist");
+                    std::string list;
+                    if (!in || !std::getline(in, list))
+                        continue;
+
+                    if (static_cast<size_t>(node) >= nodes_.size()) {
+                        nodes_.resize(node + 1);
+                    }
+                    nodes_[node] = parseCpuList(list);
+                }
+                closedir(dir);
+            }
+
+            if (nodes_.empty()) {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                nodes_.push_back(std::vector<int>());
+                for (long cpu = 0; cpu < (cpus > 0 ? cpus : 1); ++cpu) {
+                    nodes_.back().push_back(static_cast<int>(cpu));
+                }
+            }
+
+            for (size_t node = 0; node < nodes_.size(); ++node) {
+                if (!nodes_[node].empty()) {
+                    cpuNodes_.push_back(static_cast<int>(node));
+                }
+                for (int cpu : nodes_[node]) {
+                    if (static_cast<size_t>(cpu) >= nodeOfCpu_.size()) {
+                        nodeOfCpu_.resize(cpu + 1, -1);
+                    }
+                    nodeOfCpu_[cpu] = static_cast<int>(node);
+                }
+            }
+        }
+
+        static const NumaTopology &instance() {
+            static const NumaTopology topology;
+            return topology;
+        }
+
+        // node ids are indices, memory only nodes have no cpus
+        size_t nodes() const { return nodes_.size(); }
+
+        const std::vector<int> &cpus(int node) const { return nodes_[node]; }
+
+        // the nodes that have cpus, in id order
+        const std::vector<int> &cpuNodes() const { return cpuNodes_; }
+
+        int nodeOf(int cpu) const {
+            if (cpu < 0 || static_cast<size_t>(cpu) >= nodeOfCpu_.size())
+                return -1;
+            return nodeOfCpu_[cpu];
+        }
+
+        // node of the cpu the calling thread runs on right now, exact once the thread is pinned
+        static int currentNode() {
+            unsigned cpu = 0;
+            unsigned node = 0;
+            if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+                return 0;
+            return static_cast<int>(node);
+        }
+
+        // sets the policy of the pages in [addr, addr + length) before they are touched. preferred falls back
+        // to other nodes when the node is full, bind does not. false where the kernel has no NUMA support.
+        static bool bindMemory(void *addr, size_t length, int node, bool strict = false) {
+            if (node < 0 || node >= 64)
+                return false;
+
+            uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+            uintptr_t begin = reinterpret_cast<uintptr_t>(addr) & ~(page - 1);
+            uintptr_t end = (reinterpret_cast<uintptr_t>(addr) + length + page - 1) & ~(page - 1);
+
+            unsigned long mask = 1ul << node;
+            long result = syscall(SYS_mbind, begin, end - begin, strict ? MPOL_BIND_ : MPOL_PREFERRED_, &mask,
+                                  sizeof(mask) * 8, 0);
+            return result == 0;
+        }
+
+        // page granular memory preferring the given node (any node for -1), released with freeOnNode
+        static void *allocateOnNode(size_t length, int node) {
+            void *ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ptr == MAP_FAILED) {
+                std::cout << "node local allocation failed [" << errno << "]" << std::endl;
+                throw std::bad_alloc();
+            }
+
+            if (node >= 0) {
+                bindMemory(ptr, length, node);
+            }
+            return ptr;
+        }
+
+        static void freeOnNode(void *ptr, size_t length) {
+            munmap(ptr, length);
+        }
+
+    protected:
+
+        // "0-3,8-11"
+        static std::vector<int> parseCpuList(const std::string &list) {
+            std::vector<int> cpus;
+            std::stringstream ss(list);
+            std::string range;
+            while (std::getline(ss, range, ',')) {
+                if (range.empty())
+                    continue;
+
+                size_t dash = range.find('-');
+                int first = std::stoi(range.substr(0, dash));
+                int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+                for (int cpu = first; cpu <= last; ++cpu) {
+                    cpus.push_back(cpu);
+                }
+            }
+            return cpus;
+        }
+
+        std::vector<std::vector<int> > nodes_;
+        std::vector<int> cpuNodes_;
+        std::vector<int> nodeOfCpu_;
+    };
+
+    // std allocator placing large blocks on one node; small ones come from the heap and are placed by first
+    // touch. node -1 leaves placement to the kernel.
+    template<typename T>
+    class NodeAllocator {
+    public:
+        typedef T value_type;
+
+        enum {
+            MIN_NODE_BYTES = 64 * 1024
+        };
+
+        NodeAllocator(int node = -1) : node_(node) {}
+
+        template<typename U>
+        NodeAllocator(const NodeAllocator<U> &other) : node_(other.node()) {}
+
+        T *allocate(size_t n) {
+            size_t bytes = n * sizeof(T);
+            if (node_ < 0 || bytes < MIN_NODE_BYTES)
+                return static_cast<T *>(::operator new(bytes));
+            return static_cast<T *>(NumaTopology::allocateOnNode(bytes, node_));
+        }
+
+        void deallocate(T *ptr, size_t n) {
+            size_t bytes = n * sizeof(T);
+            if (node_ < 0 || bytes < MIN_NODE_BYTES) {
+                ::operator delete(ptr);
+            } else {
+                NumaTopology::freeOnNode(ptr, bytes);
+            }
+        }
+
+        int node() const { return node_; }
+
+        template<typename U>
+        bool operator==(const NodeAllocator<U> &other) const { return node_ == other.node(); }
+
+        template<typename U>
+        bool operator!=(const NodeAllocator<U> &other) const { return node_ != other.node(); }
+
+    protected:
+
+        int node_;
+    };
+}
+
+#endif //SOCKETLIB_NUMATOPOLOGY_H
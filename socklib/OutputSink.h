@@ -0,0 +1,335 @@
+#pragma once
+
+#ifndef SOCKETLIB_OUTPUTSINK_H
+#define SOCKETLIB_OUTPUTSINK_H
+
+#include <iostream>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "LoopStats.h"
+
+namespace agpc {
+
+    // "00" .. "99", two digits per table lookup and division
+    inline const char *digitPairs() {
+        static const char pairs[201] =
+                "00010203040506070809"
+                "10111213141516171819"
+                "20212223242526272829"
+                "30313233343536373839"
+                "40414243444546474849"
+                "50515253545556575859"
+                "60616263646566676869"
+                "70717273747576777879"
+                "80818283848586878889"
+                "90919293949596979899";
+        return pairs;
+    }
+
+    inline unsigned decimalDigits(uint64_t value) {
+        unsigned digits = 1;
+        for (;;) {
+            if (value < 10)
+                return digits;
+            if (value < 100)
+                return digits + 1;
+            if (value < 1000)
+                return digits + 2;
+            if (value < 10000)
+                return digits + 3;
+            value /= 10000;
+            digits += 4;
+        }
+    }
+
+    // writes value in decimal at out (at most 20 bytes, no terminator), returns the length
+    inline size_t formatInt64(char *out, int64_t value) {
+        char *p = out;
+        uint64_t u = static_cast<uint64_t>(value);
+        if (value < 0) {
+            *p++ = '-';
+            u = 0 - u;
+        }
+
+        unsigned digits = decimalDigits(u);
+        char *end = p + digits;
+        char *q = end;
+        const char *pairs = digitPairs();
+        while (u >= 100) {
+            unsigned pair = static_cast<unsigned>(u % 100) * 2;
+            u /= 100;
+            q -= 2;
+            memcpy(q, pairs + pair, 2);
+        }
+        if (u >= 10) {
+            memcpy(q - 2, pairs + u * 2, 2);
+        } else {
+            q[-1] = static_cast<char>('0' + u);
+        }
+        return end - out;
+    }
+
+    // when buffered output reaches the fd: at the end of every batch, once a size threshold is buffered, or
+    // once the oldest buffered byte is older than a deadline (checked on batch ends and flushIfDue())
+    enum class FlushPolicy {
+        PerBatch,
+        Size,
+        Deadline
+    };
+
+    struct OutputStats {
+        uint64_t flushes{0};
+        uint64_t syscalls{0};
+        uint64_t bytes{0};
+    };
+
+    // formats into a large reusable buffer and hands it to the fd in few, large writes. not thread safe.
+    //
+    // with vmsplice the pages are given to a pipe by reference instead of being copied. bytes once spliced
+    // must not change until the reader consumed them, so the sink alternates between two buffers, only ever
+    // appends to the current one and waits before refilling the other until the pipe drained past its end.
+    class OutputSink {
+    public:
+
+        enum {
+            MAX_INT64_CHARS = 20
+        };
+
+        explicit OutputSink(int fd = STDOUT_FILENO, size_t capacity = 1 << 20) : fd_(fd) {
+            long page = sysconf(_SC_PAGESIZE);
+            capacity_ = (capacity + page - 1) / page * page;
+            for (Buffer &buffer : buffers_) {
+                void *ptr = mmap(nullptr, capacity_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (ptr == MAP_FAILED) {
+                    std::cout << "output buffer mapping failed [" << errno << "]" << std::endl;
+                    throw std::runtime_error("output buffer mapping failed");
+                }
+                buffer.data = static_cast<char *>(ptr);
+            }
+        }
+
+        OutputSink(const OutputSink &) = delete;
+
+        OutputSink &operator=(const OutputSink &) = delete;
+
+        ~OutputSink() {
+            flush();
+            for (Buffer &buffer : buffers_) {
+                munmap(buffer.data, capacity_);
+            }
+        }
+
+        void setPolicy(FlushPolicy policy, size_t sizeThreshold = 0, uint64_t deadlineNanos = 0) {
+            policy_ = policy;
+            sizeThreshold_ = sizeThreshold < capacity_ ? sizeThreshold : capacity_;
+            deadlineNanos_ = deadlineNanos;
+        }
+
+        FlushPolicy policy() const { return policy_; }
+
+        uint64_t deadlineNanos() const { return deadlineNanos_; }
+
+        // only for a pipe; false (and plain writes) for anything else
+        bool useVmsplice() {
+            struct stat st;
+            if (fstat(fd_, &st) != 0 || !S_ISFIFO(st.st_mode))
+                return false;
+
+            fcntl(fd_, F_SETPIPE_SZ, static_cast<int>(capacity_));
+            vmsplice_ = true;
+            return true;
+        }
+
+        void put(int64_t value) {
+            reserve(MAX_INT64_CHARS + 1);
+            Buffer &buffer = buffers_[current_];
+            buffer.end += formatInt64(buffer.data + buffer.end, value);
+            buffer.data[buffer.end++] = ' ';
+        }
+
+        void put(char c) {
+            reserve(1);
+            Buffer &buffer = buffers_[current_];
+            buffer.data[buffer.end++] = c;
+        }
+
+        void write(const char *data, size_t length) {
+            while (length > 0) {
+                reserve(1);
+                Buffer &buffer = buffers_[current_];
+                size_t chunk = capacity_ - buffer.end < length ? capacity_ - buffer.end : length;
+                memcpy(buffer.data + buffer.end, data, chunk);
+                buffer.end += chunk;
+                data += chunk;
+                length -= chunk;
+            }
+        }
+
+        // ends a line of output and applies the flush policy
+        void endBatch() {
+            put('\n');
+            switch (policy_) {
+                case FlushPolicy::PerBatch:
+                    flush();
+                    break;
+                case FlushPolicy::Size:
+                    if (pending() >= sizeThreshold_) {
+                        flush();
+                    }
+                    break;
+                case FlushPolicy::Deadline:
+                    flushIfDue(monotonicNanos());
+                    break;
+            }
+        }
+
+        // for a timer while no batches arrive
+        void flushIfDue(uint64_t now) {
+            if (pending() && now - pendingSince_ >= deadlineNanos_) {
+                flush();
+            }
+        }
+
+        void flush() {
+            Buffer &buffer = buffers_[current_];
+            if (buffer.end == buffer.flushed)
+                return;
+
+            if (vmsplice_) {
+                splice(buffer);
+            } else {
+                writeOut(buffer.data + buffer.flushed, buffer.end - buffer.flushed);
+                // copied by the kernel, the buffer can start over
+                buffer.end = 0;
+            }
+            buffer.flushed = buffer.end;
+            ++stats_.flushes;
+        }
+
+        size_t pending() const {
+            const Buffer &buffer = buffers_[current_];
+            return buffer.end - buffer.flushed;
+        }
+
+        const OutputStats &stats() const { return stats_; }
+
+    protected:
+
+        struct Buffer {
+            char *data{nullptr};
+            // [0, flushed) went out, [flushed, end) is pending
+            size_t flushed{0};
+            size_t end{0};
+            // stream position just past this buffer's last spliced byte
+            uint64_t streamEnd{0};
+        };
+
+        void reserve(size_t length) {
+            Buffer &buffer = buffers_[current_];
+            if (buffer.end == buffer.flushed) {
+                pendingSince_ = monotonicNanos();
+            }
+            if (capacity_ - buffer.end >= length)
+                return;
+
+            flush();
+            if (vmsplice_) {
+                current_ ^= 1;
+                waitConsumed(buffers_[current_]);
+                buffers_[current_].flushed = 0;
+                buffers_[current_].end = 0;
+            }
+            pendingSince_ = monotonicNanos();
+        }
+
+        void writeOut(const char *data, size_t length) {
+            while (length > 0) {
+                ssize_t written = ::write(fd_, data, length);
+                ++stats_.syscalls;
+                if (written < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN) {
+                        waitWritable();
+                        continue;
+                    }
+                    std::cout << "output write failed [" << errno << "]" << std::endl;
+                    throw std::runtime_error("output write failed");
+                }
+                data += written;
+                length -= written;
+                stats_.bytes += written;
+            }
+        }
+
+        void splice(Buffer &buffer) {
+            iovec iov;
+            iov.iov_base = buffer.data + buffer.flushed;
+            iov.iov_len = buffer.end - buffer.flushed;
+            while (iov.iov_len > 0) {
+                ssize_t spliced = vmsplice(fd_, &iov, 1, 0);
+                ++stats_.syscalls;
+                if (spliced < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN) {
+                        waitWritable();
+                        continue;
+                    }
+                    std::cout << "output vmsplice failed [" << errno << "]" << std::endl;
+                    throw std::runtime_error("output vmsplice failed");
+                }
+                iov.iov_base = static_cast<char *>(iov.iov_base) + spliced;
+                iov.iov_len -= spliced;
+                stats_.bytes += spliced;
+            }
+            buffer.streamEnd = stats_.bytes;
+        }
+
+        // the pipe is FIFO: whatever is still unread is the tail of what we spliced (or others wrote since)
+        void waitConsumed(const Buffer &buffer) {
+            for (;;) {
+                int unread = 0;
+                if (ioctl(fd_, FIONREAD, &unread) != 0)
+                    return;
+                if (static_cast<uint64_t>(unread) <= stats_.bytes && stats_.bytes - unread >= buffer.streamEnd)
+                    return;
+
+                timespec pause{0, 50000};
+                nanosleep(&pause, nullptr);
+            }
+        }
+
+        void waitWritable() {
+            pollfd pfd;
+            pfd.fd = fd_;
+            pfd.events = POLLOUT;
+            ::poll(&pfd, 1, -1);
+        }
+
+        int fd_;
+        size_t capacity_;
+        Buffer buffers_[2];
+        int current_{0};
+        bool vmsplice_{false};
+        FlushPolicy policy_{FlushPolicy::PerBatch};
+        size_t sizeThreshold_{0};
+        uint64_t deadlineNanos_{0};
+        // monotonic time of the oldest pending byte
+        uint64_t pendingSince_{0};
+        OutputStats stats_;
+    };
+}
+
+#endif //SOCKETLIB_OUTPUTSINK_H
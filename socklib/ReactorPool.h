@@ -0,0 +1,120 @@
+#pragma once
+
+#ifndef SOCKETLIB_REACTORPOOL_H
+#define SOCKETLIB_REACTORPOOL_H
+
+#include <memory>
+#include <thread>
+#include <pthread.h>
+#include <sched.h>
+#include "EventService.h"
+#include "NumaTopology.h"
+
+namespace agpc {
+
+    // Compact pins reactor i to cpu firstCpu + i. SpreadNodes deals the reactors out round robin over the NUMA
+    // nodes, each pinned to the next free cpu of its node, so a dual socket box gets a reactor per socket first.
+    enum class ReactorPlacement {
+        Compact,
+        SpreadNodes
+    };
+
+    // N independent EventService loops, one per thread. Reactor 0 runs on the thread that calls run(),
+    // so a pool of one behaves exactly like a plain EventService::poll().
+    class ReactorPool {
+    public:
+
+        explicit ReactorPool(size_t count, int firstCpu = -1, EventBackend backend = AGPC_DEFAULT_EVENT_BACKEND,
+                             ReactorPlacement placement = ReactorPlacement::Compact)
+                : firstCpu_(firstCpu), placement_(placement) {
+            if (count == 0) {
+                throw std::runtime_error("reactor pool needs at least one reactor");
+            }
+
+            for (size_t i = 0; i < count; ++i) {
+                services_.push_back(std::unique_ptr<EventService>(new EventService(backend)));
+            }
+        }
+
+        size_t size() const { return services_.size(); }
+
+        EventService &service(size_t index) { return *services_[index]; }
+
+        // the index of one of the pool's services, size() for any other
+        size_t indexOf(const EventService &service) const {
+            for (size_t i = 0; i < services_.size(); ++i) {
+                if (services_[i].get() == &service)
+                    return i;
+            }
+            return services_.size();
+        }
+
+        void run() {
+            for (size_t i = 1; i < services_.size(); ++i) {
+                threads_.push_back(std::thread(&ReactorPool::runReactor, this, i));
+            }
+
+            runReactor(0);
+
+            for (std::thread &t : threads_) {
+                t.join();
+            }
+            threads_.clear();
+        }
+
+        void stop() {
+            for (auto &service : services_) {
+                service->stop();
+            }
+        }
+
+        int cpuFor(size_t index) const {
+            if (placement_ == ReactorPlacement::SpreadNodes) {
+                const NumaTopology &topology = NumaTopology::instance();
+                const std::vector<int> &nodes = topology.cpuNodes();
+                const std::vector<int> &cpus = topology.cpus(nodes[index % nodes.size()]);
+                return cpus[(index / nodes.size()) % cpus.size()];
+            }
+
+            if (firstCpu_ < 0)
+                return -1;
+
+            unsigned cpus = std::thread::hardware_concurrency();
+            return static_cast<int>((firstCpu_ + index) % (cpus ? cpus : 1));
+        }
+
+        // -1 while the reactor is not pinned
+        int nodeFor(size_t index) const {
+            return NumaTopology::instance().nodeOf(cpuFor(index));
+        }
+
+        static void pinThread(int cpu) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+
+            int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if (result != 0) {
+                std::cout << "failed to pin reactor to cpu " << cpu << " [" << result << "]" << std::endl;
+            }
+        }
+
+    protected:
+
+        void runReactor(size_t index) {
+            int cpu = cpuFor(index);
+            if (cpu >= 0) {
+                pinThread(cpu);
+            }
+
+            services_[index]->poll();
+        }
+
+        int firstCpu_;
+        ReactorPlacement placement_;
+        std::vector<std::unique_ptr<EventService>> services_;
+        std::vector<std::thread> threads_;
+    };
+}
+
+#endif //SOCKETLIB_REACTORPOOL_H
@@ -0,0 +1,156 @@
+#pragma once
+
+#ifndef SOCKETLIB_SENDQUEUE_H
+#define SOCKETLIB_SENDQUEUE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <vector>
+#include <sys/uio.h>
+#include "TcpSocket.h"
+
+namespace agpc {
+
+    // outbound bytes of one connection, kept in a chain of fixed size chunks. small appends are packed into the
+    // tail chunk and flush() hands up to MAX_IOV chunks to a single sendmsg, so a burst of 12 byte messages
+    // costs one syscall instead of one each. whatever the kernel does not take stays queued for the next
+    // flush, nothing is dropped. drained chunks are kept for reuse.
+    template<size_t CHUNK_SIZE = 16384>
+    class SendQueue {
+    public:
+
+        enum {
+            MAX_IOV = 64
+        };
+
+        SendQueue() {}
+
+        SendQueue(const SendQueue &) = delete;
+
+        SendQueue &operator=(const SendQueue &) = delete;
+
+        ~SendQueue() {
+            for (Chunk *chunk : chunks_) {
+                delete chunk;
+            }
+            for (Chunk *chunk : spare_) {
+                delete chunk;
+            }
+        }
+
+        bool empty() const { return size_ == 0; }
+
+        size_t size() const { return size_; }
+
+        void append(const char *bytes, size_t length) {
+            while (length > 0) {
+                if (chunks_.empty() || chunks_.back()->wPos_ == CHUNK_SIZE) {
+                    chunks_.push_back(newChunk());
+                }
+
+                Chunk *tail = chunks_.back();
+                size_t n = CHUNK_SIZE - tail->wPos_;
+                if (n > length)
+                    n = length;
+
+                memcpy(tail->buf_ + tail->wPos_, bytes, n);
+                tail->wPos_ += n;
+                bytes += n;
+                length -= n;
+                size_ += n;
+            }
+        }
+
+        template<typename T>
+        void putBytes(T const &outgoing) {
+            append(reinterpret_cast<const char *>(&outgoing), sizeof(outgoing));
+        }
+
+        // bytes written (0 if the socket buffer is full) or -1 if the connection failed
+        ssize_t flush(TcpSocket &sock) {
+            ssize_t total = 0;
+
+            while (size_ > 0) {
+                iovec iov[MAX_IOV];
+                int count = 0;
+                for (size_t i = 0; i < chunks_.size() && count < MAX_IOV; ++i) {
+                    Chunk *chunk = chunks_[i];
+                    iov[count].iov_base = chunk->buf_ + chunk->rPos_;
+                    iov[count].iov_len = chunk->wPos_ - chunk->rPos_;
+                    ++count;
+                }
+
+                ssize_t sent = sock.sendv(iov, count);
+                if (sent < 0)
+                    return -1;
+
+                consume(static_cast<size_t>(sent));
+                total += sent;
+
+                // a short write means the socket buffer is full
+                size_t offered = 0;
+                for (int i = 0; i < count; ++i) {
+                    offered += iov[i].iov_len;
+                }
+                if (static_cast<size_t>(sent) < offered)
+                    break;
+            }
+
+            return total;
+        }
+
+        void clear() {
+            while (!chunks_.empty()) {
+                release(chunks_.front());
+                chunks_.pop_front();
+            }
+            size_ = 0;
+        }
+
+    protected:
+
+        struct Chunk {
+            size_t rPos_{0};
+            size_t wPos_{0};
+            char buf_[CHUNK_SIZE];
+        };
+
+        Chunk *newChunk() {
+            if (spare_.empty())
+                return new Chunk();
+
+            Chunk *chunk = spare_.back();
+            spare_.pop_back();
+            return chunk;
+        }
+
+        void release(Chunk *chunk) {
+            chunk->rPos_ = chunk->wPos_ = 0;
+            spare_.push_back(chunk);
+        }
+
+        void consume(size_t length) {
+            size_ -= length;
+            while (length > 0) {
+                Chunk *head = chunks_.front();
+                size_t n = head->wPos_ - head->rPos_;
+                if (n > length) {
+                    head->rPos_ += length;
+                    return;
+                }
+
+                length -= n;
+                chunks_.pop_front();
+                release(head);
+            }
+        }
+
+        std::deque<Chunk *> chunks_;
+        std::vector<Chunk *> spare_;
+        size_t size_{0};
+    };
+}
+
+#endif //SOCKETLIB_SENDQUEUE_H
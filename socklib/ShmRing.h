@@ -0,0 +1,203 @@
+#pragma once
+
+#ifndef SOCKETLIB_SHMRING_H
+#define SOCKETLIB_SHMRING_H
+
+#include <iostream>
+#include <stdexcept>
+#include <atomic>
+#include <new>
+#include <cstdint>
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Messages.h"
+
+namespace agpc {
+
+    // first page of the shared region. the producer only writes head_, the consumer only tail_; each sits on its
+    // own cache line so the two sides never share one.
+    struct ShmRingControl {
+        enum {
+            MAGIC = 0x41475352
+        };
+
+        uint32_t magic_;
+        uint32_t pageSize_;
+        uint64_t dataSize_;
+        alignas(64) std::atomic<uint64_t> head_;
+        alignas(64) std::atomic<uint64_t> tail_;
+        // set by a consumer about to block on the doorbell, cleared by whoever rings it
+        alignas(64) std::atomic<uint32_t> sleeping_;
+        char pad_[64 - sizeof(std::atomic<uint32_t>)];
+    };
+
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the ring indices must be lock free to work across processes");
+
+    // single producer / single consumer byte ring in a memfd shared between two processes. the data pages are
+    // mapped twice back to back (as in MirroredRingBuffer), so a record is always contiguous even where it wraps.
+    // head and tail count bytes since creation and never wrap themselves.
+    class ShmRing {
+    public:
+
+        ShmRing() {}
+
+        ShmRing(const ShmRing &) = delete;
+
+        ShmRing &operator=(const ShmRing &) = delete;
+
+        ~ShmRing() {
+            unmap();
+        }
+
+        // a fresh ring of dataSize bytes (a multiple of the page size), returns the memfd to map and pass on
+        static int create(size_t dataSize) {
+            long page = sysconf(_SC_PAGESIZE);
+            if (page <= 0 || dataSize % static_cast<size_t>(page) != 0) {
+                throw std::runtime_error("shm ring size must be a multiple of the page size");
+            }
+
+            int fd = memfd_create("agpc_shm_ring", MFD_CLOEXEC);
+            if (fd < 0) {
+                std::cout << "memfd create failed [" << errno << "]" << std::endl;
+                throw std::runtime_error("memfd create failed");
+            }
+
+            if (ftruncate(fd, page + dataSize) != 0) {
+                std::cout << "memfd truncate failed [" << errno << "]" << std::endl;
+                ::close(fd);
+                throw std::runtime_error("memfd truncate failed");
+            }
+
+            void *ptr = mmap(nullptr, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (ptr == MAP_FAILED) {
+                std::cout << "shm ring mapping failed [" << errno << "]" << std::endl;
+                ::close(fd);
+                throw std::runtime_error("shm ring mapping failed");
+            }
+
+            ShmRingControl *control = new(ptr) ShmRingControl();
+            control->magic_ = ShmRingControl::MAGIC;
+            control->pageSize_ = static_cast<uint32_t>(page);
+            control->dataSize_ = dataSize;
+            control->head_.store(0);
+            control->tail_.store(0);
+            // the consumer starts out blocked on the doorbell, the first push has to ring it
+            control->sleeping_.store(1);
+            munmap(ptr, page);
+            return fd;
+        }
+
+        void map(int fd) {
+            long page = sysconf(_SC_PAGESIZE);
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size <= page) {
+                throw std::runtime_error("not a shm ring");
+            }
+
+            void *ptr = mmap(nullptr, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (ptr == MAP_FAILED) {
+                std::cout << "shm ring mapping failed [" << errno << "]" << std::endl;
+                throw std::runtime_error("shm ring mapping failed");
+            }
+            control_ = static_cast<ShmRingControl *>(ptr);
+            pageSize_ = page;
+
+            if (control_->magic_ != ShmRingControl::MAGIC || control_->pageSize_ != page ||
+                static_cast<off_t>(page + control_->dataSize_) != st.st_size) {
+                unmap();
+                throw std::runtime_error("shm ring layout mismatch");
+            }
+            size_ = control_->dataSize_;
+
+            void *base = mmap(nullptr, 2 * size_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (base == MAP_FAILED) {
+                std::cout << "shm ring reservation failed [" << errno << "]" << std::endl;
+                unmap();
+                throw std::runtime_error("shm ring reservation failed");
+            }
+
+            data_ = static_cast<char *>(base);
+            if (mmap(data_, size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, page) == MAP_FAILED ||
+                mmap(data_ + size_, size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, page) == MAP_FAILED) {
+                std::cout << "shm ring mirror mapping failed [" << errno << "]" << std::endl;
+                unmap();
+                throw std::runtime_error("shm ring mirror mapping failed");
+            }
+        }
+
+        void unmap() {
+            if (data_) {
+                munmap(data_, 2 * size_);
+                data_ = nullptr;
+            }
+            if (control_) {
+                munmap(control_, pageSize_);
+                control_ = nullptr;
+            }
+        }
+
+        size_t capacity() const { return size_; }
+
+        // producer side. copies as many whole records as fit and publishes them with one store, returns how
+        // many. true in doorbell means the consumer went to sleep and has to be woken.
+        size_t push(const IncomingMessage *msgs, size_t count, bool &doorbell) {
+            uint64_t head = control_->head_.load(std::memory_order_relaxed);
+            uint64_t tail = control_->tail_.load(std::memory_order_acquire);
+            size_t room = (size_ - (head - tail)) / sizeof(IncomingMessage);
+            if (count > room)
+                count = room;
+
+            doorbell = false;
+            if (count == 0)
+                return 0;
+
+            memcpy(data_ + head % size_, msgs, count * sizeof(IncomingMessage));
+            control_->head_.store(head + count * sizeof(IncomingMessage), std::memory_order_release);
+
+            // pairs with the fence in prepareSleep: either the consumer sees the new head or we see it sleeping
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (control_->sleeping_.load(std::memory_order_relaxed)) {
+                doorbell = control_->sleeping_.exchange(0, std::memory_order_relaxed) != 0;
+            }
+            return count;
+        }
+
+        // consumer side
+
+        size_t readable() const {
+            return control_->head_.load(std::memory_order_acquire) - control_->tail_.load(std::memory_order_relaxed);
+        }
+
+        const char *rPtr() const {
+            return data_ + control_->tail_.load(std::memory_order_relaxed) % size_;
+        }
+
+        void consume(size_t length) {
+            control_->tail_.store(control_->tail_.load(std::memory_order_relaxed) + length,
+                                  std::memory_order_release);
+        }
+
+        // announce that the consumer is about to block. false if data arrived meanwhile, keep reading then.
+        bool prepareSleep() {
+            control_->sleeping_.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (readable() != 0) {
+                control_->sleeping_.store(0, std::memory_order_relaxed);
+                return false;
+            }
+            return true;
+        }
+
+    protected:
+
+        ShmRingControl *control_{nullptr};
+        char *data_{nullptr};
+        size_t size_{0};
+        long pageSize_{0};
+    };
+}
+
+#endif //SOCKETLIB_SHMRING_H
@@ -0,0 +1,417 @@
+#pragma once
+
+#ifndef SOCKETLIB_SHMTRANSPORT_H
+#define SOCKETLIB_SHMTRANSPORT_H
+
+#include <string>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include "EventService.h"
+#include "ShmRing.h"
+#include "MessageBatch.h"
+
+// IncomingMessage transport for producers on the same host. a producer connects to a unix socket, the consumer
+// answers with a fresh ShmRing memfd and an eventfd doorbell (SCM_RIGHTS) and from then on messages only go
+// through the ring. the producer rings the doorbell only when the consumer announced it is about to block, so
+// a busy consumer takes no syscalls at all. the unix socket stays open to signal the end of the producer.
+
+namespace agpc {
+
+    namespace shm {
+
+        inline sockaddr_un unixAddress(const std::string &path) {
+            sockaddr_un addr;
+            std::memset(&addr, '\0', sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(addr.sun_path)) {
+                throw std::runtime_error("unix socket path too long");
+            }
+            std::memcpy(addr.sun_path, path.c_str(), path.size());
+            return addr;
+        }
+
+        inline bool sendFds(int sock, const int *fds, int count) {
+            char byte = 0;
+            iovec iov;
+            iov.iov_base = &byte;
+            iov.iov_len = 1;
+
+            char control[CMSG_SPACE(sizeof(int) * 2)];
+            std::memset(control, '\0', sizeof(control));
+            msghdr msg;
+            std::memset(&msg, '\0', sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+            std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+            return ::sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+        }
+
+        // blocking, fills fds and returns how many arrived
+        inline int recvFds(int sock, int *fds, int count) {
+            char byte;
+            iovec iov;
+            iov.iov_base = &byte;
+            iov.iov_len = 1;
+
+            char control[CMSG_SPACE(sizeof(int) * 2)];
+            msghdr msg;
+            std::memset(&msg, '\0', sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            if (::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+                return 0;
+
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                return 0;
+
+            int received = static_cast<int>((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            if (received > count)
+                received = count;
+            std::memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * received);
+            return received;
+        }
+    }
+
+    // consuming end of one producer's ring, driven by the doorbell eventfd. delivers to
+    // HANDLER::onMsgBatch(const MessageBatch &, ShmConsumer *) followed by flush(), and calls
+    // HANDLER::onDisconnect(ShmConsumer *) once the producer is gone and the ring is drained. the handler owns
+    // the consumer from accept on and may delete it after onDisconnect returns.
+    template<typename HANDLER>
+    class ShmConsumer : public EventNode {
+    public:
+
+        enum {
+            MAX_BATCH = 512,
+            // then the rest of the reactor gets its turn, the doorbell is rung again to come back
+            MAX_PER_WAKEUP = 64 * MAX_BATCH
+        };
+
+        ShmConsumer(EventService &eventService, HANDLER *handler, int ringFd, int doorbellFd, int controlFd)
+                : eventService_(eventService), handler_(handler), doorbellFd_(doorbellFd), control_(this, controlFd) {
+            ring_.map(ringFd);
+            eventService_.registerHandler(doorbellFd_, this);
+            eventService_.registerHandler(controlFd, &control_);
+        }
+
+        ShmConsumer(const ShmConsumer &) = delete;
+
+        ShmConsumer &operator=(const ShmConsumer &) = delete;
+
+        ~ShmConsumer() {
+            close();
+        }
+
+        void onRead() override {
+            if (closed_)
+                return;
+
+            uint64_t counter;
+            while (::read(doorbellFd_, &counter, sizeof(counter)) == sizeof(counter)) {}
+            drain(MAX_PER_WAKEUP);
+        }
+
+        bool isReader() override { return true; }
+
+        bool isStopped() const { return stopped_; }
+
+        void setStopped() { stopped_ = true; }
+
+        EventService &eventService() { return eventService_; }
+
+        void disconnect() {
+            if (closed_)
+                return;
+
+            drain(SIZE_MAX);
+            close();
+            handler_->onDisconnect(this);
+        }
+
+    protected:
+
+        class Control : public EventNode {
+        public:
+            Control(ShmConsumer *consumer, int fd) : consumer_(consumer), fd_(fd) {}
+
+            // the producer sends nothing after the handshake, anything readable is its close
+            void onRead() override {
+                char buf[64];
+                ssize_t n = ::recv(fd_, buf, sizeof(buf), MSG_DONTWAIT);
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                    consumer_->disconnect();
+                }
+            }
+
+            bool isReader() override { return true; }
+
+            ShmConsumer *consumer_;
+            int fd_;
+        };
+
+        void drain(size_t limit) {
+            size_t delivered = 0;
+
+            for (;;) {
+                size_t available;
+                while ((available = ring_.readable() / IncomingMessage::LENGTH) > 0) {
+                    size_t count = available < MAX_BATCH ? available : static_cast<size_t>(MAX_BATCH);
+                    BatchDecoder<false>::decode(ring_.rPtr(), count, exchanges_, values_);
+                    ring_.consume(count * IncomingMessage::LENGTH);
+
+                    MessageBatch batch = {exchanges_, values_, count, 0};
+                    handler_->onMsgBatch(batch, this);
+                    delivered += count;
+
+                    if (delivered >= limit) {
+                        uint64_t one = 1;
+                        ssize_t ignored = ::write(doorbellFd_, &one, sizeof(one));
+                        (void) ignored;
+                        handler_->flush();
+                        return;
+                    }
+                }
+
+                if (ring_.prepareSleep())
+                    break;
+            }
+
+            if (delivered > 0) {
+                handler_->flush();
+            }
+        }
+
+        void close() {
+            if (closed_)
+                return;
+
+            closed_ = true;
+            eventService_.removeFD(doorbellFd_);
+            eventService_.removeFD(control_.fd_);
+            ::close(doorbellFd_);
+            ::close(control_.fd_);
+            ring_.unmap();
+        }
+
+        EventService &eventService_;
+        HANDLER *handler_;
+        ShmRing ring_;
+        int doorbellFd_;
+        Control control_;
+        bool stopped_{false};
+        bool closed_{false};
+        int32_t exchanges_[MAX_BATCH];
+        int64_t values_[MAX_BATCH];
+    };
+
+    // unix socket the producers connect to. every accepted producer gets its own ring and doorbell and is
+    // handed to HANDLER::addShmConsumer(ShmConsumer<HANDLER> *) on the listener's reactor.
+    template<typename HANDLER>
+    class ShmListener : public EventNode {
+    public:
+
+        typedef ShmConsumer<HANDLER> Consumer;
+
+        ShmListener(EventService &eventService, HANDLER *handler, size_t ringSize = 1 << 20)
+                : eventService_(eventService), handler_(handler), ringSize_(ringSize) {}
+
+        ShmListener(const ShmListener &) = delete;
+
+        ShmListener &operator=(const ShmListener &) = delete;
+
+        ~ShmListener() {
+            close();
+        }
+
+        void listen(const std::string &path, int backlog) {
+            sockaddr_un addr = shm::unixAddress(path);
+
+            fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd_ == INVALID_FD_VAL) {
+                std::cout << "unable to create a unix socket [" << errno << "]" << std::endl;
+                throw std::runtime_error("unable to create unix socket");
+            }
+
+            ::unlink(path.c_str());
+            if (::bind(fd_, (sockaddr *) &addr, sizeof(addr)) != 0 || ::listen(fd_, backlog) != 0) {
+                std::cout << "failed to listen on " << path << " [" << errno << "]" << std::endl;
+                ::close(fd_);
+                fd_ = INVALID_FD_VAL;
+                throw std::runtime_error("failed to listen on unix socket");
+            }
+
+            path_ = path;
+            eventService_.registerHandler(fd_, this);
+        }
+
+        void close() {
+            if (fd_ != INVALID_FD_VAL) {
+                eventService_.removeFD(fd_);
+                ::close(fd_);
+                ::unlink(path_.c_str());
+                fd_ = INVALID_FD_VAL;
+            }
+        }
+
+        void onRead() override {
+            int client;
+            while ((client = ::accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != INVALID_FD_VAL) {
+                accepted(client);
+            }
+        }
+
+        bool isReader() override { return true; }
+
+    protected:
+
+        void accepted(int client) {
+            int fds[2] = {INVALID_FD_VAL, INVALID_FD_VAL};
+            try {
+                fds[0] = ShmRing::create(ringSize_);
+                fds[1] = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                if (fds[1] == INVALID_FD_VAL) {
+                    std::cout << "eventfd failed [" << errno << "]" << std::endl;
+                    throw std::runtime_error("eventfd failed");
+                }
+
+                if (!shm::sendFds(client, fds, 2)) {
+                    std::cout << "failed to hand the ring to the producer [" << errno << "]" << std::endl;
+                    throw std::runtime_error("failed to hand the ring to the producer");
+                }
+
+                handler_->addShmConsumer(new Consumer(eventService_, handler_, fds[0], fds[1], client));
+                ::close(fds[0]);
+            }
+            catch (const std::exception &e) {
+                std::cout << "exception while accepting shm producer " << e.what() << std::endl;
+                for (int fd : fds) {
+                    if (fd != INVALID_FD_VAL)
+                        ::close(fd);
+                }
+                ::close(client);
+            }
+        }
+
+        EventService &eventService_;
+        HANDLER *handler_;
+        size_t ringSize_;
+        int fd_{INVALID_FD_VAL};
+        std::string path_;
+    };
+
+    // producing end, used from a plain thread. push() waits for room when the consumer falls behind.
+    class ShmProducer {
+    public:
+
+        ShmProducer() {}
+
+        ShmProducer(const ShmProducer &) = delete;
+
+        ShmProducer &operator=(const ShmProducer &) = delete;
+
+        ~ShmProducer() {
+            close();
+        }
+
+        void connect(const std::string &path) {
+            sockaddr_un addr = shm::unixAddress(path);
+
+            sock_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (sock_ == INVALID_FD_VAL || ::connect(sock_, (sockaddr *) &addr, sizeof(addr)) != 0) {
+                std::cout << "failed to connect to " << path << " [" << errno << "]" << std::endl;
+                close();
+                throw std::runtime_error("failed to connect to unix socket");
+            }
+
+            int fds[2];
+            if (shm::recvFds(sock_, fds, 2) != 2) {
+                close();
+                throw std::runtime_error("no shm ring received");
+            }
+
+            doorbellFd_ = fds[1];
+            try {
+                ring_.map(fds[0]);
+            }
+            catch (const std::exception &) {
+                ::close(fds[0]);
+                close();
+                throw;
+            }
+            ::close(fds[0]);
+        }
+
+        // as many as fit right now
+        size_t tryPush(const IncomingMessage *msgs, size_t count) {
+            bool doorbell;
+            size_t pushed = ring_.push(msgs, count, doorbell);
+            if (doorbell) {
+                uint64_t one = 1;
+                ssize_t ignored = ::write(doorbellFd_, &one, sizeof(one));
+                (void) ignored;
+            }
+            return pushed;
+        }
+
+        void push(const IncomingMessage *msgs, size_t count) {
+            while (count > 0) {
+                size_t pushed = tryPush(msgs, count);
+                if (pushed == 0) {
+                    if (consumerGone()) {
+                        throw std::runtime_error("shm consumer gone");
+                    }
+                    sched_yield();
+                }
+                msgs += pushed;
+                count -= pushed;
+            }
+        }
+
+        void push(const IncomingMessage &msg) {
+            push(&msg, 1);
+        }
+
+        // the consumer drains what is left and then sees the producer gone
+        void close() {
+            ring_.unmap();
+            if (doorbellFd_ != INVALID_FD_VAL) {
+                ::close(doorbellFd_);
+                doorbellFd_ = INVALID_FD_VAL;
+            }
+            if (sock_ != INVALID_FD_VAL) {
+                ::close(sock_);
+                sock_ = INVALID_FD_VAL;
+            }
+        }
+
+    protected:
+
+        // only asked while the ring is full, the consumer never writes to the socket
+        bool consumerGone() {
+            pollfd pfd;
+            pfd.fd = sock_;
+            pfd.events = POLLIN | POLLRDHUP;
+            pfd.revents = 0;
+            return ::poll(&pfd, 1, 0) > 0;
+        }
+
+        ShmRing ring_;
+        int sock_{INVALID_FD_VAL};
+        int doorbellFd_{INVALID_FD_VAL};
+    };
+}
+
+#endif //SOCKETLIB_SHMTRANSPORT_H
@@ -0,0 +1,99 @@
+#pragma once
+
+#ifndef SOCKETLIB_SLABALLOCATOR_H
+#define SOCKETLIB_SLABALLOCATOR_H
+
+#include <iostream>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstddef>
+#include <vector>
+#include "NumaTopology.h"
+
+namespace agpc {
+
+    // fixed size object pool: objects live in cache line aligned slots carved out of slabs of SLOTS_PER_SLAB,
+    // freed slots go on an intrusive free list and are reused before a new slab is allocated. slabs are only
+    // returned to the system when the allocator is destroyed. with a node the slabs are placed on that NUMA
+    // node. not thread safe.
+    template<typename T, size_t SLOTS_PER_SLAB = 64>
+    class SlabAllocator {
+    public:
+
+        enum {
+            CACHE_LINE = 64,
+            SLOT_SIZE = ((sizeof(T) + CACHE_LINE - 1) / CACHE_LINE) * CACHE_LINE
+        };
+
+        explicit SlabAllocator(int node = -1) : node_(node) {}
+
+        SlabAllocator(const SlabAllocator &) = delete;
+
+        SlabAllocator &operator=(const SlabAllocator &) = delete;
+
+        ~SlabAllocator() {
+            for (void *slab : slabs_) {
+                if (node_ >= 0) {
+                    NumaTopology::freeOnNode(slab, SLOT_SIZE * SLOTS_PER_SLAB);
+                } else {
+                    free(slab);
+                }
+            }
+        }
+
+        void *allocate() {
+            if (!free_) {
+                grow();
+            }
+
+            FreeSlot *slot = free_;
+            free_ = slot->next_;
+            ++used_;
+            return slot;
+        }
+
+        void deallocate(void *ptr) {
+            FreeSlot *slot = static_cast<FreeSlot *>(ptr);
+            slot->next_ = free_;
+            free_ = slot;
+            --used_;
+        }
+
+        size_t used() const { return used_; }
+
+        size_t capacity() const { return slabs_.size() * SLOTS_PER_SLAB; }
+
+        int node() const { return node_; }
+
+    protected:
+
+        struct FreeSlot {
+            FreeSlot *next_;
+        };
+
+        void grow() {
+            void *slab = nullptr;
+            if (node_ >= 0) {
+                slab = NumaTopology::allocateOnNode(SLOT_SIZE * SLOTS_PER_SLAB, node_);
+            } else if (posix_memalign(&slab, CACHE_LINE, SLOT_SIZE * SLOTS_PER_SLAB) != 0) {
+                std::cout << "slab allocation failed" << std::endl;
+                throw std::bad_alloc();
+            }
+            slabs_.push_back(slab);
+
+            char *base = static_cast<char *>(slab);
+            for (size_t i = SLOTS_PER_SLAB; i > 0; --i) {
+                FreeSlot *slot = reinterpret_cast<FreeSlot *>(base + (i - 1) * SLOT_SIZE);
+                slot->next_ = free_;
+                free_ = slot;
+            }
+        }
+
+        int node_;
+        FreeSlot *free_{nullptr};
+        size_t used_{0};
+        std::vector<void *> slabs_;
+    };
+}
+
+#endif //SOCKETLIB_SLABALLOCATOR_H
@@ -3,16 +3,29 @@
 #ifndef SOCKETLIB_TCPSOCKET_H
 #define SOCKETLIB_TCPSOCKET_H
 
+#include <sys/uio.h>
+#include <linux/net_tstamp.h>
 #include "EventService.h"
 
 namespace agpc {
 
+    // kernel receive stamps: Software through SO_TIMESTAMPNS, Hardware through SO_TIMESTAMPING asking for NIC
+    // stamps with the kernel's software stamp as fallback. NIC stamps also need the interface's receive filter
+    // turned on (SIOCSHWTSTAMP, e.g. hwstamp_ctl), until then the software ones come through, and are in the
+    // NIC's clock, comparable with CLOCK_REALTIME once phc2sys keeps the two together.
+    enum class RxTimestamps {
+        Off,
+        Software,
+        Hardware
+    };
+
     class TcpSocket {
     public:
 
         TcpSocket() {}
 
-        void create() {
+        // busyPollMicros > 0 enables SO_BUSY_POLL; sockets accepted from a listener inherit the setting
+        void create(int busyPollMicros = 0) {
             if (fd_ != INVALID_FD_VAL) {
                 throw std::runtime_error("socket already created");
             }
@@ -26,6 +39,10 @@ namespace agpc {
 
             setNonBlocking();
             setNoDelay();
+
+            if (busyPollMicros > 0) {
+                setBusyPoll(busyPollMicros);
+            }
         }
 
         bool connect(const sockaddr_in &sa) {
@@ -68,6 +85,15 @@ namespace agpc {
             }
         }
 
+        void setReusePort(bool reuse) {
+            int r = (reuse ? 1 : 0);
+            int result = ::setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT, (const char *) &r, sizeof(r));
+            if (result < 0) {
+                std::cout << "setReusePort failed [" << errno << "]" << std::endl;
+                throw std::runtime_error("setReusePort failed");
+            }
+        }
+
         void bind(const sockaddr_in &sa) {
             int result = ::bind(fd_, (sockaddr *) &sa, sizeof(sa));
             if (result != 0) {
@@ -119,6 +145,99 @@ namespace agpc {
             }
         }
 
+        // on a SO_REUSEPORT listener: prefer it for connections whose packets are received on this cpu, so a
+        // reactor pinned next to the NIC queue's IRQ gets the flows of that queue
+        void setIncomingCpu(int cpu) {
+            int result = ::setsockopt(fd_, SOL_SOCKET, SO_INCOMING_CPU, (const char *) &cpu, sizeof(cpu));
+            if (result < 0) {
+                std::cout << "failed to set incoming cpu sock option [" << errno << "]" << std::endl;
+            }
+        }
+
+        void setBusyPoll(int micros) {
+            int result = ::setsockopt(fd_, SOL_SOCKET, SO_BUSY_POLL, (const char *) &micros, sizeof(micros));
+
+            if (result < 0) {
+                std::cout << "failed to set busy poll sock option [" << errno << "]" << std::endl;
+            }
+        }
+
+        // the kernel stamps every received segment (CLOCK_REALTIME), handed out by the receive overload below
+        void setReceiveTimestamps(RxTimestamps mode) {
+            int on = (mode == RxTimestamps::Software ? 1 : 0);
+            int result = ::setsockopt(fd_, SOL_SOCKET, SO_TIMESTAMPNS, (const char *) &on, sizeof(on));
+            if (result < 0) {
+                std::cout << "setReceiveTimestamps failed [" << errno << "]" << std::endl;
+                throw std::runtime_error("setReceiveTimestamps failed");
+            }
+            setReceiveTimestamping(mode == RxTimestamps::Hardware
+                                   ? SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+                                     SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE : 0);
+        }
+
+        // SO_TIMESTAMPING with any SOF_TIMESTAMPING_* flags, 0 turns it off
+        void setReceiveTimestamping(unsigned flags) {
+            int value = static_cast<int>(flags);
+            int result = ::setsockopt(fd_, SOL_SOCKET, SO_TIMESTAMPING, (const char *) &value, sizeof(value));
+            if (result < 0) {
+                std::cout << "setReceiveTimestamping failed [" << errno << "]" << std::endl;
+                throw std::runtime_error("setReceiveTimestamping failed");
+            }
+        }
+
+        // receive() through recvmsg, receivedNanos is the kernel receive time of the data read (the last segment
+        // for tcp) or left alone if no stamp came with it. with RxTimestamps::Hardware the raw NIC stamp is taken
+        // when there is one, the software one otherwise.
+        ssize_t receive(char *buffer, size_t len, int flags, uint64_t &receivedNanos) {
+            iovec iov;
+            iov.iov_base = buffer;
+            iov.iov_len = len;
+
+            char control[CMSG_SPACE(3 * sizeof(timespec))];
+            msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            ssize_t result = ::recvmsg(fd_, &msg, flags);
+            if (result > 0) {
+                for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                    if (cmsg->cmsg_level != SOL_SOCKET)
+                        continue;
+
+                    timespec ts[3];
+                    if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                        std::memcpy(ts, CMSG_DATA(cmsg), sizeof(timespec));
+                    } else if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                        std::memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+                        if (ts[2].tv_sec != 0 || ts[2].tv_nsec != 0)
+                            ts[0] = ts[2];
+                    } else {
+                        continue;
+                    }
+
+                    if (ts[0].tv_sec != 0 || ts[0].tv_nsec != 0) {
+                        receivedNanos = static_cast<uint64_t>(ts[0].tv_sec) * 1000000000ull + ts[0].tv_nsec;
+                    }
+                }
+                return result;
+            }
+
+            if (result == 0) {
+                return -1; // conenction closed
+            }
+
+            switch (errno) {
+                case EWOULDBLOCK:
+                case ETIMEDOUT:
+                    return 0;
+                default:
+                    return -1;
+            }
+        }
+
         ssize_t receive(char *buffer, size_t len, int flags) {
             ssize_t result = ::recv(fd_, (char *) buffer, len, flags);
             if (result > 0)
@@ -153,6 +272,28 @@ namespace agpc {
             }
         }
 
+        // gathers count buffers into one send, same return convention as send()
+        ssize_t sendv(const iovec *iov, int count) {
+            msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = const_cast<iovec *>(iov);
+            msg.msg_iovlen = count;
+
+            ssize_t result = ::sendmsg(fd_, &msg, MSG_NOSIGNAL);
+            if (result >= 0) {
+                return result;
+            }
+
+            switch (errno) {
+                case EWOULDBLOCK:
+                case EINTR:
+                case ETIMEDOUT:
+                    return 0;
+                default:
+                    return -1;
+            }
+        }
+
         void close() {
             if (fd_ != INVALID_FD_VAL)
                 ::close(fd_);
@@ -160,7 +301,7 @@ namespace agpc {
 
         int getFD() { return fd_; }
 
-        int setFD(int fd) { fd_ = fd; }
+        void setFD(int fd) { fd_ = fd; }
 
     protected:
 
@@ -0,0 +1,168 @@
+#pragma once
+
+#ifndef SOCKETLIB_UDPSOCKET_H
+#define SOCKETLIB_UDPSOCKET_H
+
+#include <string>
+#include <arpa/inet.h>
+#include "EventService.h"
+
+namespace agpc {
+
+    // "a.b.c.d:port"
+    inline sockaddr_in parseEndpoint(const std::string &hostPort) {
+        sockaddr_in addr;
+        std::memset(&addr, '\0', sizeof(addr));
+        addr.sin_family = AF_INET;
+
+        size_t colon = hostPort.rfind(':');
+        if (colon == std::string::npos ||
+            inet_pton(AF_INET, hostPort.substr(0, colon).c_str(), &addr.sin_addr) != 1) {
+            std::cout << "bad endpoint " << hostPort << std::endl;
+            throw std::runtime_error("bad endpoint, expected a.b.c.d:port");
+        }
+
+        addr.sin_port = htons(static_cast<uint16_t>(std::stoi(hostPort.substr(colon + 1))));
+        return addr;
+    }
+
+    class UdpSocket {
+    public:
+
+        UdpSocket() {}
+
+        void create() {
+            if (fd_ != INVALID_FD_VAL) {
+                throw std::runtime_error("socket already created");
+            }
+
+            fd_ = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+            if (fd_ == INVALID_FD_VAL) {
+                std::cout << "unable to create a udp socket [" << errno << "]" << std::endl;
+                throw std::runtime_error("unable to create udp socket");
+            }
+
+            setNonBlocking();
+        }
+
+        void setNonBlocking() {
+            int flags = ::fcntl(fd_, F_GETFL);
+            flags |= O_NONBLOCK;
+            if (::fcntl(fd_, F_SETFL, flags) == -1) {
+                std::cout << "faild to set socket non blocking [" << errno << "]" << std::endl;
+                throw std::runtime_error("failed to set socket non blocking");
+            }
+        }
+
+        void setReuseAddr(bool reuse) {
+            int r = (reuse ? 1 : 0);
+            int result = ::setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, (const char *) &r, sizeof(r));
+            if (result < 0) {
+                std::cout << "setReuseAddr failed [" << errno << "]" << std::endl;
+                throw std::runtime_error("setReuseAddr failed");
+            }
+        }
+
+        void setRecvBufferSize(int size) {
+            int result = ::setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, (const char *) &size, sizeof(size));
+            if (result < 0) {
+                std::cout << "setRecvBufferSize failed [" << errno << "]" << std::endl;
+                throw std::runtime_error("setRecvBufferSize failed");
+            }
+        }
+
+        void bind(const sockaddr_in &sa) {
+            int result = ::bind(fd_, (sockaddr *) &sa, sizeof(sa));
+            if (result != 0) {
+                std::cout << "failed to bind socket " << errno << std::endl;
+                throw std::runtime_error("failed to bind socket");
+            }
+        }
+
+        // iface selects the local interface by address, e.g. 127.0.0.1 for loopback tests
+        void joinGroup(const in_addr &group, const in_addr &iface) {
+            ip_mreq mreq;
+            mreq.imr_multiaddr = group;
+            mreq.imr_interface = iface;
+            int result = ::setsockopt(fd_, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char *) &mreq, sizeof(mreq));
+            if (result < 0) {
+                std::cout << "failed to join multicast group [" << errno << "]" << std::endl;
+                throw std::runtime_error("failed to join multicast group");
+            }
+        }
+
+        // sending side: outgoing interface, whether local receivers see the traffic, and hop limit
+        void setMulticastInterface(const in_addr &iface) {
+            int result = ::setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_IF, (const char *) &iface, sizeof(iface));
+            if (result < 0) {
+                std::cout << "setMulticastInterface failed [" << errno << "]" << std::endl;
+                throw std::runtime_error("setMulticastInterface failed");
+            }
+        }
+
+        void setMulticastLoop(bool loop) {
+            unsigned char l = (loop ? 1 : 0);
+            int result = ::setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_LOOP, (const char *) &l, sizeof(l));
+            if (result < 0) {
+                std::cout << "setMulticastLoop failed [" << errno << "]" << std::endl;
+                throw std::runtime_error("setMulticastLoop failed");
+            }
+        }
+
+        void setMulticastTtl(int ttl) {
+            unsigned char t = static_cast<unsigned char>(ttl);
+            int result = ::setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_TTL, (const char *) &t, sizeof(t));
+            if (result < 0) {
+                std::cout << "setMulticastTtl failed [" << errno << "]" << std::endl;
+                throw std::runtime_error("setMulticastTtl failed");
+            }
+        }
+
+        // -1 on error, 0 if it would block
+        ssize_t sendTo(const char *buffer, size_t len, const sockaddr_in &to) {
+            ssize_t result = ::sendto(fd_, buffer, len, 0, (const sockaddr *) &to, sizeof(to));
+            if (result >= 0)
+                return result;
+
+            switch (errno) {
+                case EWOULDBLOCK:
+                case ENOBUFS:
+                    return 0;
+                default:
+                    return -1;
+            }
+        }
+
+        // fills up to count messages in one syscall, returns how many arrived (0 if none were waiting)
+        int receiveBatch(mmsghdr *msgs, unsigned count) {
+            int result = ::recvmmsg(fd_, msgs, count, MSG_DONTWAIT, nullptr);
+            if (result >= 0)
+                return result;
+
+            switch (errno) {
+                case EWOULDBLOCK:
+                case EINTR:
+                    return 0;
+                default:
+                    std::cout << "recvmmsg failed [" << errno << "]" << std::endl;
+                    return 0;
+            }
+        }
+
+        void close() {
+            if (fd_ != INVALID_FD_VAL) {
+                ::close(fd_);
+                fd_ = INVALID_FD_VAL;
+            }
+        }
+
+        int getFD() { return fd_; }
+
+    protected:
+
+        int fd_{INVALID_FD_VAL};
+    };
+}
+
+#endif //SOCKETLIB_UDPSOCKET_H
@@ -1,122 +1,1074 @@
+#include <atomic>
 #include <cstdint>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
 #include "../socklib/EventService.h"
+#include "../socklib/ReactorPool.h"
 #include "../socklib/ClientConnection.h"
-#include "max_heap.h"
+#include "../socklib/MirroredRingBuffer.h"
+#include "../socklib/ConnectionRegistry.h"
+#include "../socklib/MulticastFeed.h"
+#include "../socklib/ShmTransport.h"
+#include "../socklib/OutputSink.h"
+#include "radix_heap.h"
+#include "stream_merge.h"
+#include "sorted_runs.h"
+#include "spill_runs.h"
+#include "master_store.h"
+#include "flow_stats.h"
+#include "ring_buffer.h"
 
 namespace agpc {
 
-    class SortServer : public EventNode {
+    struct SortServerOptions {
+        size_t reactors{1};
+        int firstCpu{-1};
+        bool edgeTriggered{false};
+        uint64_t spinNanos{0};
+        int busyPollMicros{0};
+        EventBackend backend{AGPC_DEFAULT_EVENT_BACKEND};
+        int16_t backlog{5};
+        // reactor i publishes its loop stats in /dev/shm/<statsPrefix><i> (needs -DAGPC_STATS), flow control its
+        // per exchange numbers in /dev/shm/<statsPrefix>flows
+        std::string statsPrefix;
+        // multicast feed group (a.b.c.d:port), its TCP retransmit server and the interface address to join on
+        std::string feedGroup;
+        std::string feedRecovery;
+        std::string feedInterface{"0.0.0.0"};
+        // unix socket co-located exchanges connect to for a shared memory ring instead of TCP
+        std::string shmPath;
+        // kernel receive to handler and handler to stdout flush latencies, printed on exit, with the receive
+        // stamps taken in software or by the NIC
+        bool latency{false};
+        RxTimestamps rxTimestamps{RxTimestamps::Off};
+        // per exchange flow control: values queued for the sorter thread. reading from an exchange's
+        // connections pauses at the high watermark and resumes at the low one. 0 sorts on the reactors.
+        uint64_t highWatermark{0};
+        uint64_t lowWatermark{0};
+        // spread reactors over the NUMA nodes, keep connections on their reactor's node and the heap (and
+        // sorter thread) on reactor 0's
+        bool numa{false};
+        // steer each connection to the listener of the reactor pinned to the cpu its packets arrive on
+        bool incomingCpu{false};
+        // exchanges send ascending streams: merge them and write each value once, in ascending order, as soon
+        // as no connected exchange can still send a smaller one
+        bool merge{false};
+        // merge: feed exchanges are not known before their first packet, so say how many there are
+        size_t feedExchanges{0};
+        // unsorted exchanges: each flush writes only the values new since the previous one, sorted, and the
+        // complete list once on exit
+        bool delta{false};
+        // threads radix sorting large delta batches and spill runs
+        unsigned sortThreads{1};
+        // more values than fit in memory: at most spillBytes are held, full runs are spilled to unlinked files
+        // in spillDir and the complete list is merged out once on exit, nothing before
+        size_t spillBytes{0};
+        std::string spillDir{"/tmp"};
+        // every value is also kept in the master store in masterDir, across restarts
+        std::string masterDir;
+        size_t masterSegmentBytes{64 << 20};
+        // stdout is flushed per batch, once flushBytes are buffered or once the oldest byte is
+        // flushDeadlineNanos old
+        FlushPolicy flushPolicy{FlushPolicy::PerBatch};
+        size_t flushBytes{0};
+        uint64_t flushDeadlineNanos{0};
+        // stdout pages are handed to a pipe by reference instead of being copied
+        bool vmsplice{false};
+    };
+
+    class SortServer {
     public:
-        typedef ClientConnectionT<SortServer> ClientConnection;
+        // build with -DAGPC_MIRRORED_RECV_BUFFER=<bytes> to receive into a mirrored ring of that size
+#ifdef AGPC_MIRRORED_RECV_BUFFER
+        typedef MirroredRingBuffer<AGPC_MIRRORED_RECV_BUFFER> RecvBuffer;
+#else
+        typedef ByteBuffer<1024> RecvBuffer;
+#endif
+        typedef ClientConnectionT<SortServer, RecvBuffer, NegotiatedFraming<> > ClientConnection;
+        typedef MulticastFeed<SortServer> Feed;
+        typedef ShmConsumer<SortServer> ShmConnection;
+        // largest first, as the output is written. pq_ itself is only pushed to and each flush drains a copy,
+        // so the radix heap's monotone rule always holds; HeapBench has it well ahead of the d-ary heaps here.
+        typedef radix_heap<int64_t, std::greater<int64_t>, NodeAllocator<int64_t> > Heap;
+
+        // one listening socket per reactor, all bound to the same port with SO_REUSEPORT so the kernel
+        // spreads incoming exchanges across reactors. accepted connections stay on the accepting reactor.
+        class Acceptor : public EventNode {
+        public:
+            Acceptor(SortServer &server, EventService &eventService)
+                    : server_(server), eventService_(eventService) {}
+
+            void bind(const sockaddr_in &addr, bool reusePort, int busyPollMicros, int incomingCpu) {
+                try {
+                    sock_.create(busyPollMicros);
+                    sock_.setReuseAddr(true);
+                    if (reusePort) {
+                        sock_.setReusePort(true);
+                    }
+                    if (incomingCpu >= 0) {
+                        sock_.setIncomingCpu(incomingCpu);
+                    }
+                    sock_.bind(addr);
+                }
+                catch (const std::exception &e) {
+                    std::cout << "exception while creating socket " << e.what() << std::endl;
+                    sock_.close();
+                    throw;
+                }
+            }
+
+            void listen(int backlog) {
+                try {
+                    sock_.listen(backlog);
+                    eventService_.registerHandler(sock_.getFD(), this);
+                    running_ = true;
+                }
+                catch (const std::exception &e) {
+                    std::cout << "exception while listening for incoming connections " << e.what() << std::endl;
+                    sock_.close();
+                    throw;
+                }
+            }
+
+            void close() {
+                if (running_) {
+                    eventService_.removeFD(sock_.getFD());
+                    running_ = false;
+                }
+                sock_.close();
+            }
+
+            void onRead() override {
+                TcpSocket client_socket;
+                while (sock_.accept(client_socket)) {
+                    accepted(client_socket);
+                }
+                // do more error checking/handling if have time.
+            }
+
+            void onAccept(int fd) override {
+                TcpSocket client_socket;
+                client_socket.setFD(fd);
+                accepted(client_socket);
+            }
+
+            bool isReader() override { return true; }
+
+            bool isAcceptor() override { return true; }
+
+            bool isEdgeTriggered() override { return server_.options_.edgeTriggered; }
+
+        protected:
+            void accepted(TcpSocket &client_socket) {
+                server_.addConnection(eventService_, client_socket);
+            }
+
+            SortServer &server_;
+            EventService &eventService_;
+            TcpSocket sock_;
+            bool running_{false};
+        };
+
+        // flushes output held back by the deadline policy while no batches arrive
+        class FlushTimer : public EventNode {
+        public:
+            FlushTimer(SortServer &server, EventService &eventService)
+                    : server_(server), eventService_(eventService) {}
+
+            void open(uint64_t periodNanos) {
+                fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+                if (fd_ < 0) {
+                    std::cout << "timerfd create failed [" << errno << "]" << std::endl;
+                    throw std::runtime_error("timerfd create failed");
+                }
+
+                itimerspec spec;
+                spec.it_interval.tv_sec = periodNanos / 1000000000;
+                spec.it_interval.tv_nsec = periodNanos % 1000000000;
+                spec.it_value = spec.it_interval;
+                timerfd_settime(fd_, 0, &spec, nullptr);
+                eventService_.registerHandler(fd_, this);
+            }
+
+            void close() {
+                if (fd_ >= 0) {
+                    eventService_.removeFD(fd_);
+                    ::close(fd_);
+                    fd_ = -1;
+                }
+            }
+
+            void onRead() override {
+                uint64_t expirations;
+                while (::read(fd_, &expirations, sizeof(expirations)) > 0) {
+                }
+                server_.flush_due();
+            }
+
+            bool isReader() override { return true; }
 
-        SortServer(int port, int16_t backlog = 5) : port_(port), backlog_(backlog) {
+        protected:
+            SortServer &server_;
+            EventService &eventService_;
+            int fd_{-1};
+        };
+
+        SortServer(int port, const SortServerOptions &options)
+                : pq_(NodeAllocator<int64_t>(heap_node(options))), port_(port), options_(options),
+                  pool_(options.reactors, options.firstCpu, options.backend,
+                        options.numa ? ReactorPlacement::SpreadNodes : ReactorPlacement::Compact),
+                  connections_(options.numa) {
             std::memset(&addr_, '\0', sizeof(addr_));
+
+            for (size_t i = 0; i < pool_.size(); ++i) {
+                pool_.service(i).setSpinBudget(options_.spinNanos);
+#ifdef AGPC_STATS
+                pool_.service(i).setStatsLabel("reactor " + std::to_string(i));
+                if (!options_.statsPrefix.empty()) {
+                    pool_.service(i).mapStats(options_.statsPrefix + std::to_string(i));
+                }
+#endif
+            }
+
+            if (sharded(options_)) {
+                for (size_t i = 0; i < pool_.size(); ++i) {
+                    int node = options_.numa ? pool_.nodeFor(i) : -1;
+                    shards_.push_back(std::unique_ptr<ReactorShard>(new ReactorShard(node)));
+                }
+            }
+
+            if (options_.highWatermark) {
+                flows_.resize(FlowStats::MAX_EXCHANGES);
+                if (!options_.statsPrefix.empty()) {
+                    flowStats_ = flowRegion_.create(options_.statsPrefix + "flows");
+                } else {
+                    localFlowStats_.reset(new FlowStats());
+                    flowStats_ = localFlowStats_.get();
+                }
+            }
+
+            runs_.set_sort_threads(options_.sortThreads);
+            if (options_.spillBytes) {
+                spill_ = new spill_runs(options_.spillBytes, options_.spillDir, options_.sortThreads);
+            }
+            if (!options_.masterDir.empty()) {
+                open_master();
+            }
+            out_.setPolicy(options_.flushPolicy, options_.flushBytes, options_.flushDeadlineNanos);
+            if (options_.vmsplice && !out_.useVmsplice()) {
+                std::cout << "stdout is not a pipe, writing it instead of -Z" << std::endl;
+            }
+        }
+
+        ~SortServer() {
+            for (Acceptor *acceptor : acceptors_) {
+                delete acceptor;
+            }
+            delete feed_;
+            delete shmListener_;
+            delete flushTimer_;
+            delete spill_;
+            delete master_;
+            for (ShmConnection *conn : shmConnections_) {
+                delete conn;
+            }
         }
 
         void start() {
             bind();
             listen();
+            open_feed();
+            open_shm();
+            open_flush_timer();
+            if (options_.highWatermark) {
+                sorter_ = std::thread(&SortServer::sort_loop, this);
+            }
+
+            pool_.run();
+
+            if (sorter_.joinable()) {
+                {
+                    std::lock_guard<std::mutex> guard(flowMutex_);
+                    sorterStop_ = true;
+                }
+                ingestReady_.notify_one();
+                sorter_.join();
+                print_flow_stats();
+            }
+            if (options_.merge) {
+                finish_merge();
+            }
+            if (options_.delta) {
+                finish_delta();
+            }
+            if (spill_) {
+                finish_spill();
+            }
+            if (master_) {
+                uint64_t values = master_->size();
+                master_->close();
+                std::cerr << "master values " << values << " compactions " << master_->compactions() << std::endl;
+            }
+            if (flushTimer_) {
+                flushTimer_->close();
+            }
+            out_.flush();
+
+            for (Acceptor *acceptor : acceptors_) {
+                acceptor->close();
+            }
+            if (feed_) {
+                feed_->close();
+                std::cerr << "feed gaps " << feed_->gaps() << " recovered packets " << feed_->recovered()
+                          << " duplicates " << feed_->duplicates() << std::endl;
+            }
+            if (shmListener_) {
+                shmListener_->close();
+            }
+            if (heartbeats_ > 0 || resets_ > 0) {
+                std::cerr << "heartbeats " << heartbeats_ << " sequence resets " << resets_ << " repeats dropped "
+                          << repeats_ << " values lost " << lost_ << std::endl;
+            }
 
-            eventService_.poll();
+            if (options_.spinNanos > 0) {
+                print_poll_stats();
+            }
+            if (options_.latency) {
+                for (const std::unique_ptr<ReactorShard> &shard : shards_) {
+                    kernelToHandler_.merge(shard->kernelToHandler);
+                }
+                kernelToHandler_.print(std::cerr, "kernel receive to handler ns");
+                handlerToFlush_.print(std::cerr, "handler to stdout flush ns");
+            }
+            AGPC_STATS_ONLY(print_loop_stats();)
         }
 
         void bind() {
-            try {
-                sock_.create();
-                sock_.setReuseAddr(true);
-
-                addr_.sin_family = AF_INET;
-                addr_.sin_addr.s_addr = htonl(INADDR_ANY);
-                addr_.sin_port = htons(port_);
-                sock_.bind(addr_);
-            }
-            catch (const std::exception &e) {
-                std::cout << "exception while creating socket " << e.what() << std::endl;
-                eventService_.removeFD(sock_.getFD());
-                sock_.close();
-                throw;
+            addr_.sin_family = AF_INET;
+            addr_.sin_addr.s_addr = htonl(INADDR_ANY);
+            addr_.sin_port = htons(port_);
+
+            for (size_t i = 0; i < pool_.size(); ++i) {
+                Acceptor *acceptor = new Acceptor(*this, pool_.service(i));
+                acceptors_.push_back(acceptor);
+                acceptor->bind(addr_, pool_.size() > 1, options_.busyPollMicros,
+                               options_.incomingCpu ? pool_.cpuFor(i) : -1);
             }
         }
 
         void listen() {
-            try {
-                sock_.listen(backlog_);
-                eventService_.registerHandler(sock_.getFD(), this);
-                running_ = true;
-            }
-            catch (const std::exception &e) {
-                std::cout << "exception while listening for incoming connections " << e.what() << std::endl;
-                sock_.close();
-                throw;
+            for (Acceptor *acceptor : acceptors_) {
+                acceptor->listen(options_.backlog);
             }
         }
 
         void stop() {
-            if (running_) {
-                eventService_.removeFD(sock_.getFD());
-                running_ = false;
+            pool_.stop();
+        }
+
+        void addConnection(EventService &eventService, TcpSocket &client_socket) {
+            std::lock_guard<std::mutex> guard(mutex_);
+            ClientConnection *conn = connections_.create(client_socket.getFD(), eventService, client_socket, this,
+                                                         options_.edgeTriggered, options_.rxTimestamps);
+            if (options_.merge) {
+                unidentified_.push_back(conn);
+            }
+            ++accepted_;
+        }
+
+        // the connection is still on the reactor's call stack, so it is released by a task posted to the same
+        // reactor. the handle's generation guards against the fd having been reused by then.
+        void onDisconnect(ClientConnection *conn) {
+            ConnectionRegistry<ClientConnection>::Handle handle;
+            {
+                std::lock_guard<std::mutex> guard(mutex_);
+                handle = connections_.handle(conn->getFD());
+                AGPC_STATS_ONLY(print_connection_stats(conn);)
+                erase_one(unidentified_, conn);
+
+                // an exchange that drops without its 0 is forgotten, it may reconnect and carry on
+                if (!conn->isStopped()) {
+                    out_.flush();
+                    std::cout << "exchange disconnected before sending 0" << std::endl;
+                    conn->setStopped();
+                    --accepted_;
+                    check_connected_clients();
+                }
             }
 
-            sock_.close();
-            eventService_.stop();
+            conn->eventService().post([this, handle]() {
+                std::lock_guard<std::mutex> guard(mutex_);
+                connections_.destroy(handle);
+            });
         }
 
-        void onRead() override {
-            TcpSocket client_socket;
-            while (sock_.accept(client_socket)) {
-                ClientConnection *c = new ClientConnection(eventService_, client_socket, this);
-                connections_.push_back(c);
+        void addShmConsumer(ShmConnection *conn) {
+            std::lock_guard<std::mutex> guard(mutex_);
+            shmConnections_.push_back(conn);
+            if (options_.merge) {
+                unidentified_.push_back(conn);
             }
-            // do more error checking/handling if have time.
+            ++accepted_;
         }
 
-        void onMsg(int32_t exch, int64_t value, ClientConnection *conn) {
-            if (value == 0) {
-                flush();
-                conn->setStopped();
-                check_connected_clients();
-            } else {
-                pq_.enqueue(value);
+        void onDisconnect(ShmConnection *conn) {
+            {
+                std::lock_guard<std::mutex> guard(mutex_);
+                erase_one(unidentified_, conn);
+                if (!conn->isStopped()) {
+                    out_.flush();
+                    std::cout << "exchange disconnected before sending 0" << std::endl;
+                    conn->setStopped();
+                    --accepted_;
+                    check_connected_clients();
+                }
+            }
+
+            conn->eventService().post([this, conn]() {
+                std::lock_guard<std::mutex> guard(mutex_);
+                erase_one(shmConnections_, conn);
+                delete conn;
+            });
+        }
+
+        // one lock per read instead of one per message. tcp and shared memory exchanges alike.
+        template<typename CONN>
+        void onMsgBatch(const MessageBatch &batch, CONN *conn) {
+            if (options_.highWatermark) {
+                queue_batch(batch, conn);
+                return;
+            }
+            if (!shards_.empty()) {
+                push_sharded(batch, conn);
+                return;
+            }
+
+            std::lock_guard<std::mutex> guard(mutex_);
+            if (options_.latency) {
+                record_arrival_locked(batch);
+            }
+            erase_one(unidentified_, conn);
+            for (size_t i = 0; i < batch.count_; ++i) {
+                int64_t value = batch.values_[i];
+                if (value == 0) {
+                    finish_exchange_locked(batch.exchanges_[i]);
+                    flush_locked();
+                    if (!conn->isStopped()) {
+                        conn->setStopped();
+                        ++finished_;
+                    }
+                    check_connected_clients();
+                } else {
+                    sort_value_locked(batch.exchanges_[i], value);
+                }
+            }
+        }
+
+        // tagged exchanges (FORMAT_TAGGED) interleave these with their values
+        void onMsg(const Heartbeat & /*heartbeat*/, ClientConnection * /*conn*/) {
+            std::lock_guard<std::mutex> guard(mutex_);
+            ++heartbeats_;
+        }
+
+        // arrives before the framing applies it: repeats up to the position received so far are dropped there,
+        // a jump ahead is a gap the exchange will not fill
+        void onMsg(const SequenceReset &reset, ClientConnection *conn) {
+            uint64_t received = conn->framing().tagged().received();
+            uint64_t next = static_cast<uint64_t>(reset.nextSequence_);
+
+            std::lock_guard<std::mutex> guard(mutex_);
+            ++resets_;
+            if (next < received) {
+                repeats_ += received - next;
+            } else if (next > received) {
+                out_.flush();
+                std::cout << "exchange on " << conn->getFD() << " skipped " << next - received << " values" << std::endl;
+                lost_ += next - received;
+            }
+        }
+
+        // feed exchanges have no connection, each one counts as connected from its first packet on
+        void onFeedExchange(int32_t exch, Feed * /*feed*/) {
+            std::lock_guard<std::mutex> guard(mutex_);
+            FeedExchange feedExchange;
+            feedExchange.exch = exch;
+            feedExchanges_.push_back(feedExchange);
+            ++accepted_;
+        }
+
+        void onMsgBatch(const MessageBatch &batch, Feed * /*feed*/) {
+            std::lock_guard<std::mutex> guard(mutex_);
+            if (options_.latency) {
+                record_arrival_locked(batch);
+            }
+            for (size_t i = 0; i < batch.count_; ++i) {
+                int64_t value = batch.values_[i];
+                if (value == 0) {
+                    finish_exchange_locked(batch.exchanges_[i]);
+                    flush_locked();
+                    FeedExchange *feedExchange = find_feed_exchange(batch.exchanges_[i]);
+                    if (feedExchange && !feedExchange->finished) {
+                        feedExchange->finished = true;
+                        ++finished_;
+                    }
+                    check_connected_clients();
+                } else {
+                    sort_value_locked(batch.exchanges_[i], value);
+                }
             }
         }
 
+        // with flow control the sorter thread writes the output
         void flush() {
-            max_heap<int64_t> temp(pq_);
-            while (!temp.empty()) {
-                std::cout << temp.dequeue() << " ";
+            if (options_.highWatermark)
+                return;
+            if (!shards_.empty()) {
+                request_flush();
+                return;
             }
-            std::cout << std::endl;
 
+            std::lock_guard<std::mutex> guard(mutex_);
+            flush_locked();
         }
 
-        bool isReader() override { return true; }
+        void flush_due() {
+            std::lock_guard<std::mutex> guard(mutex_);
+            out_.flushIfDue(monotonicNanos());
+        }
 
     protected:
 
-        void check_connected_clients() {
-            bool should_stop = true;
+        // default mode: each reactor appends what it reads to its own shard, under a lock only the writer takes
+        // besides it, and keeps its own latency stamps. the writer on reactor 0 takes the values out, counts the
+        // exchanges finished since and records the oldest stamp. the histogram keeps the next shard's
+        // allocation off these fields' cache lines.
+        struct ReactorShard {
+            explicit ReactorShard(int node) : values(NodeAllocator<int64_t>(node)) {}
+
+            std::mutex mutex;
+            std::vector<int64_t, NodeAllocator<int64_t> > values;
+            uint64_t finished{0};
+            uint64_t unflushedSince{0};
+            LogLinearHistogram<> kernelToHandler;
+        };
+
+        struct PausedConnection {
+            EventService *service;
+            ConnectionRegistry<ClientConnection>::Handle handle;
+        };
+
+        // the numbers are kept in flowStats_
+        struct ExchangeFlow {
+            uint64_t pausedSince{0};
+            std::vector<PausedConnection> paused;
+        };
+
+        struct FeedExchange {
+            int32_t exch{0};
+            bool finished{false};
+        };
+
+        struct SortWork {
+            // the sending connection, identified once the sorter got its first values
+            const void *conn{nullptr};
+            std::vector<int32_t> exchanges;
+            std::vector<int64_t> values;
+        };
+
+        // reactor side of flow control. an exchange's 0 is only counted once the sorter got to it, after
+        // everything the exchange sent before.
+        template<typename CONN>
+        void queue_batch(const MessageBatch &batch, CONN *conn) {
+            if (options_.latency) {
+                std::lock_guard<std::mutex> guard(mutex_);
+                record_arrival_locked(batch);
+            }
+
+            SortWork work;
+            work.conn = conn;
+            work.exchanges.reserve(batch.count_);
+            work.values.reserve(batch.count_);
+            for (size_t i = 0; i < batch.count_; ++i) {
+                if (batch.values_[i] == 0) {
+                    if (conn->isStopped())
+                        continue;
+                    conn->setStopped();
+                }
+                work.exchanges.push_back(batch.exchanges_[i]);
+                work.values.push_back(batch.values_[i]);
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(flowMutex_);
+                bool paused = false;
+                for (int32_t exch : work.exchanges) {
+                    ExchangeFlowStats &stats = flowStats_->exchanges[FlowStats::slot(exch)];
+                    ++stats.received;
+                    if (++stats.buffered > stats.maxBuffered) {
+                        stats.maxBuffered = stats.buffered;
+                    }
+                    if (!paused && stats.buffered >= options_.highWatermark) {
+                        paused = pause_locked(flows_[FlowStats::slot(exch)], stats, conn);
+                    }
+                }
+                ingest_.push_back(std::move(work));
+            }
+            ingestReady_.notify_one();
+        }
+
+        bool pause_locked(ExchangeFlow &flow, ExchangeFlowStats &stats, ClientConnection *conn) {
+            if (conn->isPaused())
+                return false;
+
+            PausedConnection paused;
+            paused.service = &conn->eventService();
+            {
+                std::lock_guard<std::mutex> guard(mutex_);
+                paused.handle = connections_.handle(conn->getFD());
+            }
+            conn->pauseReading();
+
+            if (flow.paused.empty()) {
+                flow.pausedSince = monotonicNanos();
+            }
+            flow.paused.push_back(paused);
+            ++stats.pauses;
+            return true;
+        }
+
+        // a shared memory producer is held back by its full ring already
+        bool pause_locked(ExchangeFlow & /*flow*/, ExchangeFlowStats & /*stats*/, ShmConnection * /*conn*/) {
+            return false;
+        }
+
+        void sort_loop() {
+            ring_buffer<SortWork> work;
+
+            if (options_.numa) {
+                ReactorPool::pinThread(sorter_cpu());
+            }
+
+            for (;;) {
+                {
+                    std::unique_lock<std::mutex> lock(flowMutex_);
+                    ingestReady_.wait(lock, [this]() { return sorterStop_ || !ingest_.empty(); });
+                    if (ingest_.empty())
+                        return;
+                    work.swap(ingest_);
+                }
+
+                {
+                    std::lock_guard<std::mutex> guard(mutex_);
+                    for (size_t n = 0; n < work.size(); ++n) {
+                        const SortWork &w = work[n];
+                        erase_one(unidentified_, w.conn);
+                        for (size_t i = 0; i < w.values.size(); ++i) {
+                            if (w.values[i] == 0) {
+                                finish_exchange_locked(w.exchanges[i]);
+                                flush_locked();
+                                ++finished_;
+                                check_connected_clients();
+                            } else {
+                                sort_value_locked(w.exchanges[i], w.values[i]);
+                            }
+                        }
+                    }
+                    flush_locked();
+                }
+
+                std::lock_guard<std::mutex> guard(flowMutex_);
+                for (size_t n = 0; n < work.size(); ++n) {
+                    for (int32_t exch : work[n].exchanges) {
+                        --flowStats_->exchanges[FlowStats::slot(exch)].buffered;
+                    }
+                }
+                work.clear();
+                resume_locked();
+            }
+        }
+
+        // resuming happens on each connection's own reactor
+        void resume_locked() {
+            for (size_t slot = 0; slot < flows_.size(); ++slot) {
+                ExchangeFlow &flow = flows_[slot];
+                ExchangeFlowStats &stats = flowStats_->exchanges[slot];
+                if (flow.paused.empty() || stats.buffered > options_.lowWatermark)
+                    continue;
+
+                for (const PausedConnection &paused : flow.paused) {
+                    ConnectionRegistry<ClientConnection>::Handle handle = paused.handle;
+                    // connections are only destroyed on their own reactor, so it stays valid after the lookup.
+                    // resuming may deliver held back data, which takes the locks again.
+                    paused.service->post([this, handle]() {
+                        ClientConnection *conn;
+                        {
+                            std::lock_guard<std::mutex> guard(mutex_);
+                            conn = connections_.find(handle);
+                        }
+                        if (conn) {
+                            conn->resumeReading();
+                        }
+                    });
+                }
+                flow.paused.clear();
+                stats.pausedNanos += monotonicNanos() - flow.pausedSince;
+            }
+        }
+
+        void print_flow_stats() {
+            std::lock_guard<std::mutex> guard(flowMutex_);
+            flowStats_->print(std::cerr);
+        }
+
+        // the feed lives on the first reactor
+        void open_feed() {
+            if (options_.feedGroup.empty())
+                return;
+
+            sockaddr_in group = parseEndpoint(options_.feedGroup);
+            sockaddr_in recovery;
+            std::memset(&recovery, '\0', sizeof(recovery));
+            if (!options_.feedRecovery.empty()) {
+                recovery = parseEndpoint(options_.feedRecovery);
+            }
+            in_addr iface;
+            if (inet_pton(AF_INET, options_.feedInterface.c_str(), &iface) != 1) {
+                throw std::runtime_error("bad feed interface address");
+            }
+
+            feed_ = new Feed(pool_.service(0), this);
+            feed_->open(group, iface, recovery);
+        }
+
+        // and the deadline flush timer, firing twice per deadline
+        void open_flush_timer() {
+            if (options_.flushPolicy != FlushPolicy::Deadline)
+                return;
+
+            flushTimer_ = new FlushTimer(*this, pool_.service(0));
+            flushTimer_->open(options_.flushDeadlineNanos / 2 ? options_.flushDeadlineNanos / 2 : 1);
+        }
+
+        // so is the shared memory listener, each producer gets its ring there
+        void open_shm() {
+            if (options_.shmPath.empty())
+                return;
+
+            shmListener_ = new ShmListener<SortServer>(pool_.service(0), this);
+            shmListener_->listen(options_.shmPath, options_.backlog);
+        }
+
+        void print_poll_stats() {
+            for (size_t i = 0; i < pool_.size(); ++i) {
+                const PollStats &stats = pool_.service(i).pollStats();
+                std::cerr << "reactor " << i << " productive polls " << stats.productivePolls
+                          << " empty polls " << stats.emptyPolls
+                          << " blocking polls " << stats.blockingPolls << std::endl;
+            }
+        }
+
+#ifdef AGPC_STATS
+        void print_loop_stats() {
+            for (size_t i = 0; i < pool_.size(); ++i) {
+                std::cerr << "-- reactor " << i << "\n";
+                pool_.service(i).loopStats().print(std::cerr);
+            }
+        }
+
+        void print_connection_stats(ClientConnection *conn) {
+            const ConnectionStats &stats = conn->stats();
+            std::cerr << "connection " << conn->getFD() << " messages " << stats.messages << " bytes "
+                      << stats.bytes << " wakeups " << stats.wakeups << std::endl;
+        }
+#endif
+
+        // the modes other than the default one, the master store, flow control and feeds keep mutex_'d state
+        static bool sharded(const SortServerOptions &options) {
+            return !options.merge && !options.delta && !options.spillBytes && options.masterDir.empty() &&
+                   !options.highWatermark && options.feedGroup.empty();
+        }
+
+        // nothing shared is written here but an exchange's 0, counted once the writer got the values before it.
+        // the connection is only looked at on its own reactor.
+        template<typename CONN>
+        void push_sharded(const MessageBatch &batch, CONN *conn) {
+            ReactorShard &shard = *shards_[pool_.indexOf(conn->eventService())];
+            std::lock_guard<std::mutex> guard(shard.mutex);
+            if (options_.latency) {
+                record_arrival(batch, shard.kernelToHandler, shard.unflushedSince);
+            }
+            for (size_t i = 0; i < batch.count_; ++i) {
+                if (batch.values_[i] != 0) {
+                    shard.values.push_back(batch.values_[i]);
+                } else if (!conn->isStopped()) {
+                    conn->setStopped();
+                    ++shard.finished;
+                }
+            }
+        }
+
+        // one flush is in flight at a time, reads while it is pending are written by it
+        void request_flush() {
+            if (flushPending_.load(std::memory_order_relaxed) || flushPending_.exchange(true))
+                return;
+            pool_.service(0).post([this]() { flush_shards(); });
+        }
+
+        // the single writer. the flag is cleared before the shards are emptied, so values appended after their
+        // shard was taken ask for the next flush. runs_ only sorts what is new, the snapshot is a merge of the
+        // runs already sorted.
+        void flush_shards() {
+            flushPending_.store(false);
+
+            size_t taken = 0;
+            uint64_t finished = 0;
+            uint64_t since = 0;
+            for (const std::unique_ptr<ReactorShard> &shard : shards_) {
+                std::lock_guard<std::mutex> guard(shard->mutex);
+                for (int64_t value : shard->values) {
+                    runs_.insert(value);
+                }
+                taken += shard->values.size();
+                shard->values.clear();
+                finished += shard->finished;
+                shard->finished = 0;
+                if (shard->unflushedSince && (!since || shard->unflushedSince < since)) {
+                    since = shard->unflushedSince;
+                }
+                shard->unflushedSince = 0;
+            }
+            if (!taken && !finished)
+                return;
+            runs_.take_delta([](int64_t) {});
+
+            std::lock_guard<std::mutex> guard(mutex_);
+            runs_.snapshot([this](int64_t value) { out_.put(value); });
+            out_.endBatch();
+            if (since) {
+                handlerToFlush_.record(monotonicNanos() - since);
+            }
+            if (finished) {
+                finished_ += finished;
+                check_connected_clients();
+            }
+        }
+
+        void sort_value_locked(int32_t exch, int64_t value) {
+            if (master_) {
+                master_->append(value);
+            }
+            if (options_.merge) {
+                merge_.push(exch, value);
+            } else if (options_.delta) {
+                runs_.insert(value);
+            } else if (spill_) {
+                spill_->insert(value);
+            } else {
+                pq_.push(value);
+            }
+        }
+
+        void finish_exchange_locked(int32_t exch) {
+            if (options_.merge) {
+                merge_.finish(exch);
+            }
+        }
+
+        void flush_locked() {
+            if (options_.merge) {
+                emit_locked();
+                return;
+            }
+            if (spill_)
+                return;
+
+            if (options_.delta) {
+                if (!runs_.has_delta())
+                    return;
+                runs_.take_delta([this](int64_t value) { out_.put(value); });
+            } else {
+                Heap temp(pq_);
+                while (!temp.empty()) {
+                    out_.put(temp.pop());
+                }
+            }
+            out_.endBatch();
+
+            if (unflushedSince_) {
+                handlerToFlush_.record(monotonicNanos() - unflushedSince_);
+                unflushedSince_ = 0;
+            }
+        }
+
+        // writes what the merge let through, one line per flush. an accepted exchange that has not sent yet may still send the
+        // smallest value of all, so nothing passes until every connection has identified its exchange, and until -E
+        // feed exchanges have been heard from.
+        void emit_locked() {
+            if (!unidentified_.empty() || feedExchanges_.size() < options_.feedExchanges)
+                return;
+
+            size_t emitted = merge_.drain([this](int64_t value) { out_.put(value); });
+            if (emitted) {
+                out_.endBatch();
+            }
+            if (unflushedSince_ && emitted) {
+                handlerToFlush_.record(monotonicNanos() - unflushedSince_);
+                unflushedSince_ = 0;
+            }
+        }
+
+        // exchanges that dropped without their 0, or feed exchanges that never showed up, are not coming any more
+        void finish_merge() {
+            std::lock_guard<std::mutex> guard(mutex_);
+            unidentified_.clear();
+            options_.feedExchanges = 0;
+            merge_.finish_all();
+            emit_locked();
+            if (merge_.out_of_order()) {
+                std::cerr << "merge out of order values " << merge_.out_of_order() << std::endl;
+            }
+        }
+
+        void finish_delta() {
+            std::lock_guard<std::mutex> guard(mutex_);
+            flush_locked();
+            runs_.snapshot([this](int64_t value) { out_.put(value); });
+            out_.endBatch();
+        }
+
+        void open_master() {
+            uint64_t start = monotonicNanos();
+            master_ = new master_store(options_.masterDir, options_.masterSegmentBytes);
+            std::cerr << "master recovered values " << master_->recovered_values() << " segments "
+                      << master_->recovered_segments() << " in " << (monotonicNanos() - start) / 1000 << " us"
+                      << std::endl;
+        }
+
+        void finish_spill() {
+            std::lock_guard<std::mutex> guard(mutex_);
+            spill_->drain([this](int64_t value) { out_.put(value); });
+            out_.endBatch();
+
+            rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            std::cerr << "spilled runs " << spill_->spilled_runs() << " bytes " << spill_->spilled_bytes()
+                      << " group merges " << spill_->merges() << " peak rss kb " << usage.ru_maxrss << std::endl;
+        }
+
+        // batches without a kernel stamp (feed, shared memory) only count towards handler to flush
+        void record_arrival_locked(const MessageBatch &batch) {
+            record_arrival(batch, kernelToHandler_, unflushedSince_);
+        }
+
+        static void record_arrival(const MessageBatch &batch, LogLinearHistogram<> &kernelToHandler,
+                                   uint64_t &unflushedSince) {
+            if (batch.receivedNanos_) {
+                uint64_t now = realtimeNanos();
+                kernelToHandler.record(now > batch.receivedNanos_ ? now - batch.receivedNanos_ : 0);
+            }
+            if (!unflushedSince) {
+                unflushedSince = monotonicNanos();
+            }
+        }
+
+        // reactor 0 sits on the first node with cpus when spread
+        static int heap_node(const SortServerOptions &options) {
+            return options.numa ? NumaTopology::instance().cpuNodes()[0] : -1;
+        }
+
+        // the first cpu of the heap's node no reactor is pinned to, wrapping onto a shared one on small nodes
+        int sorter_cpu() const {
+            const NumaTopology &topology = NumaTopology::instance();
+            size_t nodes = topology.cpuNodes().size();
+            const std::vector<int> &cpus = topology.cpus(heap_node(options_));
+            return cpus[((pool_.size() + nodes - 1) / nodes) % cpus.size()];
+        }
 
-            for (ClientConnection *connection : connections_) {
-                if (!connection->isStopped()) {
-                    should_stop = false;
-                    break;
+        // the few connections and exchanges tracked are kept in plain vectors, unordered
+        template<typename T, typename U>
+        static void erase_one(std::vector<T> &items, U item) {
+            for (size_t i = 0; i < items.size(); ++i) {
+                if (items[i] == item) {
+                    items[i] = items.back();
+                    items.pop_back();
+                    return;
                 }
             }
+        }
+
+        FeedExchange *find_feed_exchange(int32_t exch) {
+            for (FeedExchange &feedExchange : feedExchanges_) {
+                if (feedExchange.exch == exch)
+                    return &feedExchange;
+            }
+            return nullptr;
+        }
 
-            if (should_stop) {
+        void check_connected_clients() {
+            if (finished_ > 0 && finished_ == accepted_ && feedExchanges_.size() >= options_.feedExchanges) {
+                out_.flush();
                 std::cout << "all clients finished sending data (received 0 from all), exiting" << std::endl;
                 this->stop();
             }
         }
 
-        max_heap<int64_t> pq_;
+        // reactors share the sorter state, so onMsgBatch/flush serialise on this lock. with a single
+        // reactor it is never contended. the default mode only writes its snapshots under it.
+        std::mutex mutex_;
+        Heap pq_;
+        // default mode, indexed by reactor
+        std::vector<std::unique_ptr<ReactorShard> > shards_;
+        std::atomic<bool> flushPending_{false};
+        stream_merge<int64_t> merge_;
+        // -D, or the default mode's writer
+        sorted_runs<int64_t> runs_;
+        spill_runs *spill_{nullptr};
+        master_store *master_{nullptr};
+        // merge: accepted connections that have not sent a value yet
+        std::vector<const void *> unidentified_;
         sockaddr_in addr_;
-        EventService eventService_;
-        TcpSocket sock_;
-        int16_t backlog_;
         int port_;
-        bool running_{false};
-        std::vector<ClientConnection *> connections_;
+        SortServerOptions options_;
+        ReactorPool pool_;
+        std::vector<Acceptor *> acceptors_;
+        ConnectionRegistry<ClientConnection> connections_;
+        Feed *feed_{nullptr};
+        // in the order they showed up
+        std::vector<FeedExchange> feedExchanges_;
+        ShmListener<SortServer> *shmListener_{nullptr};
+        // sorted output, written under mutex_. status lines go to std::cout after flushing it.
+        OutputSink out_;
+        FlushTimer *flushTimer_{nullptr};
+        std::vector<ShmConnection *> shmConnections_;
+        uint64_t accepted_{0};
+        uint64_t finished_{0};
+        // tagged exchanges
+        uint64_t heartbeats_{0};
+        uint64_t resets_{0};
+        uint64_t repeats_{0};
+        uint64_t lost_{0};
+        LogLinearHistogram<> kernelToHandler_;
+        LogLinearHistogram<> handlerToFlush_;
+        // handler time of the oldest batch not yet written out
+        uint64_t unflushedSince_{0};
+        // flow control: reactors queue batches for the sorter thread. mutex_ may be taken while holding
+        // flowMutex_, never the other way round.
+        std::mutex flowMutex_;
+        std::condition_variable ingestReady_;
+        ring_buffer<SortWork> ingest_;
+        // indexed by FlowStats::slot
+        std::vector<ExchangeFlow> flows_;
+        // in /dev/shm with -S
+        FlowStats *flowStats_{nullptr};
+        SharedRegion<FlowStats> flowRegion_;
+        std::unique_ptr<FlowStats> localFlowStats_;
+        std::thread sorter_;
+        bool sorterStop_{false};
 
     };
 }
@@ -124,13 +1076,149 @@ namespace agpc {
 using namespace agpc;
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        throw std::runtime_error("usage : ./SortServer <port_number>");
+    const char *usage = "usage : ./SortServer [-r reactors] [-c first_cpu] [-e] [-s spin_usec] [-b busy_poll_usec] [-u] "
+                        "[-S stats_shm_prefix] [-m feed_group:port] [-R recovery_host:port] [-I feed_iface_addr] [-U shm_socket_path] [-T | -H] [-W high[:low]] [-N] [-i] [-M [-E feed_exchanges] | -D | -X budget_mb[:dir]] [-P sort_threads] [-F master_dir[:segment_mb]] [-O batch|size:bytes|deadline:usec] [-Z] <port_number>";
+    SortServerOptions options;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:c:es:b:uS:m:R:I:U:THW:NiME:DX:P:F:O:Z")) != -1) {
+        switch (opt) {
+            case 'r':
+                options.reactors = std::stoul(optarg);
+                break;
+            case 'c':
+                options.firstCpu = std::stoi(optarg);
+                break;
+            case 'e':
+                options.edgeTriggered = true;
+                break;
+            case 's':
+                options.spinNanos = std::stoull(optarg) * 1000;
+                break;
+            case 'b':
+                options.busyPollMicros = std::stoi(optarg);
+                break;
+            case 'u':
+                options.backend = EventBackend::IoUring;
+                break;
+            case 'S':
+                options.statsPrefix = optarg;
+                break;
+            case 'm':
+                options.feedGroup = optarg;
+                break;
+            case 'R':
+                options.feedRecovery = optarg;
+                break;
+            case 'I':
+                options.feedInterface = optarg;
+                break;
+            case 'U':
+                options.shmPath = optarg;
+                break;
+            case 'T':
+                options.latency = true;
+                options.rxTimestamps = RxTimestamps::Software;
+                break;
+            case 'H':
+                options.latency = true;
+                options.rxTimestamps = RxTimestamps::Hardware;
+                break;
+            case 'W': {
+                std::string marks = optarg;
+                size_t colon = marks.find(':');
+                options.highWatermark = std::stoull(marks.substr(0, colon));
+                options.lowWatermark = colon == std::string::npos ? options.highWatermark / 2
+                                                                  : std::stoull(marks.substr(colon + 1));
+                if (options.highWatermark == 0 || options.lowWatermark >= options.highWatermark) {
+                    throw std::runtime_error("watermarks need 0 < low < high");
+                }
+                break;
+            }
+            case 'N':
+                options.numa = true;
+                break;
+            case 'i':
+                options.incomingCpu = true;
+                break;
+            case 'M':
+                options.merge = true;
+                break;
+            case 'E':
+                options.feedExchanges = std::stoul(optarg);
+                break;
+            case 'D':
+                options.delta = true;
+                break;
+            case 'X': {
+                std::string spill = optarg;
+                size_t colon = spill.find(':');
+                options.spillBytes = std::stoull(spill.substr(0, colon)) << 20;
+                if (colon != std::string::npos) {
+                    options.spillDir = spill.substr(colon + 1);
+                }
+                break;
+            }
+            case 'F': {
+                std::string master = optarg;
+                size_t colon = master.find(':');
+                options.masterDir = master.substr(0, colon);
+                if (colon != std::string::npos) {
+                    options.masterSegmentBytes = std::stoull(master.substr(colon + 1)) << 20;
+                }
+                break;
+            }
+            case 'P':
+                options.sortThreads = std::stoul(optarg);
+                break;
+            case 'O': {
+                std::string policy = optarg;
+                size_t colon = policy.find(':');
+                std::string name = policy.substr(0, colon);
+                if (name == "batch") {
+                    options.flushPolicy = FlushPolicy::PerBatch;
+                } else if (name == "size" && colon != std::string::npos) {
+                    options.flushPolicy = FlushPolicy::Size;
+                    options.flushBytes = std::stoull(policy.substr(colon + 1));
+                } else if (name == "deadline" && colon != std::string::npos) {
+                    options.flushPolicy = FlushPolicy::Deadline;
+                    options.flushDeadlineNanos = std::stoull(policy.substr(colon + 1)) * 1000;
+                } else {
+                    throw std::runtime_error(usage);
+                }
+                break;
+            }
+            case 'Z':
+                options.vmsplice = true;
+                break;
+            default:
+                throw std::runtime_error(usage);
+        }
     }
 
-    std::string port_num_str = argv[1];
+    if (optind != argc - 1 || (options.merge + options.delta + (options.spillBytes > 0)) > 1) {
+        throw std::runtime_error(usage);
+    }
+
+    if (options.reactors > 1 && options.firstCpu < 0) {
+        options.firstCpu = 0;
+    }
+    if (options.incomingCpu && (options.reactors < 2 || options.firstCpu < 0)) {
+        std::cout << "-i needs pinned reactors sharing the port, ignoring it" << std::endl;
+        options.incomingCpu = false;
+    }
+
+    std::string port_num_str = argv[optind];
     int port_num = std::stoi(port_num_str);
 
-    SortServer ss(port_num);
+#ifdef AGPC_STATS
+    StatsDumpSignal::install(SIGUSR1);
+#else
+    if (!options.statsPrefix.empty()) {
+        std::cout << "built without AGPC_STATS, -S only publishes the flow control stats of -W" << std::endl;
+    }
+#endif
+
+    SortServer ss(port_num, options);
     ss.start();
-}
\ No newline at end of file
+}
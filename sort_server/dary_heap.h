@@ -0,0 +1,160 @@
+#ifndef SORTSERVER_DARY_HEAP_H
+#define SORTSERVER_DARY_HEAP_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace agpc {
+
+    // as many children per node as fit in a cache line, so a sift down level reads one line
+    template <typename T>
+    struct dary_arity {
+        enum {
+            value = sizeof(T) >= 32 ? 2 : 64 / sizeof(T)
+        };
+    };
+
+    // the heaps here share one convention: compare(a, b) means a comes out before b, so std::less pops the
+    // smallest first and std::greater the largest.
+    //
+    // d-ary heap in a vector. sifting moves a hole instead of swapping, so move only elements work and every
+    // level costs one move.
+    template <typename T, typename COMPARE = std::less<T>, size_t D = dary_arity<T>::value,
+              typename ALLOC = std::allocator<T> >
+    class dary_heap {
+
+    public:
+        static_assert(D >= 2, "a heap needs at least two children per node");
+
+        dary_heap() {}
+
+        // storage from alloc, e.g. a NodeAllocator keeping the heap on the sorting thread's node
+        explicit dary_heap(const ALLOC &alloc) : storage_(alloc) {}
+
+        dary_heap(const COMPARE &compare, const ALLOC &alloc) : compare_(compare), storage_(alloc) {}
+
+        void push(const T &item) {
+            storage_.push_back(item);
+            sift_up(storage_.size() - 1);
+        }
+
+        void push(T &&item) {
+            storage_.push_back(std::move(item));
+            sift_up(storage_.size() - 1);
+        }
+
+        // more new than held items are cheaper to heapify as a whole than to sift up one by one. the items are
+        // moved out of the range, so move only elements work as with push(T &&).
+        template <typename ITER>
+        void push_range(ITER first, ITER last) {
+            size_t before = storage_.size();
+            for (; first != last; ++first) {
+                storage_.push_back(std::move(*first));
+            }
+
+            size_t added = storage_.size() - before;
+            if (added > before) {
+                heapify();
+            } else {
+                for (size_t i = before; i < storage_.size(); ++i) {
+                    sift_up(i);
+                }
+            }
+        }
+
+        const T &top() const {
+            return storage_[0];
+        }
+
+        T pop() {
+            T item = std::move(storage_[0]);
+            T last = std::move(storage_.back());
+            storage_.pop_back();
+            if (!storage_.empty()) {
+                sift_down(0, std::move(last));
+            }
+            return item;
+        }
+
+        // up to n items in order to out, returns the advanced iterator
+        template <typename OUT>
+        OUT pop_n(size_t n, OUT out) {
+            while (n-- > 0 && !storage_.empty()) {
+                *out++ = pop();
+            }
+            return out;
+        }
+
+        size_t size() const {
+            return storage_.size();
+        }
+
+        bool empty() const {
+            return storage_.empty();
+        }
+
+        void reserve(size_t n) {
+            storage_.reserve(n);
+        }
+
+        void clear() {
+            storage_.clear();
+        }
+
+    protected:
+
+        void sift_up(size_t i) {
+            T item = std::move(storage_[i]);
+            while (i > 0) {
+                size_t parent = (i - 1) / D;
+                if (!compare_(item, storage_[parent]))
+                    break;
+                storage_[i] = std::move(storage_[parent]);
+                i = parent;
+            }
+            storage_[i] = std::move(item);
+        }
+
+        // item goes into the hole at i and sinks to its place
+        void sift_down(size_t i, T &&item) {
+            size_t n = storage_.size();
+            for (;;) {
+                size_t first = D * i + 1;
+                if (first >= n)
+                    break;
+
+                size_t last = first + D < n ? first + D : n;
+                size_t best = first;
+                for (size_t c = first + 1; c < last; ++c) {
+                    if (compare_(storage_[c], storage_[best])) {
+                        best = c;
+                    }
+                }
+                if (!compare_(storage_[best], item))
+                    break;
+                storage_[i] = std::move(storage_[best]);
+                i = best;
+            }
+            storage_[i] = std::move(item);
+        }
+
+        void heapify() {
+            size_t n = storage_.size();
+            if (n < 2)
+                return;
+
+            for (size_t i = (n - 2) / D + 1; i > 0; --i) {
+                T item = std::move(storage_[i - 1]);
+                sift_down(i - 1, std::move(item));
+            }
+        }
+
+        COMPARE compare_;
+        std::vector<T, ALLOC> storage_;
+    };
+}
+
+#endif //SORTSERVER_DARY_HEAP_H
@@ -0,0 +1,52 @@
+#ifndef SORTSERVER_FLOW_STATS_H
+#define SORTSERVER_FLOW_STATS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+namespace agpc {
+
+    // flow control numbers of one exchange. buffered is what is still queued for the sorter thread.
+    struct ExchangeFlowStats {
+        uint64_t received{0};
+        uint64_t buffered{0};
+        uint64_t maxBuffered{0};
+        uint64_t pauses{0};
+        uint64_t pausedNanos{0};
+    };
+
+    // the flow control numbers of every exchange, plain data like LoopStats so SortServer -W -S <prefix> can
+    // publish them in /dev/shm/<prefix>flows while it runs. written under the flow lock, readers may see a
+    // slightly torn snapshot. exchanges numbered outside 0..MAX_EXCHANGES-2 share the last slot.
+    struct FlowStats {
+        enum {
+            MAGIC = 0x41474653,
+            MAX_EXCHANGES = 1024
+        };
+
+        uint32_t magic{MAGIC};
+        uint32_t size{sizeof(FlowStats)};
+        ExchangeFlowStats exchanges[MAX_EXCHANGES];
+
+        static size_t slot(int32_t exch) {
+            return exch >= 0 && exch < MAX_EXCHANGES - 1 ? static_cast<size_t>(exch) : MAX_EXCHANGES - 1;
+        }
+
+        // exchanges that sent something
+        void print(std::ostream &os) const {
+            for (size_t i = 0; i < MAX_EXCHANGES; ++i) {
+                const ExchangeFlowStats &flow = exchanges[i];
+                if (!flow.received)
+                    continue;
+                os << "exchange " << (i < MAX_EXCHANGES - 1 ? std::to_string(i) : "other") << " values "
+                   << flow.received << " buffered " << flow.buffered << " max buffered " << flow.maxBuffered
+                   << " pauses " << flow.pauses << " paused us " << flow.pausedNanos / 1000 << "\n";
+            }
+            os.flush();
+        }
+    };
+}
+
+#endif //SORTSERVER_FLOW_STATS_H
@@ -0,0 +1,234 @@
+#ifndef SORTSERVER_LOSER_TREE_H
+#define SORTSERVER_LOSER_TREE_H
+
+#include <cstddef>
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace agpc {
+
+    // the matches of a loser tree over leaves 0..k-1, leaving the order to the caller: beats(a, b) says leaf a wins
+    // against leaf b. leaves are at positions k..2k-1, tree_[p] holds the loser of the match at internal node p,
+    // winners_[p] its winner and tree_[0] the overall winner. loser_tree and stream_merge keep their leaves in it.
+    class tournament {
+
+    public:
+        size_t winner() const {
+            return tree_[0];
+        }
+
+        // no leaves leave leaf 0 the winner, the caller has nothing to look at then
+        template <typename BEATS>
+        void build(size_t leaves, const BEATS &beats) {
+            size_t k = leaves > 0 ? leaves : 1;
+            tree_.assign(k, 0);
+            winners_.assign(k, 0);
+            for (size_t p = k - 1; p > 0; --p) {
+                play(p, beats);
+            }
+            tree_[0] = k > 1 ? winners_[1] : 0;
+        }
+
+        // the winner's key changed: one match against the stored loser per level
+        template <typename BEATS>
+        void replay(size_t i, const BEATS &beats) {
+            size_t k = tree_.size();
+            size_t w = i;
+            for (size_t p = (k + i) / 2; p > 0; p /= 2) {
+                if (beats(tree_[p], w)) {
+                    size_t tmp = tree_[p];
+                    tree_[p] = w;
+                    w = tmp;
+                }
+                winners_[p] = w;
+            }
+            tree_[0] = w;
+        }
+
+        // leaf i's key changed. unless it is the winner it may have lost anywhere on its path, so those matches
+        // are replayed from both children.
+        template <typename BEATS>
+        void update(size_t i, const BEATS &beats) {
+            if (i == tree_[0]) {
+                replay(i, beats);
+                return;
+            }
+
+            size_t k = tree_.size();
+            for (size_t p = (k + i) / 2; p > 0; p /= 2) {
+                play(p, beats);
+            }
+            tree_[0] = k > 1 ? winners_[1] : 0;
+        }
+
+    protected:
+
+        size_t winner_at(size_t pos) const {
+            size_t k = tree_.size();
+            return pos >= k ? pos - k : winners_[pos];
+        }
+
+        template <typename BEATS>
+        void play(size_t p, const BEATS &beats) {
+            size_t a = winner_at(2 * p);
+            size_t b = winner_at(2 * p + 1);
+            bool aWins = beats(a, b);
+            winners_[p] = aWins ? a : b;
+            tree_[p] = aWins ? b : a;
+        }
+
+        std::vector<size_t> tree_{0};
+        std::vector<size_t> winners_{0};
+    };
+
+    // tournament tree merging k sorted sources, compare(a, b) meaning a comes out before b as for the heaps.
+    // every internal node keeps the loser of its match, so taking the winner replays one match per level
+    // against the stored losers, without looking at siblings.
+    //
+    // each source buffers the items pushed to it, in order. a source that runs dry drops out of the merge
+    // until it is pushed to again, so refill sources before popping past them. refilling a dry source replays
+    // the matches on its path, O(log k) like a pop.
+    template <typename T, typename COMPARE = std::less<T> >
+    class loser_tree {
+
+    public:
+        explicit loser_tree(size_t sources, const COMPARE &compare = COMPARE())
+                : compare_(compare), sources_(sources) {}
+
+        void push(size_t source, const T &item) {
+            bool dry = sources_[source].empty();
+            sources_[source].items.push_back(item);
+            pushed(source, dry);
+        }
+
+        void push(size_t source, T &&item) {
+            bool dry = sources_[source].empty();
+            sources_[source].items.push_back(std::move(item));
+            pushed(source, dry);
+        }
+
+        // moves the items out of the range
+        template <typename ITER>
+        void push_range(size_t source, ITER first, ITER last) {
+            bool dry = sources_[source].empty();
+            for (; first != last; ++first) {
+                sources_[source].items.push_back(std::move(*first));
+            }
+            pushed(source, dry);
+        }
+
+        bool empty() {
+            return sources_.empty() || !live(winner());
+        }
+
+        const T &top() {
+            return sources_[winner()].head();
+        }
+
+        // the source the top item came from, e.g. to refill it
+        size_t top_source() {
+            return winner();
+        }
+
+        T pop() {
+            size_t w = winner();
+            T item = sources_[w].take();
+            matches_.replay(w, beaten_by());
+            return item;
+        }
+
+        template <typename OUT>
+        OUT pop_n(size_t n, OUT out) {
+            while (n-- > 0 && !empty()) {
+                *out++ = pop();
+            }
+            return out;
+        }
+
+        // items still buffered over all sources
+        size_t size() const {
+            size_t total = 0;
+            for (const source &src : sources_) {
+                total += src.items.size() - src.next;
+            }
+            return total;
+        }
+
+        size_t sources() const {
+            return sources_.size();
+        }
+
+    protected:
+
+        struct source {
+            std::vector<T> items;
+            size_t next{0};
+
+            bool empty() const { return next == items.size(); }
+
+            const T &head() const { return items[next]; }
+
+            // taken items are dropped once they are the larger half
+            T take() {
+                T item = std::move(items[next++]);
+                if (next == items.size()) {
+                    items.clear();
+                    next = 0;
+                } else if (next > 64 && next * 2 > items.size()) {
+                    items.erase(items.begin(), items.begin() + next);
+                    next = 0;
+                }
+                return item;
+            }
+        };
+
+        bool live(size_t i) const {
+            return !sources_[i].empty();
+        }
+
+        // dry sources lose every match
+        bool beats(size_t a, size_t b) const {
+            const source &sa = sources_[a];
+            const source &sb = sources_[b];
+            if (sa.empty())
+                return false;
+            if (sb.empty())
+                return true;
+            return compare_(sa.head(), sb.head());
+        }
+
+        // for tournament
+        struct beats_fn {
+            const loser_tree *tree;
+
+            bool operator()(size_t a, size_t b) const { return tree->beats(a, b); }
+        };
+
+        beats_fn beaten_by() const {
+            return beats_fn{this};
+        }
+
+        // only a source that was dry gets a new head
+        void pushed(size_t source, bool dry) {
+            if (dry && built_) {
+                matches_.update(source, beaten_by());
+            }
+        }
+
+        size_t winner() {
+            if (!built_) {
+                matches_.build(sources_.size(), beaten_by());
+                built_ = true;
+            }
+            return matches_.winner();
+        }
+
+        COMPARE compare_;
+        std::vector<source> sources_;
+        tournament matches_;
+        bool built_{false};
+    };
+}
+
+#endif //SORTSERVER_LOSER_TREE_H
@@ -0,0 +1,562 @@
+#ifndef SORTSERVER_MASTER_STORE_H
+#define SORTSERVER_MASTER_STORE_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "loser_tree.h"
+#include "radix_sort.h"
+
+namespace agpc {
+
+    // every value ever received, kept in dir across restarts. appends go to an mmap'd segment file whose
+    // header count is bumped after each value, so a crashed process loses nothing the kernel has. full
+    // segments are sealed and merged by a compactor thread with the master file, a header and the values
+    // ascending, into a new master that replaces the old one by rename. that waits for COMPACT_SEGMENTS of them
+    // holding an eighth of the master's values, so a large master is rewritten a bounded number of times. the master
+    // records the last segment it took in, so segments a crash left behind after the rename are dropped.
+    // compacting holds two segments' worth of values in memory, not the master's: each segment is sorted on its
+    // own and written back over itself, then all are merged straight from their mappings.
+    //
+    // opening maps the master and the surviving segments without reading them, so startup takes as long as
+    // listing the directory, however large the master.
+    class master_store {
+
+    public:
+        enum {
+            COMPACT_SEGMENTS = 4,
+            // the master and each segment start with a header of this size, the values follow
+            HEADER = 64
+        };
+
+        master_store(const std::string &dir, size_t segmentBytes) : dir_(dir) {
+            if (segmentBytes < 2 * HEADER) {
+                throw std::runtime_error("master segments below " + std::to_string(2 * HEADER) + " bytes");
+            }
+            segmentValues_ = (segmentBytes - HEADER) / sizeof(int64_t);
+            recover();
+            compactor_ = std::thread(&master_store::compact_loop, this);
+        }
+
+        ~master_store() {
+            close();
+        }
+
+        master_store(const master_store &) = delete;
+        master_store &operator=(const master_store &) = delete;
+
+        void append(int64_t value) {
+            if (!active_.values || active_.header->count == segmentValues_) {
+                roll();
+            }
+            uint64_t count = active_.header->count;
+            active_.values[count] = value;
+            __atomic_store_n(&active_.header->count, count + 1, __ATOMIC_RELEASE);
+        }
+
+        // seals the active segment and merges every segment into the master before returning
+        void close() {
+            if (!compactor_.joinable())
+                return;
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (active_.values) {
+                seal_locked();
+            }
+            stop_ = true;
+            sealedReady_.notify_one();
+            lock.unlock();
+            compactor_.join();
+
+            for (segment &s : sealed_) {
+                unmap(s);
+            }
+            sealed_.clear();
+            unmap_master();
+            if (!error_.empty()) {
+                std::cerr << "master compaction failed, segments kept: " << error_ << std::endl;
+            }
+        }
+
+        // master and segments
+        uint64_t size() {
+            std::lock_guard<std::mutex> guard(mutex_);
+            uint64_t total = master_ ? master_->count : 0;
+            for (const segment &s : sealed_) {
+                total += s.header->count;
+            }
+            return total + (active_.values ? active_.header->count : 0);
+        }
+
+        uint64_t recovered_values() const {
+            return recoveredValues_;
+        }
+
+        uint64_t recovered_segments() const {
+            return recoveredSegments_;
+        }
+
+        uint64_t compactions() const {
+            return compactions_;
+        }
+
+    protected:
+
+        static const uint64_t SEGMENT_MAGIC = 0x31474553435047ull;
+        static const uint64_t MASTER_MAGIC = 0x315254534d435047ull;
+
+        struct segment_header {
+            uint64_t magic;
+            uint64_t sequence;
+            uint64_t count;
+        };
+
+        struct master_header {
+            uint64_t magic;
+            uint64_t count;
+            // segments up to this one are in the master
+            uint64_t compacted;
+        };
+
+        struct segment {
+            segment_header *header{nullptr};
+            int64_t *values{nullptr};
+            size_t bytes{0};
+        };
+
+        std::string segment_path(uint64_t sequence) const {
+            char name[32];
+            snprintf(name, sizeof(name), "/segment-%016llu", static_cast<unsigned long long>(sequence));
+            return dir_ + name;
+        }
+
+        std::string master_path() const {
+            return dir_ + "/master";
+        }
+
+        void fail(const std::string &what, const std::string &path) const {
+            throw std::runtime_error(what + " " + path + ": " + strerror(errno));
+        }
+
+        void *map(const std::string &path, int flags, size_t &bytes) {
+            int fd = ::open(path.c_str(), flags);
+            if (fd < 0) {
+                fail("cannot open", path);
+            }
+            struct stat st;
+            if (fstat(fd, &st) < 0) {
+                ::close(fd);
+                fail("cannot stat", path);
+            }
+            bytes = st.st_size;
+            int prot = (flags & O_ACCMODE) == O_RDONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+            void *ptr = bytes ? mmap(nullptr, bytes, prot, MAP_SHARED, fd, 0) : MAP_FAILED;
+            ::close(fd);
+            if (ptr == MAP_FAILED) {
+                fail("cannot map", path);
+            }
+            return ptr;
+        }
+
+        void unmap(segment &s) {
+            if (s.header) {
+                munmap(s.header, s.bytes);
+            }
+            s = segment();
+        }
+
+        void unmap_master() {
+            if (master_) {
+                munmap(master_, masterBytes_);
+                master_ = nullptr;
+            }
+        }
+
+        void recover() {
+            if (mkdir(dir_.c_str(), 0755) < 0 && errno != EEXIST) {
+                fail("cannot create", dir_);
+            }
+            unlink((master_path() + ".tmp").c_str());
+
+            struct stat st;
+            if (stat(master_path().c_str(), &st) == 0) {
+                if (st.st_size < HEADER) {
+                    throw std::runtime_error("corrupt master file " + master_path());
+                }
+                master_ = static_cast<master_header *>(map(master_path(), O_RDONLY, masterBytes_));
+                if (master_->magic != MASTER_MAGIC ||
+                    masterBytes_ != HEADER + master_->count * sizeof(int64_t)) {
+                    throw std::runtime_error("corrupt master file " + master_path());
+                }
+                compacted_ = master_->compacted;
+            }
+
+            DIR *d = opendir(dir_.c_str());
+            if (!d) {
+                fail("cannot list", dir_);
+            }
+            std::vector<uint64_t> sequences;
+            std::vector<std::string> unsorted;
+            while (dirent *entry = readdir(d)) {
+                unsigned long long sequence;
+                if (sscanf(entry->d_name, "segment-%llu", &sequence) == 1) {
+                    sequences.push_back(sequence);
+                } else if (strncmp(entry->d_name, "sorting-", 8) == 0) {
+                    unsorted.push_back(dir_ + "/" + entry->d_name);
+                }
+            }
+            closedir(d);
+            // a segment being sorted when the process died is still there as it was
+            for (const std::string &path : unsorted) {
+                unlink(path.c_str());
+            }
+
+            // sorted, as the compactor takes segments oldest first
+            for (size_t i = 1; i < sequences.size(); ++i) {
+                uint64_t sequence = sequences[i];
+                size_t j = i;
+                while (j > 0 && sequences[j - 1] > sequence) {
+                    sequences[j] = sequences[j - 1];
+                    --j;
+                }
+                sequences[j] = sequence;
+            }
+
+            // a segment cut short while being created holds nothing yet
+            next_ = compacted_ + 1;
+            for (uint64_t sequence : sequences) {
+                std::string path = segment_path(sequence);
+                if (sequence <= compacted_ || stat(path.c_str(), &st) < 0 || st.st_size < HEADER) {
+                    unlink(path.c_str());
+                    continue;
+                }
+                segment s;
+                s.header = static_cast<segment_header *>(map(path, O_RDONLY, s.bytes));
+                s.values = reinterpret_cast<int64_t *>(reinterpret_cast<char *>(s.header) + HEADER);
+                if (s.header->magic == 0) {
+                    unmap(s);
+                    unlink(path.c_str());
+                    continue;
+                }
+                if (s.header->magic != SEGMENT_MAGIC || s.header->sequence != sequence ||
+                    s.header->count > (s.bytes - HEADER) / sizeof(int64_t)) {
+                    throw std::runtime_error("corrupt master segment " + path);
+                }
+                recoveredValues_ += s.header->count;
+                ++recoveredSegments_;
+                next_ = sequence + 1;
+                sealed_.push_back(s);
+            }
+            recoveredValues_ += master_ ? master_->count : 0;
+        }
+
+        // a fresh segment, the full one sealed for the compactor
+        void roll() {
+            std::lock_guard<std::mutex> guard(mutex_);
+            if (active_.values) {
+                seal_locked();
+            }
+
+            uint64_t sequence = next_++;
+            std::string path = segment_path(sequence);
+            size_t bytes = HEADER + segmentValues_ * sizeof(int64_t);
+            int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                fail("cannot create", path);
+            }
+            if (ftruncate(fd, bytes) < 0) {
+                ::close(fd);
+                fail("cannot size", path);
+            }
+            ::close(fd);
+
+            active_.header = static_cast<segment_header *>(map(path, O_RDWR, active_.bytes));
+            active_.values = reinterpret_cast<int64_t *>(reinterpret_cast<char *>(active_.header) + HEADER);
+            active_.header->sequence = sequence;
+            active_.header->count = 0;
+            __atomic_store_n(&active_.header->magic, SEGMENT_MAGIC, __ATOMIC_RELEASE);
+        }
+
+        void seal_locked() {
+            if (active_.header->count == 0) {
+                unlink(segment_path(active_.header->sequence).c_str());
+                unmap(active_);
+                return;
+            }
+            // the sealed values wait in the page cache, up to an eighth of the master, not in our rss
+            msync(active_.header, active_.bytes, MS_ASYNC);
+            madvise(active_.header, active_.bytes, MADV_DONTNEED);
+            sealed_.push_back(active_);
+            active_ = segment();
+            if (compact_due_locked()) {
+                sealedReady_.notify_one();
+            }
+        }
+
+        bool compact_due_locked() const {
+            if (sealed_.size() < COMPACT_SEGMENTS)
+                return false;
+            uint64_t sealed = 0;
+            for (const segment &s : sealed_) {
+                sealed += s.header->count;
+            }
+            return !master_ || sealed * 8 >= master_->count;
+        }
+
+        // merges the sealed segments, as far as sealed when it started, until a compaction fails
+        void compact_loop() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (error_.empty()) {
+                sealedReady_.wait(lock, [this]() { return stop_ || compact_due_locked(); });
+                if (sealed_.empty())
+                    return;
+
+                size_t taking = sealed_.size();
+                std::vector<segment> segments(sealed_.begin(), sealed_.begin() + taking);
+                lock.unlock();
+                std::string error;
+                try {
+                    compact(segments);
+                } catch (const std::exception &e) {
+                    error = e.what();
+                }
+                lock.lock();
+
+                if (!error.empty()) {
+                    error_ = error;
+                    return;
+                }
+                for (segment &s : segments) {
+                    unlink(segment_path(s.header->sequence).c_str());
+                    unmap(s);
+                }
+                sealed_.erase(sealed_.begin(), sealed_.begin() + taking);
+                ++compactions_;
+            }
+        }
+
+        // writes master + segments to master.tmp and renames it over the master. runs without mutex_: only
+        // the compactor replaces master_ and the segments it was handed are no longer written.
+        void compact(const std::vector<segment> &segments) {
+            std::vector<segment> sorted;
+            try {
+                std::vector<int64_t> data;
+                std::vector<int64_t> scratch;
+                for (const segment &s : segments) {
+                    sorted.push_back(sort_segment(s, data, scratch));
+                }
+                sync_dir();
+                std::vector<int64_t>().swap(data);
+                std::vector<int64_t>().swap(scratch);
+                merge(sorted, segments.back().header->sequence);
+            } catch (...) {
+                for (segment &s : sorted) {
+                    unmap(s);
+                }
+                throw;
+            }
+            for (segment &s : sorted) {
+                unmap(s);
+            }
+        }
+
+        // the segment's values ascending, in a file renamed over it: a crash leaves either version, both holding
+        // the same values. the caller's mapping still shows the old file.
+        segment sort_segment(const segment &s, std::vector<int64_t> &data, std::vector<int64_t> &scratch) {
+            uint64_t count = s.header->count;
+            data.assign(s.values, s.values + count);
+            madvise(s.header, s.bytes, MADV_DONTNEED);
+            if (scratch.size() < count) {
+                scratch.resize(count);
+            }
+            radix_sort<11>(data.data(), scratch.data(), count);
+
+            char name[32];
+            snprintf(name, sizeof(name), "/sorting-%016llu", static_cast<unsigned long long>(s.header->sequence));
+            std::string tmp = dir_ + name;
+            int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                fail("cannot create", tmp);
+            }
+            write_all(fd, reinterpret_cast<const char *>(s.header), HEADER, tmp);
+            write_all(fd, reinterpret_cast<const char *>(data.data()), count * sizeof(int64_t), tmp);
+            if (fsync(fd) < 0) {
+                ::close(fd);
+                fail("cannot sync", tmp);
+            }
+            ::close(fd);
+
+            std::string path = segment_path(s.header->sequence);
+            if (rename(tmp.c_str(), path.c_str()) < 0) {
+                fail("cannot rename", tmp);
+            }
+
+            segment out;
+            out.header = static_cast<segment_header *>(map(path, O_RDONLY, out.bytes));
+            out.values = reinterpret_cast<int64_t *>(reinterpret_cast<char *>(out.header) + HEADER);
+            return out;
+        }
+
+        // k-way merges the master and the sorted segments, a chunk of each at a time, into master.tmp. a source
+        // is refilled while it still holds the winner, so the tree only ever replays the winner's path. the pages
+        // behind each chunk are dropped from the mapping, they stay in the page cache but not in our rss.
+        void merge(const std::vector<segment> &sorted, uint64_t compacted) {
+            struct source {
+                const int64_t *next;
+                const int64_t *end;
+                // start of the pages not dropped yet
+                char *mapped;
+            };
+            std::vector<source> sources;
+            uint64_t total = 0;
+            if (master_) {
+                const int64_t *old = reinterpret_cast<const int64_t *>(reinterpret_cast<const char *>(master_) + HEADER);
+                sources.push_back(source{old, old + master_->count, reinterpret_cast<char *>(master_)});
+                total += master_->count;
+                madvise(master_, masterBytes_, MADV_SEQUENTIAL);
+            }
+            for (const segment &s : sorted) {
+                sources.push_back(source{s.values, s.values + s.header->count, reinterpret_cast<char *>(s.header)});
+                total += s.header->count;
+                madvise(s.header, s.bytes, MADV_SEQUENTIAL);
+            }
+
+            std::string tmp = master_path() + ".tmp";
+            int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                fail("cannot create", tmp);
+            }
+
+            master_header header;
+            header.magic = MASTER_MAGIC;
+            header.count = total;
+            header.compacted = compacted;
+            std::vector<char> buffer(WRITE_BUFFER);
+            memset(buffer.data(), 0, HEADER);
+            memcpy(buffer.data(), &header, sizeof(header));
+            size_t used = HEADER;
+
+            auto put = [&](int64_t value) {
+                if (used == buffer.size()) {
+                    write_all(fd, buffer.data(), used, tmp);
+                    used = 0;
+                }
+                memcpy(buffer.data() + used, &value, sizeof(value));
+                used += sizeof(value);
+            };
+
+            uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+            loser_tree<int64_t> tree(sources.size());
+            std::vector<size_t> left(sources.size());
+            auto refill = [&](size_t i) {
+                source &src = sources[i];
+                size_t n = static_cast<size_t>(src.end - src.next);
+                if (n > MERGE_CHUNK) {
+                    n = MERGE_CHUNK;
+                }
+                tree.push_range(i, src.next, src.next + n);
+                src.next += n;
+
+                char *consumed = reinterpret_cast<char *>(reinterpret_cast<uintptr_t>(src.next) & ~(page - 1));
+                if (consumed > src.mapped) {
+                    madvise(src.mapped, consumed - src.mapped, MADV_DONTNEED);
+                    src.mapped = consumed;
+                }
+                return n;
+            };
+
+            for (size_t i = 0; i < sources.size(); ++i) {
+                left[i] = refill(i);
+            }
+            while (!tree.empty()) {
+                size_t i = tree.top_source();
+                if (left[i] == 1) {
+                    left[i] += refill(i);
+                }
+                put(tree.pop());
+                --left[i];
+            }
+            write_all(fd, buffer.data(), used, tmp);
+
+            if (fsync(fd) < 0) {
+                ::close(fd);
+                fail("cannot sync", tmp);
+            }
+            ::close(fd);
+            if (rename(tmp.c_str(), master_path().c_str()) < 0) {
+                fail("cannot rename", tmp);
+            }
+            sync_dir();
+
+            size_t bytes;
+            master_header *fresh = static_cast<master_header *>(map(master_path(), O_RDONLY, bytes));
+            std::lock_guard<std::mutex> guard(mutex_);
+            unmap_master();
+            master_ = fresh;
+            masterBytes_ = bytes;
+        }
+
+        void write_all(int fd, const char *data, size_t bytes, const std::string &path) {
+            while (bytes > 0) {
+                ssize_t n = ::write(fd, data, bytes);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    ::close(fd);
+                    fail("cannot write", path);
+                }
+                data += n;
+                bytes -= n;
+            }
+        }
+
+        // the rename is only durable once the directory is
+        void sync_dir() {
+            int fd = ::open(dir_.c_str(), O_RDONLY | O_DIRECTORY);
+            if (fd >= 0) {
+                fsync(fd);
+                ::close(fd);
+            }
+        }
+
+        enum {
+            WRITE_BUFFER = 1 << 20,
+            MERGE_CHUNK = 4096
+        };
+
+        std::string dir_;
+        size_t segmentValues_;
+        // written by append only, sealed under mutex_
+        segment active_;
+        uint64_t next_{1};
+        uint64_t compacted_{0};
+        uint64_t recoveredValues_{0};
+        uint64_t recoveredSegments_{0};
+        // shared with the compactor
+        std::mutex mutex_;
+        std::condition_variable sealedReady_;
+        std::vector<segment> sealed_;
+        master_header *master_{nullptr};
+        size_t masterBytes_{0};
+        std::string error_;
+        bool stop_{false};
+        uint64_t compactions_{0};
+        std::thread compactor_;
+    };
+}
+
+#endif //SORTSERVER_MASTER_STORE_H
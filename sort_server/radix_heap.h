@@ -0,0 +1,144 @@
+#ifndef SORTSERVER_RADIX_HEAP_H
+#define SORTSERVER_RADIX_HEAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+namespace agpc {
+
+    // maps an integer to an unsigned key that increases in the order compare pops items
+    template <typename T, typename COMPARE>
+    struct radix_key;
+
+    template <typename T>
+    struct radix_key<T, std::less<T> > {
+        static uint64_t of(T item) {
+            uint64_t key = static_cast<uint64_t>(item);
+            return std::is_signed<T>::value ? key ^ (uint64_t(1) << (sizeof(T) * 8 - 1)) : key;
+        }
+    };
+
+    template <typename T>
+    struct radix_key<T, std::greater<T> > {
+        static uint64_t of(T item) {
+            return ~radix_key<T, std::less<T> >::of(item);
+        }
+    };
+
+    // monotone priority queue of integers: nothing pushed may come out before the last item popped, which
+    // holds for merging sorted streams and for pushing everything before the first pop. bucket b holds the
+    // items whose key first differs from the last popped key in bit b - 1, so each item moves to lower
+    // buckets at most 64 times over its life and a pop is amortised O(1) with no comparisons in between.
+    template <typename T, typename COMPARE = std::less<T>, typename ALLOC = std::allocator<T> >
+    class radix_heap {
+
+    public:
+        static_assert(std::is_integral<T>::value && sizeof(T) <= 8, "radix heaps order 64 bit integers");
+
+        radix_heap() : buckets_(BUCKETS) {}
+
+        // every bucket allocates from a copy of alloc
+        explicit radix_heap(const ALLOC &alloc) : buckets_(BUCKETS, std::vector<T, ALLOC>(alloc)) {}
+
+        void push(T item) {
+            uint64_t key = radix_key<T, COMPARE>::of(item);
+            if (key < last_) {
+                throw std::runtime_error("radix heap push before the last pop");
+            }
+            buckets_[bucket(key)].push_back(item);
+            ++size_;
+        }
+
+        template <typename ITER>
+        void push_range(ITER first, ITER last) {
+            for (; first != last; ++first) {
+                push(*first);
+            }
+        }
+
+        T top() {
+            refill();
+            return buckets_[0].back();
+        }
+
+        T pop() {
+            refill();
+            T item = buckets_[0].back();
+            buckets_[0].pop_back();
+            --size_;
+            return item;
+        }
+
+        template <typename OUT>
+        OUT pop_n(size_t n, OUT out) {
+            while (n > 0 && size_ > 0) {
+                refill();
+                std::vector<T, ALLOC> &ready = buckets_[0];
+                while (n > 0 && !ready.empty()) {
+                    *out++ = ready.back();
+                    ready.pop_back();
+                    --size_;
+                    --n;
+                }
+            }
+            return out;
+        }
+
+        size_t size() const {
+            return size_;
+        }
+
+        bool empty() const {
+            return size_ == 0;
+        }
+
+    protected:
+
+        enum {
+            BUCKETS = 65
+        };
+
+        size_t bucket(uint64_t key) const {
+            return key == last_ ? 0 : 64 - __builtin_clzll(key ^ last_);
+        }
+
+        // bucket 0 holds items equal to the last pop. when it is empty the lowest non empty bucket's smallest
+        // key becomes the new last and its items spread over lower buckets, at least one of them into 0.
+        void refill() {
+            if (!buckets_[0].empty())
+                return;
+
+            size_t b = 1;
+            while (buckets_[b].empty()) {
+                ++b;
+            }
+
+            std::vector<T, ALLOC> &from = buckets_[b];
+            uint64_t least = std::numeric_limits<uint64_t>::max();
+            for (T item : from) {
+                uint64_t key = radix_key<T, COMPARE>::of(item);
+                if (key < least) {
+                    least = key;
+                }
+            }
+
+            last_ = least;
+            for (T item : from) {
+                buckets_[bucket(radix_key<T, COMPARE>::of(item))].push_back(item);
+            }
+            from.clear();
+        }
+
+        std::vector<std::vector<T, ALLOC> > buckets_;
+        uint64_t last_{0};
+        size_t size_{0};
+    };
+}
+
+#endif //SORTSERVER_RADIX_HEAP_H
@@ -0,0 +1,230 @@
+#ifndef SORTSERVER_RADIX_SORT_H
+#define SORTSERVER_RADIX_SORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace agpc {
+
+    // LSD radix sort of int64 values in BITS bit digits, ascending. the sign bit is flipped when a digit is
+    // taken, so negative values sort below positive ones without a fix up pass.
+    //
+    // one read of the input counts every digit's histogram. passes whose digit is the same for all values
+    // are skipped, which for small ranges (the exchanges' 1..1000) leaves one or two of them. with COMBINE
+    // values are scattered through a 64 byte write combining line per bucket, so each bucket's output is
+    // written a whole line at a time; that pays where scattered stores miss the TLB, and only while the
+    // lines fit in cache (BITS <= 11). HeapBench measures both.
+    template <unsigned BITS>
+    struct radix_digits {
+        enum {
+            BUCKETS = 1u << BITS,
+            MASK = BUCKETS - 1,
+            PASSES = (64 + BITS - 1) / BITS,
+            LINE = 64 / sizeof(int64_t),
+            PREFETCH = 64
+        };
+
+        static unsigned digit(int64_t value, unsigned pass) {
+            uint64_t key = static_cast<uint64_t>(value) ^ (uint64_t(1) << 63);
+            return static_cast<unsigned>((key >> (pass * BITS)) & MASK);
+        }
+    };
+
+    // one pass worth of scattering src[begin, end) to dst at the running offsets
+    template <unsigned BITS, bool COMBINE>
+    class radix_scatter {
+
+    public:
+        typedef radix_digits<BITS> digits;
+
+        radix_scatter() : lines_(COMBINE ? digits::BUCKETS * digits::LINE : 0),
+                          fill_(COMBINE ? digits::BUCKETS : 0) {}
+
+        void run(const int64_t *src, size_t begin, size_t end, int64_t *dst, size_t *offsets, unsigned pass) {
+            if (!COMBINE) {
+                for (size_t i = begin; i < end; ++i) {
+                    __builtin_prefetch(src + i + digits::PREFETCH);
+                    dst[offsets[digits::digit(src[i], pass)]++] = src[i];
+                }
+                return;
+            }
+
+            for (size_t i = begin; i < end; ++i) {
+                __builtin_prefetch(src + i + digits::PREFETCH);
+                unsigned d = digits::digit(src[i], pass);
+                int64_t *line = &lines_[d * digits::LINE];
+                line[fill_[d]++] = src[i];
+                if (fill_[d] == digits::LINE) {
+                    memcpy(dst + offsets[d], line, sizeof(int64_t) * digits::LINE);
+                    offsets[d] += digits::LINE;
+                    fill_[d] = 0;
+                }
+            }
+            for (unsigned d = 0; d < digits::BUCKETS; ++d) {
+                if (fill_[d]) {
+                    memcpy(dst + offsets[d], &lines_[d * digits::LINE], sizeof(int64_t) * fill_[d]);
+                    offsets[d] += fill_[d];
+                    fill_[d] = 0;
+                }
+            }
+        }
+
+    protected:
+
+        std::vector<int64_t> lines_;
+        std::vector<unsigned char> fill_;
+    };
+
+    // sorts data[0, n) using scratch[0, n)
+    template <unsigned BITS, bool COMBINE = false>
+    void radix_sort(int64_t *data, int64_t *scratch, size_t n) {
+        typedef radix_digits<BITS> digits;
+        if (n < 2)
+            return;
+
+        std::vector<size_t> counts(digits::PASSES * digits::BUCKETS, 0);
+        for (size_t i = 0; i < n; ++i) {
+            __builtin_prefetch(data + i + digits::PREFETCH);
+            for (unsigned pass = 0; pass < digits::PASSES; ++pass) {
+                ++counts[pass * digits::BUCKETS + digits::digit(data[i], pass)];
+            }
+        }
+
+        radix_scatter<BITS, COMBINE> scatter;
+        std::vector<size_t> offsets(digits::BUCKETS);
+        int64_t *src = data;
+        int64_t *dst = scratch;
+        for (unsigned pass = 0; pass < digits::PASSES; ++pass) {
+            const size_t *count = &counts[pass * digits::BUCKETS];
+            if (count[digits::digit(src[0], pass)] == n)
+                continue;
+
+            size_t sum = 0;
+            for (unsigned d = 0; d < digits::BUCKETS; ++d) {
+                offsets[d] = sum;
+                sum += count[d];
+            }
+            scatter.run(src, 0, n, dst, offsets.data(), pass);
+
+            int64_t *tmp = src;
+            src = dst;
+            dst = tmp;
+        }
+
+        if (src != data) {
+            memcpy(data, src, n * sizeof(int64_t));
+        }
+    }
+
+    // reusable rendezvous for a fixed number of threads
+    class sort_barrier {
+
+    public:
+        explicit sort_barrier(unsigned threads) : threads_(threads) {}
+
+        void wait() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            uint64_t generation = generation_;
+            if (++arrived_ == threads_) {
+                arrived_ = 0;
+                ++generation_;
+                cv_.notify_all();
+                return;
+            }
+            cv_.wait(lock, [this, generation]() { return generation_ != generation; });
+        }
+
+    protected:
+
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        unsigned threads_;
+        unsigned arrived_{0};
+        uint64_t generation_{0};
+    };
+
+    // the same sort split over threads: per pass every thread counts its slice, thread 0 turns the counts
+    // into per thread offsets (bucket major, so the output stays stable) and every thread scatters its slice.
+    // the caller is thread 0. below PARALLEL_MIN values per thread the plain sort is used.
+    template <unsigned BITS, bool COMBINE = false>
+    void parallel_radix_sort(int64_t *data, int64_t *scratch, size_t n, unsigned threads) {
+        typedef radix_digits<BITS> digits;
+        const size_t PARALLEL_MIN = 1 << 16;
+        if (threads <= 1 || n < threads * PARALLEL_MIN) {
+            radix_sort<BITS, COMBINE>(data, scratch, n);
+            return;
+        }
+
+        size_t slice = (n + threads - 1) / threads;
+        std::vector<size_t> counts(threads * digits::BUCKETS);
+        std::vector<size_t> offsets(threads * digits::BUCKETS);
+        std::vector<char> skip(digits::PASSES);
+        sort_barrier barrier(threads);
+
+        auto work = [&](unsigned t) {
+            size_t begin = t * slice < n ? t * slice : n;
+            size_t end = begin + slice < n ? begin + slice : n;
+            radix_scatter<BITS, COMBINE> scatter;
+            int64_t *src = data;
+            int64_t *dst = scratch;
+
+            for (unsigned pass = 0; pass < digits::PASSES; ++pass) {
+                size_t *count = &counts[t * digits::BUCKETS];
+                memset(count, 0, digits::BUCKETS * sizeof(size_t));
+                for (size_t i = begin; i < end; ++i) {
+                    __builtin_prefetch(src + i + digits::PREFETCH);
+                    ++count[digits::digit(src[i], pass)];
+                }
+                barrier.wait();
+
+                if (t == 0) {
+                    size_t sum = 0;
+                    size_t widest = 0;
+                    for (unsigned d = 0; d < digits::BUCKETS; ++d) {
+                        size_t bucket = 0;
+                        for (unsigned u = 0; u < threads; ++u) {
+                            offsets[u * digits::BUCKETS + d] = sum;
+                            sum += counts[u * digits::BUCKETS + d];
+                            bucket += counts[u * digits::BUCKETS + d];
+                        }
+                        if (bucket > widest) {
+                            widest = bucket;
+                        }
+                    }
+                    skip[pass] = widest == n;
+                }
+                barrier.wait();
+
+                if (skip[pass])
+                    continue;
+
+                scatter.run(src, begin, end, dst, &offsets[t * digits::BUCKETS], pass);
+                barrier.wait();
+
+                int64_t *tmp = src;
+                src = dst;
+                dst = tmp;
+            }
+
+            if (src != data) {
+                memcpy(data + begin, src + begin, (end - begin) * sizeof(int64_t));
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (unsigned t = 1; t < threads; ++t) {
+            workers.push_back(std::thread(work, t));
+        }
+        work(0);
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+    }
+}
+
+#endif //SORTSERVER_RADIX_SORT_H
@@ -0,0 +1,78 @@
+#ifndef SORTSERVER_RING_BUFFER_H
+#define SORTSERVER_RING_BUFFER_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace agpc {
+
+    // fifo over a power of two number of slots, doubling when full. item i counts from the oldest one.
+    // clear() only resets the positions, the slots keep their items until they are pushed over.
+    template <typename T>
+    class ring_buffer {
+
+    public:
+        explicit ring_buffer(size_t capacity = 16) : slots_(round_up(capacity)) {}
+
+        void push_back(T &&item) {
+            if (size_ == slots_.size()) {
+                grow();
+            }
+            slots_[(head_ + size_) & (slots_.size() - 1)] = std::move(item);
+            ++size_;
+        }
+
+        T &operator[](size_t i) {
+            return slots_[(head_ + i) & (slots_.size() - 1)];
+        }
+
+        const T &operator[](size_t i) const {
+            return slots_[(head_ + i) & (slots_.size() - 1)];
+        }
+
+        bool empty() const {
+            return size_ == 0;
+        }
+
+        size_t size() const {
+            return size_;
+        }
+
+        void clear() {
+            head_ = 0;
+            size_ = 0;
+        }
+
+        void swap(ring_buffer &other) {
+            slots_.swap(other.slots_);
+            std::swap(head_, other.head_);
+            std::swap(size_, other.size_);
+        }
+
+    protected:
+
+        void grow() {
+            std::vector<T> slots(slots_.size() * 2);
+            for (size_t i = 0; i < size_; ++i) {
+                slots[i] = std::move((*this)[i]);
+            }
+            slots_.swap(slots);
+            head_ = 0;
+        }
+
+        static size_t round_up(size_t n) {
+            size_t capacity = 1;
+            while (capacity < n) {
+                capacity *= 2;
+            }
+            return capacity;
+        }
+
+        std::vector<T> slots_;
+        size_t head_{0};
+        size_t size_{0};
+    };
+}
+
+#endif //SORTSERVER_RING_BUFFER_H
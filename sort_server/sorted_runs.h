@@ -0,0 +1,177 @@
+#ifndef SORTSERVER_SORTED_RUNS_H
+#define SORTSERVER_SORTED_RUNS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+#include "radix_sort.h"
+
+namespace agpc {
+
+    // a small LSM of sorted runs. inserts are appended to an unsorted tail; taking the delta sorts just that
+    // tail, hands it out and files it as the newest run. runs merge while the older one is at most twice the
+    // size of the newer, so there are O(log n) of them and every value is merged O(log n) times overall.
+    // a flush therefore costs the sort of what is new, not of everything held. int64 tails of RADIX_MIN
+    // values or more are radix sorted, on several threads if set; smaller ones and other types merge sorted.
+    template <typename T>
+    class sorted_runs {
+
+    public:
+        sorted_runs() {}
+
+        void set_sort_threads(unsigned threads) {
+            sort_threads_ = threads ? threads : 1;
+        }
+
+        void insert(T item) {
+            tail_.push_back(item);
+        }
+
+        bool has_delta() const {
+            return !tail_.empty();
+        }
+
+        // values inserted since the last call, handed to out largest first, returns how many
+        template <typename OUT>
+        size_t take_delta(OUT &&out) {
+            if (tail_.empty())
+                return 0;
+
+            std::vector<T> run;
+            run.swap(tail_);
+            sort_run(run, std::is_same<T, int64_t>());
+            for (size_t i = run.size(); i > 0; --i) {
+                out(run[i - 1]);
+            }
+
+            size_t count = run.size();
+            runs_.push_back(std::move(run));
+            while (runs_.size() > 1 && runs_[runs_.size() - 2].size() <= 2 * runs_.back().size()) {
+                std::vector<T> merged;
+                merge(runs_[runs_.size() - 2], runs_.back(), merged);
+                runs_.pop_back();
+                runs_.back().swap(merged);
+            }
+            return count;
+        }
+
+        // everything taken so far as one run, handed to out largest first
+        template <typename OUT>
+        void snapshot(OUT &&out) {
+            while (runs_.size() > 1) {
+                std::vector<T> merged;
+                merge(runs_[runs_.size() - 2], runs_.back(), merged);
+                runs_.pop_back();
+                runs_.back().swap(merged);
+            }
+            if (runs_.empty())
+                return;
+
+            const std::vector<T> &all = runs_.back();
+            for (size_t i = all.size(); i > 0; --i) {
+                out(all[i - 1]);
+            }
+        }
+
+        size_t size() const {
+            size_t total = tail_.size();
+            for (const std::vector<T> &run : runs_) {
+                total += run.size();
+            }
+            return total;
+        }
+
+        size_t runs() const {
+            return runs_.size();
+        }
+
+    protected:
+
+        enum {
+            INSERTION_RUN = 16,
+            RADIX_MIN = 256
+        };
+
+        void sort_run(std::vector<T> &run, std::true_type) {
+            if (run.size() < RADIX_MIN) {
+                sort(run);
+                return;
+            }
+            std::vector<int64_t> scratch(run.size());
+            parallel_radix_sort<11>(run.data(), scratch.data(), run.size(), sort_threads_);
+        }
+
+        void sort_run(std::vector<T> &run, std::false_type) {
+            sort(run);
+        }
+
+        static void merge(const std::vector<T> &a, const std::vector<T> &b, std::vector<T> &out) {
+            out.resize(a.size() + b.size());
+            merge(a.data(), a.size(), b.data(), b.size(), out.data());
+        }
+
+        static void merge(const T *a, size_t na, const T *b, size_t nb, T *out) {
+            size_t i = 0;
+            size_t j = 0;
+            size_t k = 0;
+            while (i < na && j < nb) {
+                if (b[j] < a[i]) {
+                    out[k++] = b[j++];
+                } else {
+                    out[k++] = a[i++];
+                }
+            }
+            while (i < na) {
+                out[k++] = a[i++];
+            }
+            while (j < nb) {
+                out[k++] = b[j++];
+            }
+        }
+
+        // bottom up merge sort over insertion sorted blocks, ping ponging between run and a scratch copy
+        static void sort(std::vector<T> &run) {
+            size_t n = run.size();
+            for (size_t lo = 0; lo < n; lo += INSERTION_RUN) {
+                size_t hi = lo + INSERTION_RUN < n ? lo + INSERTION_RUN : n;
+                for (size_t i = lo + 1; i < hi; ++i) {
+                    T item = run[i];
+                    size_t j = i;
+                    while (j > lo && item < run[j - 1]) {
+                        run[j] = run[j - 1];
+                        --j;
+                    }
+                    run[j] = item;
+                }
+            }
+            if (n <= INSERTION_RUN)
+                return;
+
+            std::vector<T> scratch(n);
+            T *src = run.data();
+            T *dst = scratch.data();
+            for (size_t width = INSERTION_RUN; width < n; width *= 2) {
+                for (size_t lo = 0; lo < n; lo += 2 * width) {
+                    size_t mid = lo + width < n ? lo + width : n;
+                    size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+                    merge(src + lo, mid - lo, src + mid, hi - mid, dst + lo);
+                }
+                T *tmp = src;
+                src = dst;
+                dst = tmp;
+            }
+            if (src != run.data()) {
+                run.swap(scratch);
+            }
+        }
+
+        // the newest values, not sorted yet
+        std::vector<T> tail_;
+        // oldest (largest) first
+        std::vector<std::vector<T> > runs_;
+        unsigned sort_threads_{1};
+    };
+}
+
+#endif //SORTSERVER_SORTED_RUNS_H
@@ -0,0 +1,552 @@
+#ifndef SORTSERVER_SPILL_RUNS_H
+#define SORTSERVER_SPILL_RUNS_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "loser_tree.h"
+#include "radix_sort.h"
+
+namespace agpc {
+
+    // a run file is a sequence of BYTES sized blocks, each decodable on its own: the payload end and value
+    // count, then the first value zigzag encoded and the steps down to each following value, all as LEB128
+    // varints. runs are stored largest first, so every step is non negative, and dense data such as the
+    // exchanges' takes about a byte per value.
+    class spill_block {
+
+    public:
+        enum {
+            BYTES = 1 << 16,
+            HEADER = 8,
+            MAX_VARINT = 10
+        };
+
+        // page aligned, as O_DIRECT wants
+        spill_block() {
+            void *ptr = mmap(nullptr, BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ptr == MAP_FAILED) {
+                throw std::runtime_error(std::string("spill block mmap failed: ") + strerror(errno));
+            }
+            data_ = static_cast<unsigned char *>(ptr);
+        }
+
+        ~spill_block() {
+            munmap(data_, BYTES);
+        }
+
+        spill_block(const spill_block &) = delete;
+        spill_block &operator=(const spill_block &) = delete;
+
+        unsigned char *data() {
+            return data_;
+        }
+
+        static uint64_t zigzag(int64_t value) {
+            return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+        }
+
+        static int64_t unzigzag(uint64_t key) {
+            return static_cast<int64_t>((key >> 1) ^ (~(key & 1) + 1));
+        }
+
+    protected:
+
+        unsigned char *data_;
+    };
+
+    struct spill_run {
+        int fd{-1};
+        uint64_t blocks{0};
+        uint64_t values{0};
+    };
+
+    // encodes a run, largest value first, into block and writes it out a block at a time
+    class spill_writer {
+
+    public:
+        spill_writer(int fd, spill_block &block) : block_(block.data()) {
+            run_.fd = fd;
+        }
+
+        void put(int64_t value) {
+            if (count_ == 0) {
+                varint(spill_block::zigzag(value));
+            } else {
+                varint(static_cast<uint64_t>(prev_) - static_cast<uint64_t>(value));
+            }
+            prev_ = value;
+            ++count_;
+            ++run_.values;
+            if (pos_ > spill_block::BYTES - spill_block::MAX_VARINT) {
+                write_block();
+            }
+        }
+
+        spill_run close() {
+            if (count_) {
+                write_block();
+            }
+            return run_;
+        }
+
+    protected:
+
+        void varint(uint64_t key) {
+            while (key >= 0x80) {
+                block_[pos_++] = static_cast<unsigned char>(key | 0x80);
+                key >>= 7;
+            }
+            block_[pos_++] = static_cast<unsigned char>(key);
+        }
+
+        void write_block() {
+            uint32_t end = static_cast<uint32_t>(pos_);
+            memcpy(block_, &end, sizeof(end));
+            memcpy(block_ + sizeof(end), &count_, sizeof(count_));
+
+            off_t offset = static_cast<off_t>(run_.blocks * spill_block::BYTES);
+            size_t written = 0;
+            while (written < spill_block::BYTES) {
+                ssize_t n = pwrite(run_.fd, block_ + written, spill_block::BYTES - written, offset + written);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    throw std::runtime_error(std::string("spill write failed: ") + strerror(errno));
+                }
+                written += n;
+            }
+
+            ++run_.blocks;
+            pos_ = spill_block::HEADER;
+            count_ = 0;
+        }
+
+        unsigned char *block_;
+        spill_run run_;
+        size_t pos_{spill_block::HEADER};
+        uint32_t count_{0};
+        int64_t prev_{0};
+    };
+
+    // one run being merged: cur is decoded while the reader thread fills next with the following block
+    struct spill_cursor {
+        explicit spill_cursor(const spill_run &r) : run(r) {}
+
+        // appends up to max values. when cur runs out, fetch must swap() in the next block.
+        template <typename FETCH>
+        void decode(size_t max, std::vector<int64_t> &chunk, FETCH &&fetch) {
+            while (max > 0) {
+                if (left == 0) {
+                    if (block == run.blocks)
+                        return;
+                    fetch();
+                    continue;
+                }
+
+                uint64_t key = 0;
+                unsigned shift = 0;
+                unsigned char byte;
+                do {
+                    byte = cur->data()[pos++];
+                    key |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                    shift += 7;
+                } while (byte & 0x80);
+
+                prev = first ? spill_block::unzigzag(key) : static_cast<int64_t>(static_cast<uint64_t>(prev) - key);
+                first = false;
+                chunk.push_back(prev);
+                --left;
+                --max;
+            }
+        }
+
+        // next holds block, the one after cur
+        void swap() {
+            std::swap(cur, next);
+            uint32_t count;
+            memcpy(&count, cur->data() + sizeof(uint32_t), sizeof(count));
+            left = count;
+            pos = spill_block::HEADER;
+            first = true;
+            ++block;
+            ready = false;
+        }
+
+        spill_run run;
+        std::unique_ptr<spill_block> cur{new spill_block()};
+        std::unique_ptr<spill_block> next{new spill_block()};
+        // the run's block next holds or is being read into
+        uint64_t block{0};
+        bool ready{false};
+        size_t pos{0};
+        uint32_t left{0};
+        bool first{true};
+        int64_t prev{0};
+    };
+
+    // reads requested cursors' next blocks ahead of the merge
+    class spill_reader {
+
+    public:
+        explicit spill_reader(std::vector<std::unique_ptr<spill_cursor> > &cursors)
+                : cursors_(cursors), thread_(&spill_reader::read_loop, this) {}
+
+        ~spill_reader() {
+            {
+                std::lock_guard<std::mutex> guard(mutex_);
+                stop_ = true;
+            }
+            requested_.notify_one();
+            thread_.join();
+        }
+
+        void request(size_t i) {
+            {
+                std::lock_guard<std::mutex> guard(mutex_);
+                queue_.push_back(i);
+            }
+            requested_.notify_one();
+        }
+
+        void wait(size_t i) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            read_.wait(lock, [this, i]() { return cursors_[i]->ready || !error_.empty(); });
+            if (!error_.empty()) {
+                throw std::runtime_error(error_);
+            }
+        }
+
+    protected:
+
+        void read_loop() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (true) {
+                requested_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+                if (stop_)
+                    return;
+
+                spill_cursor &c = *cursors_[queue_.front()];
+                queue_.pop_front();
+                lock.unlock();
+                std::string error = read_block(c);
+                lock.lock();
+                c.ready = error.empty();
+                error_ = error;
+                read_.notify_all();
+            }
+        }
+
+        static std::string read_block(spill_cursor &c) {
+            off_t offset = static_cast<off_t>(c.block * spill_block::BYTES);
+            size_t done = 0;
+            while (done < spill_block::BYTES) {
+                ssize_t n = pread(c.run.fd, c.next->data() + done, spill_block::BYTES - done, offset + done);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return std::string("spill read failed: ") + (n < 0 ? strerror(errno) : "short file");
+                done += n;
+            }
+            return std::string();
+        }
+
+        std::vector<std::unique_ptr<spill_cursor> > &cursors_;
+        std::mutex mutex_;
+        std::condition_variable requested_;
+        std::condition_variable read_;
+        std::deque<size_t> queue_;
+        std::string error_;
+        bool stop_{false};
+        std::thread thread_;
+    };
+
+    // sorts int64 values within a memory budget. inserts fill an in memory run; a full run is radix sorted and
+    // handed to a writer thread, which spills it to an unlinked file in dir while the next one fills. draining
+    // k-way merges the runs largest first, with a reader thread fetching each run's next block ahead of the
+    // merge. runs, sort scratch and the run being written take 3/4 of the budget; when merging, each run takes
+    // two blocks and a decoded chunk, and more runs than fit are merged in groups first.
+    class spill_runs {
+
+    public:
+        spill_runs(size_t budget, const std::string &dir, unsigned sortThreads)
+                : dir_(dir), sortThreads_(sortThreads ? sortThreads : 1), runValues_(budget / 32),
+                  fanIn_(budget / (4 * spill_block::BYTES)) {
+            if (fanIn_ < 4) {
+                throw std::runtime_error("spill budget below " + std::to_string(16 * spill_block::BYTES >> 10) + "KB");
+            }
+            tail_.reserve(runValues_);
+            writer_ = std::thread(&spill_runs::write_loop, this);
+        }
+
+        ~spill_runs() {
+            {
+                std::lock_guard<std::mutex> guard(mutex_);
+                stop_ = true;
+            }
+            ready_.notify_one();
+            writer_.join();
+            for (const spill_run &run : runs_) {
+                ::close(run.fd);
+            }
+        }
+
+        spill_runs(const spill_runs &) = delete;
+        spill_runs &operator=(const spill_runs &) = delete;
+
+        void insert(int64_t value) {
+            tail_.push_back(value);
+            if (tail_.size() == runValues_) {
+                spill();
+            }
+        }
+
+        // everything inserted, handed to out largest first. leaves the runs empty.
+        template <typename OUT>
+        void drain(OUT &&out) {
+            wait_idle();
+            if (runs_.empty()) {
+                sort_tail();
+                for (size_t i = tail_.size(); i > 0; --i) {
+                    out(tail_[i - 1]);
+                }
+                tail_.clear();
+                return;
+            }
+
+            if (!tail_.empty()) {
+                spill();
+                wait_idle();
+            }
+            std::vector<int64_t>().swap(tail_);
+            std::vector<int64_t>().swap(scratch_);
+            std::vector<int64_t>().swap(writing_);
+
+            spill_block block;
+            while (runs_.size() > fanIn_) {
+                std::vector<spill_run> group(runs_.begin(), runs_.begin() + fanIn_);
+                runs_.erase(runs_.begin(), runs_.begin() + fanIn_);
+                int fd = open_run();
+                try {
+                    spill_writer writer(fd, block);
+                    merge(group, [&writer](int64_t value) { writer.put(value); });
+                    runs_.push_back(writer.close());
+                } catch (...) {
+                    ::close(fd);
+                    throw;
+                }
+                ++merges_;
+            }
+
+            std::vector<spill_run> all;
+            all.swap(runs_);
+            merge(all, out);
+        }
+
+        uint64_t spilled_runs() const {
+            return spilledRuns_;
+        }
+
+        uint64_t spilled_bytes() const {
+            return spilledBytes_;
+        }
+
+        // group merges needed to keep the final merge within the budget
+        uint64_t merges() const {
+            return merges_;
+        }
+
+    protected:
+
+        enum {
+            CHUNK = spill_block::BYTES / sizeof(int64_t)
+        };
+
+        void sort_tail() {
+            if (scratch_.size() < tail_.size()) {
+                scratch_.resize(runValues_ > tail_.size() ? runValues_ : tail_.size());
+            }
+            parallel_radix_sort<11>(tail_.data(), scratch_.data(), tail_.size(), sortThreads_);
+        }
+
+        // one run in flight: a full tail waits for the previous run to be written out
+        void spill() {
+            sort_tail();
+            std::unique_lock<std::mutex> lock(mutex_);
+            idle_.wait(lock, [this]() { return writing_.empty(); });
+            if (!error_.empty()) {
+                throw std::runtime_error(error_);
+            }
+            writing_.swap(tail_);
+            lock.unlock();
+            ready_.notify_one();
+            tail_.reserve(runValues_);
+        }
+
+        void wait_idle() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            idle_.wait(lock, [this]() { return writing_.empty(); });
+            if (!error_.empty()) {
+                throw std::runtime_error(error_);
+            }
+        }
+
+        void write_loop() {
+            spill_block block;
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (true) {
+                ready_.wait(lock, [this]() { return stop_ || !writing_.empty(); });
+                if (writing_.empty())
+                    return;
+
+                lock.unlock();
+                std::string error;
+                spill_run run;
+                int fd = -1;
+                try {
+                    fd = open_run();
+                    spill_writer writer(fd, block);
+                    for (size_t i = writing_.size(); i > 0; --i) {
+                        writer.put(writing_[i - 1]);
+                    }
+                    run = writer.close();
+                } catch (const std::exception &e) {
+                    // the file is unlinked already, closing it gives its space back
+                    error = e.what();
+                    if (fd >= 0) {
+                        ::close(fd);
+                    }
+                }
+                lock.lock();
+
+                if (error.empty()) {
+                    runs_.push_back(run);
+                    ++spilledRuns_;
+                    spilledBytes_ += run.blocks * spill_block::BYTES;
+                } else {
+                    error_ = error;
+                }
+                writing_.clear();
+                idle_.notify_all();
+            }
+        }
+
+        // unlinked straight away, so the runs go with the process. page cache copies would only be evicted
+        // again, so the blocks bypass it where the filesystem allows.
+        int open_run() {
+            std::string path = dir_ + "/sortserver-run-XXXXXX";
+            std::vector<char> name(path.begin(), path.end());
+            name.push_back('\0');
+            int fd = mkstemp(name.data());
+            if (fd < 0) {
+                throw std::runtime_error("cannot create spill file in " + dir_ + ": " + strerror(errno));
+            }
+            unlink(name.data());
+
+            int flags = fcntl(fd, F_GETFL);
+            if (fcntl(fd, F_SETFL, flags | O_DIRECT) < 0) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            }
+            return fd;
+        }
+
+        // merges and closes runs, failing or not. a source is refilled while it still holds the winner, so the
+        // tree only ever replays the winner's path.
+        template <typename OUT>
+        void merge(const std::vector<spill_run> &runs, OUT &&out) {
+            try {
+                merge_open(runs, out);
+            } catch (...) {
+                close_runs(runs);
+                throw;
+            }
+            close_runs(runs);
+        }
+
+        static void close_runs(const std::vector<spill_run> &runs) {
+            for (const spill_run &run : runs) {
+                ::close(run.fd);
+            }
+        }
+
+        template <typename OUT>
+        void merge_open(const std::vector<spill_run> &runs, OUT &&out) {
+            size_t k = runs.size();
+            std::vector<std::unique_ptr<spill_cursor> > cursors;
+            for (const spill_run &run : runs) {
+                cursors.push_back(std::unique_ptr<spill_cursor>(new spill_cursor(run)));
+            }
+
+            spill_reader reader(cursors);
+            loser_tree<int64_t, std::greater<int64_t> > tree(k);
+            std::vector<size_t> left(k);
+            std::vector<int64_t> chunk;
+            chunk.reserve(CHUNK);
+
+            auto refill = [&](size_t s) {
+                spill_cursor &c = *cursors[s];
+                chunk.clear();
+                c.decode(CHUNK, chunk, [&]() {
+                    reader.wait(s);
+                    c.swap();
+                    if (c.block < c.run.blocks) {
+                        reader.request(s);
+                    }
+                });
+                tree.push_range(s, chunk.begin(), chunk.end());
+                return chunk.size();
+            };
+
+            for (size_t s = 0; s < k; ++s) {
+                reader.request(s);
+            }
+            for (size_t s = 0; s < k; ++s) {
+                left[s] = refill(s);
+            }
+
+            while (!tree.empty()) {
+                size_t s = tree.top_source();
+                if (left[s] == 1) {
+                    left[s] += refill(s);
+                }
+                out(tree.pop());
+                --left[s];
+            }
+        }
+
+        std::string dir_;
+        unsigned sortThreads_;
+        size_t runValues_;
+        size_t fanIn_;
+        // filling
+        std::vector<int64_t> tail_;
+        std::vector<int64_t> scratch_;
+        // shared with the writer thread under mutex_: the sorted run it is writing, empty when idle
+        std::mutex mutex_;
+        std::condition_variable ready_;
+        std::condition_variable idle_;
+        std::vector<int64_t> writing_;
+        std::vector<spill_run> runs_;
+        std::string error_;
+        bool stop_{false};
+        uint64_t spilledRuns_{0};
+        uint64_t spilledBytes_{0};
+        uint64_t merges_{0};
+        std::thread writer_;
+    };
+}
+
+#endif //SORTSERVER_SPILL_RUNS_H
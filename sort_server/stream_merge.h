@@ -0,0 +1,157 @@
+#ifndef SORTSERVER_STREAM_MERGE_H
+#define SORTSERVER_STREAM_MERGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <map>
+#include <vector>
+#include "loser_tree.h"
+
+namespace agpc {
+
+    // k way merge of ascending per exchange streams as they arrive. each exchange has a queue of values not
+    // yet emitted and a watermark, the largest value it sent. a value is emitted once no active exchange can
+    // still send anything smaller: it is at most every queue's head and every empty queue's watermark.
+    // a loser tree (tournament) over the exchanges picks the next value, so each one costs O(log exchanges).
+    //
+    // exchanges join on their first value. a value below its exchange's watermark breaks the stream's order,
+    // it is counted and merged from where it was queued.
+    template <typename T>
+    class stream_merge {
+
+    public:
+        stream_merge() {}
+
+        void push(int32_t exch, T value) {
+            size_t i = source_of(exch);
+            source &src = sources_[i];
+            if (src.seen && value < src.watermark) {
+                ++out_of_order_;
+            }
+
+            bool was_empty = src.queue.empty();
+            src.queue.push_back(value);
+            if (!src.seen || value > src.watermark) {
+                src.watermark = value;
+            }
+            src.seen = true;
+            if (was_empty) {
+                matches_.update(i, beaten_by());
+            }
+        }
+
+        // no more values from exch, its queue drains without waiting for it
+        void finish(int32_t exch) {
+            size_t i = source_of(exch);
+            sources_[i].finished = true;
+            matches_.update(i, beaten_by());
+        }
+
+        // e.g. on shutdown, when exchanges that dropped without finishing will not come back
+        void finish_all() {
+            for (source &src : sources_) {
+                src.finished = true;
+            }
+            matches_.build(sources_.size(), beaten_by());
+        }
+
+        // hands every value that is final to out in ascending order, returns how many
+        template <typename OUT>
+        size_t drain(OUT &&out) {
+            size_t emitted = 0;
+            while (!sources_.empty()) {
+                // an empty queue winning means the smallest candidate is a watermark or everything is done
+                size_t winner = matches_.winner();
+                source &src = sources_[winner];
+                if (src.queue.empty())
+                    break;
+
+                out(src.queue.front());
+                src.queue.pop_front();
+                ++emitted;
+                matches_.replay(winner, beaten_by());
+            }
+            return emitted;
+        }
+
+        size_t exchanges() const {
+            return sources_.size();
+        }
+
+        uint64_t out_of_order() const {
+            return out_of_order_;
+        }
+
+    protected:
+
+        enum {
+            READY = 0,
+            BLOCKED = 1,
+            DONE = 2
+        };
+
+        struct source {
+            std::deque<T> queue;
+            T watermark{};
+            bool seen{false};
+            bool finished{false};
+        };
+
+        struct key {
+            T value;
+            int state;
+        };
+
+        // the head of a queue, an empty queue's watermark (nothing larger may pass it) or past the end
+        key key_of(size_t i) const {
+            const source &src = sources_[i];
+            if (!src.queue.empty())
+                return key{src.queue.front(), READY};
+            if (src.finished)
+                return key{std::numeric_limits<T>::max(), DONE};
+            return key{src.watermark, BLOCKED};
+        }
+
+        // a watermark lets an equal value through, the exchange can only send more of the same
+        bool less(size_t a, size_t b) const {
+            key ka = key_of(a);
+            key kb = key_of(b);
+            if (ka.value != kb.value)
+                return ka.value < kb.value;
+            if (ka.state != kb.state)
+                return ka.state < kb.state;
+            return a < b;
+        }
+
+        size_t source_of(int32_t exch) {
+            std::map<int32_t, size_t>::iterator it = index_.find(exch);
+            if (it != index_.end())
+                return it->second;
+
+            size_t i = sources_.size();
+            index_[exch] = i;
+            sources_.push_back(source());
+            matches_.build(sources_.size(), beaten_by());
+            return i;
+        }
+
+        struct beats_fn {
+            const stream_merge *merge;
+
+            bool operator()(size_t a, size_t b) const { return merge->less(a, b); }
+        };
+
+        beats_fn beaten_by() const {
+            return beats_fn{this};
+        }
+
+        std::vector<source> sources_;
+        std::map<int32_t, size_t> index_;
+        tournament matches_;
+        uint64_t out_of_order_{0};
+    };
+}
+
+#endif //SORTSERVER_STREAM_MERGE_H
@@ -0,0 +1,40 @@
+#include <thread>
+#include <chrono>
+#include "../socklib/LoopStats.h"
+#include "../sort_server/flow_stats.h"
+
+// prints the loop stats a running SortServer -S <prefix> publishes in /dev/shm, or with -W its per exchange flow
+// control stats in <prefix>flows, optionally every N seconds
+
+using namespace agpc;
+
+template<typename STATS>
+void dump(const std::string &name, int interval) {
+    SharedRegion<STATS> region;
+    const STATS *stats = region.open(name);
+
+    for (;;) {
+        // copy first so a single dump is not spread over a long stretch of concurrent updates
+        STATS snapshot(*stats);
+        snapshot.print(std::cout);
+
+        if (interval <= 0)
+            break;
+        std::cout << std::endl;
+        std::this_thread::sleep_for(std::chrono::seconds(interval));
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 3) {
+        throw std::runtime_error("usage : ./StatsDump <shm_name> [interval_sec]");
+    }
+
+    int interval = argc > 2 ? std::stoi(argv[2]) : 0;
+
+    if (sharedRegionMagic(argv[1]) == FlowStats::MAGIC) {
+        dump<FlowStats>(argv[1], interval);
+    } else {
+        dump<LoopStats>(argv[1], interval);
+    }
+}